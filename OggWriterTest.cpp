@@ -0,0 +1,110 @@
+//
+// Ogg页封装的测试
+//
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "glog/logging.h"
+#include "server_base/audio_buffer.h"
+#include "server_base/ogg_writer.h"
+
+using namespace WL::Service::Base;
+
+// 逐位计算的Ogg CRC32，和OggPageWriter中查表的实现相互独立
+static uint32_t referenceCrc(const uint8_t* data, size_t size) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= uint32_t(data[i]) << 24;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04c11db7u : crc << 1;
+    }
+    return crc;
+}
+
+static uint32_t readLE32(const uint8_t* data) {
+    return uint32_t(data[0]) | uint32_t(data[1]) << 8 | uint32_t(data[2]) << 16 | uint32_t(data[3]) << 24;
+}
+
+// 页中记录的CRC和去掉CRC之后重新计算的结果一致
+static void checkPageCrc(const uint8_t* page, size_t size) {
+    CHECK_GE(size, 27u);
+    std::vector<uint8_t> copy(page, page + size);
+    memset(copy.data() + 22, 0, 4);
+    CHECK_EQ(readLE32(page + 22), referenceCrc(copy.data(), copy.size()));
+}
+
+// 已知的页：serial为0x12345678，bos，granule为0，只有一个19 byte的OpusHead
+static void testKnownPage() {
+    // 多项式0x04c11db7、初值0、不反转、结果不异或时"123456789"的CRC
+    const char* check = "123456789";
+    CHECK_EQ(referenceCrc((const uint8_t*) check, strlen(check)), 0x89a1897fu);
+
+    const uint8_t head[] = {
+        0x4f, 0x70, 0x75, 0x73, 0x48, 0x65, 0x61, 0x64, 0x01, 0x01,
+        0x38, 0x01, 0x80, 0x3e, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    const uint8_t expected[] = {
+        0x4f, 0x67, 0x67, 0x53, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x78, 0x56, 0x34, 0x12, 0x00, 0x00,
+        0x00, 0x00, 0x76, 0x13, 0x83, 0x69, 0x01, 0x13, 0x4f, 0x70,
+        0x75, 0x73, 0x48, 0x65, 0x61, 0x64, 0x01, 0x01, 0x38, 0x01,
+        0x80, 0x3e, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    OggPageWriter writer(0x12345678);
+    AudioBuffer out;
+    CHECK(writer.addPacket(head, sizeof(head), 0, out));
+    CHECK(writer.flush(out, true));
+    CHECK_EQ(out.size(), sizeof(expected));
+    CHECK_EQ(memcmp(out.data(), expected, sizeof(expected)), 0);
+}
+
+// 超过255个lacing值时拆分成多页，页序号递增，每一页的CRC都正确，eos页没有packet
+static void testPaging() {
+    OggPageWriter writer(7);
+    AudioBuffer out;
+    // 每个packet长度为1000，需要4个lacing值，64个packet超过一页
+    std::vector<uint8_t> packet(1000);
+    for (int i = 0; i < 64; i++) {
+        memset(packet.data(), i, packet.size());
+        CHECK(writer.addPacket(packet.data(), packet.size(), int64_t(i + 1) * 960, out));
+    }
+    CHECK(writer.flush(out));
+    CHECK(writer.flush(out, false, true));
+
+    size_t offset = 0;
+    uint32_t sequence = 0;
+    size_t packets = 0;
+    while (offset < out.size()) {
+        const uint8_t* page = out.data() + offset;
+        CHECK_EQ(memcmp(page, "OggS", 4), 0);
+        CHECK_EQ(readLE32(page + 14), 7u);
+        CHECK_EQ(readLE32(page + 18), sequence);
+        size_t segments = page[26];
+        size_t body = 0;
+        for (size_t i = 0; i < segments; i++) {
+            body += page[27 + i];
+            if (page[27 + i] < 255)
+                packets++;
+        }
+        size_t size = 27 + segments + body;
+        checkPageCrc(page, size);
+        offset += size;
+        sequence++;
+    }
+    CHECK_EQ(offset, out.size());
+    CHECK_EQ(packets, 64u);
+    // 两页数据加上一个空的eos页
+    CHECK_EQ(sequence, 3u);
+    CHECK_EQ(out.data()[out.size() - 27 + 5] & 0x04, 0x04);
+}
+
+int main(int argc, char* argv[]) {
+    google::InitGoogleLogging(argv[0]);
+
+    testKnownPage();
+    testPaging();
+
+    LOG(INFO) << "OggWriterTest passed";
+    return 0;
+}
@@ -0,0 +1,177 @@
+//
+// 变速、变调和重采样的行为测试
+//
+
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "glog/logging.h"
+#include "server_base/parallel_stretch.h"
+#include "server_base/pitch_shift.h"
+#include "server_base/resampler.h"
+#include "server_base/silence_stretch.h"
+#include "server_base/stretcher.h"
+
+using namespace WL::Service::Base;
+
+static const int kSampleRate = 16000;
+
+// 16k单声道s16的正弦波
+static std::vector<int16_t> makeSine(double frequency, double seconds, double amplitude = 0.5) {
+    std::vector<int16_t> samples(size_t(seconds * kSampleRate));
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = int16_t(std::lround(32767.0 * amplitude * std::sin(2.0 * M_PI * frequency * double(i) / kSampleRate)));
+    }
+    return samples;
+}
+
+// 去掉开头和结尾各10%之后，按照上升过零点的间隔估计频率
+static double estimateFrequency(const std::vector<int16_t>& samples) {
+    size_t begin = samples.size() / 10;
+    size_t end = samples.size() - samples.size() / 10;
+    double first = -1.0;
+    double last = -1.0;
+    int crossings = 0;
+    for (size_t i = begin + 1; i < end; i++) {
+        if (samples[i - 1] < 0 && samples[i] >= 0) {
+            // 线性插值得到过零点的位置
+            double position = double(i - 1) + double(-samples[i - 1]) / double(samples[i] - samples[i - 1]);
+            if (first < 0.0)
+                first = position;
+            else
+                crossings++;
+            last = position;
+        }
+    }
+    CHECK_GT(crossings, 0);
+    return double(crossings) * kSampleRate / (last - first);
+}
+
+static std::vector<int16_t> toSamples(void* data, size_t size) {
+    std::vector<int16_t> samples((const int16_t*) data, (const int16_t*) data + size / sizeof(int16_t));
+    free(data);
+    return samples;
+}
+
+static std::vector<int16_t> stretch(AudioStretcher& stretcher, const std::vector<int16_t>& input) {
+    void* destData = nullptr;
+    size_t destSize = 0;
+    CHECK(stretchBuffer(stretcher, input.data(), input.size() * sizeof(int16_t), &destData, destSize));
+    return toSamples(destData, destSize);
+}
+
+// 每个引擎的输出长度约为输入长度 / tempo，并且音调不变
+static void testEngineLengthAndPitch() {
+    const std::vector<int16_t> input = makeSine(440.0, 2.0);
+    const char* engines[] = { "atempo", "wsola", "vocoder" };
+    const float tempos[] = { 0.5f, 0.8f, 1.25f, 2.0f };
+    for (const char* engine : engines) {
+        for (float tempo : tempos) {
+            std::unique_ptr<AudioStretcher> stretcher = createStretcher(engine, tempo);
+            CHECK(stretcher && stretcher->valid()) << engine;
+            std::vector<int16_t> output = stretch(*stretcher, input);
+            double expected = double(input.size()) / tempo;
+            // 允许相差20ms
+            CHECK_LE(std::fabs(double(output.size()) - expected), kSampleRate * 0.02)
+                    << engine << " tempo " << tempo << " size " << output.size() << " expected " << expected;
+            double frequency = estimateFrequency(output);
+            CHECK_LE(std::fabs(frequency - 440.0), 440.0 * 0.01)
+                    << engine << " tempo " << tempo << " frequency " << frequency;
+            LOG(INFO) << engine << " tempo " << tempo << " size " << output.size() << " frequency " << frequency;
+        }
+    }
+}
+
+// 直流信号经过重采样之后不变，开头和结尾按照静音处理，只检查中间部分
+static void testResamplerDC() {
+    const double ratios[] = { 0.5, 0.8, 1.0, 1.25, 2.0 };
+    for (double ratio : ratios) {
+        Resampler resampler(ratio);
+        std::vector<float> input(kSampleRate, 0.5f);
+        resampler.push(input.data(), input.size());
+        resampler.finish();
+        std::vector<float> output;
+        size_t frames = resampler.pull(output);
+        CHECK_EQ(frames, output.size());
+        CHECK_LE(std::fabs(double(frames) - double(input.size()) / ratio), 1.0) << "ratio " << ratio;
+        auto margin = size_t(std::ceil(double(resampler.latency()) / ratio)) + 1;
+        for (size_t i = margin; i + margin < output.size(); i++) {
+            CHECK_LE(std::fabs(output[i] - 0.5f), 0.005f) << "ratio " << ratio << " index " << i << " value " << output[i];
+        }
+    }
+}
+
+// 变调之后时长不变，频率按照2^(cents/1200)变化
+static void testPitchShift() {
+    const std::vector<int16_t> input = makeSine(440.0, 2.0);
+    const float cents[] = { -700.0f, 300.0f, 1200.0f };
+    for (float c : cents) {
+        PitchShiftStretcher stretcher("wsola", 1.0f, c);
+        CHECK(stretcher.valid());
+        std::vector<int16_t> output = stretch(stretcher, input);
+        CHECK_LE(std::fabs(double(output.size()) - double(input.size())), kSampleRate * 0.02)
+                << "cents " << c << " size " << output.size();
+        double expected = 440.0 * std::pow(2.0, c / 1200.0);
+        double frequency = estimateFrequency(output);
+        CHECK_LE(std::fabs(frequency - expected), expected * 0.01) << "cents " << c << " frequency " << frequency;
+    }
+}
+
+// 跳过静音时总长度仍然约为输入长度 / tempo，静音部分仍然是静音
+static void testSilenceAwareStretch() {
+    std::vector<int16_t> input = makeSine(440.0, 1.0);
+    input.resize(input.size() * 2, 0);
+    std::vector<int16_t> tail = makeSine(440.0, 1.0);
+    input.insert(input.end(), tail.begin(), tail.end());
+    const float tempos[] = { 0.5f, 2.0f };
+    for (float tempo : tempos) {
+        SilenceAwareStretcher stretcher(createStretcher("wsola", tempo));
+        CHECK(stretcher.valid());
+        std::vector<int16_t> output = stretch(stretcher, input);
+        double expected = double(input.size()) / tempo;
+        CHECK_LE(std::fabs(double(output.size()) - expected), kSampleRate * 0.02)
+                << "tempo " << tempo << " size " << output.size();
+        // 静音的中间部分，前后各留100ms给过渡
+        auto begin = size_t((1.0 / tempo + 0.1) * kSampleRate);
+        auto end = size_t((2.0 / tempo - 0.1) * kSampleRate);
+        for (size_t i = begin; i < end; i++) {
+            CHECK_EQ(output[i], 0) << "tempo " << tempo << " index " << i;
+        }
+    }
+}
+
+// 多线程变速的长度和整段变速一致，每个分界点最多相差10ms
+static void testParallelStretch() {
+    setStretchThreads(4);
+    const std::vector<int16_t> input = makeSine(440.0, 35.0);
+    size_t size = input.size() * sizeof(int16_t);
+    CHECK(useParallelStretch(size));
+    const float tempos[] = { 0.8f, 1.25f };
+    for (float tempo : tempos) {
+        void* destData = nullptr;
+        size_t destSize = 0;
+        CHECK(parallelTimeStretch("wsola", input.data(), size, &destData, destSize, tempo));
+        std::vector<int16_t> parallel = toSamples(destData, destSize);
+        std::unique_ptr<AudioStretcher> stretcher = createStretcher("wsola", tempo);
+        std::vector<int16_t> serial = stretch(*stretcher, input);
+        // 35秒按照10秒拆分，3个分界点
+        CHECK_LE(std::fabs(double(parallel.size()) - double(serial.size())), 3 * kSampleRate * 0.01)
+                << "tempo " << tempo << " parallel " << parallel.size() << " serial " << serial.size();
+        double frequency = estimateFrequency(parallel);
+        CHECK_LE(std::fabs(frequency - 440.0), 440.0 * 0.01) << "tempo " << tempo << " frequency " << frequency;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    google::InitGoogleLogging(argv[0]);
+
+    testEngineLengthAndPitch();
+    testResamplerDC();
+    testPitchShift();
+    testSilenceAwareStretch();
+    testParallelStretch();
+
+    LOG(INFO) << "StretchEngineTest passed";
+    return 0;
+}
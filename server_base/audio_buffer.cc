@@ -0,0 +1,80 @@
+#include "glog/logging.h"
+#include "server_base/audio_buffer.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace WL::Service::Base {
+
+// 第一次分配的最小容量
+static const size_t kMinCapacity = 4096;
+
+AudioBuffer::AudioBuffer(size_t capacity) {
+    if (capacity > 0)
+        reserve(capacity);
+}
+
+AudioBuffer::~AudioBuffer() {
+    free(data_);
+}
+
+bool AudioBuffer::reserve(size_t capacity) {
+    if (failed_)
+        return false;
+    if (capacity <= capacity_)
+        return true;
+    auto* data = (uint8_t*) realloc(data_, capacity);
+    if (!data) {
+        LOG(ERROR) << "Error allocating buffer, capacity " << capacity;
+        failed_ = true;
+        return false;
+    }
+    data_ = data;
+    capacity_ = capacity;
+    return true;
+}
+
+bool AudioBuffer::append(const void* data, size_t size) {
+    if (size == 0)
+        return !failed_;
+    if (size_ + size > capacity_) {
+        size_t capacity = std::max({ size_ + size, capacity_ * 2, kMinCapacity });
+        if (!reserve(capacity))
+            return false;
+    }
+    memcpy(data_ + size_, data, size);
+    size_ += size;
+    return true;
+}
+
+SampleSink AudioBuffer::sink() {
+    return [this](const uint8_t* data, size_t size) {
+        append(data, size);
+    };
+}
+
+void* AudioBuffer::release(size_t& size) {
+    size = 0;
+    if (failed_)
+        return nullptr;
+    void* data;
+    if (size_ == 0) {
+        // malloc(0)可能返回nullptr，没有数据时分配1 byte
+        free(data_);
+        data = malloc(1);
+    } else if (size_ < capacity_) {
+        data = realloc(data_, size_);
+        // 收缩失败时原来的内存仍然有效
+        if (!data)
+            data = data_;
+    } else {
+        data = data_;
+    }
+    size = size_;
+    data_ = nullptr;
+    size_ = 0;
+    capacity_ = 0;
+    return data;
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef SERVICE_BASE_AUDIO_BUFFER_H_
+#define SERVICE_BASE_AUDIO_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 可以增长的输出缓存，用于接收长度事先不确定的音频数据
+ *
+ * 容量不足时按照2倍realloc，新增的部分不清零。数据写完之后调用release，
+ * 缓存会收缩到准确的大小并交给调用者，返回的指针可以直接free
+ */
+class AudioBuffer {
+public:
+    explicit AudioBuffer(size_t capacity = 0);
+    AudioBuffer(const AudioBuffer&) = delete;
+    AudioBuffer& operator=(const AudioBuffer&) = delete;
+    ~AudioBuffer();
+
+    /**
+     * 保证容量至少为capacity，已有的数据不变
+     *
+     * @return 内存分配失败时返回false
+     */
+    bool reserve(size_t capacity);
+
+    /**
+     * 在末尾追加数据
+     *
+     * @return 内存分配失败时返回false，之后的追加都会失败
+     */
+    bool append(const void* data, size_t size);
+
+    // 返回接收数据的回调，追加到末尾
+    SampleSink sink();
+
+    /**
+     * 交出缓存，收缩到准确的大小，之后缓存为空
+     *
+     * @param size [out] 数据大小，byte为单位
+     * @return 需要调用者free的内存，没有数据时也返回可以free的指针，分配失败时返回nullptr
+     */
+    void* release(size_t& size);
+
+    // 清空数据，保留容量
+    void clear() { size_ = 0; }
+
+    uint8_t* data() { return data_; }
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    // 是否出现过内存分配失败
+    bool failed() const { return failed_; }
+
+private:
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    bool failed_ = false;
+};
+
+}
+#endif
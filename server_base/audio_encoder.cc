@@ -0,0 +1,407 @@
+#include "glog/logging.h"
+#include "server_base/audio_encoder.h"
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+namespace WL::Service::Base {
+
+// 编码数据的封装
+enum class EncoderContainer {
+    // packet直接拼接，可以有固定的文件头
+    Plain,
+    // 文件头之后是STREAMINFO
+    Flac,
+    // Ogg页，每次encode之后输出一页
+    Ogg,
+    // 每个packet之前是2字节大端的长度
+    LengthPrefixed
+};
+
+struct EncoderFormat {
+    const char* filetype;
+    const char* codec;
+    AVCodecID codecId;
+    int sampleRate;
+    int64_t bitRate;
+    int compressionLevel;
+    EncoderContainer container;
+    // Plain封装在编码数据之前的文件头
+    const char* magic;
+    // 编码器的私有参数，格式为"key=value:key=value"
+    const char* options;
+};
+
+// 和fill_filetype_encoding、get_filetype_rate的参数相同
+// opus使用20ms的帧和voip模式，延迟和码率都比mp3低得多
+static const EncoderFormat kFormats[] = {
+    { "mp3", "libmp3lame", AV_CODEC_ID_MP3, 16000, 32000, FF_COMPRESSION_DEFAULT, EncoderContainer::Plain, "", "" },
+    { "flac", "flac", AV_CODEC_ID_FLAC, 16000, 0, 6, EncoderContainer::Flac, "fLaC", "" },
+    { "amr-nb", "libopencore_amrnb", AV_CODEC_ID_AMR_NB, 8000, 12200, FF_COMPRESSION_DEFAULT, EncoderContainer::Plain, "#!AMR\n", "" },
+    { "opus", "libopus", AV_CODEC_ID_OPUS, 16000, 12000, FF_COMPRESSION_DEFAULT, EncoderContainer::Ogg, "",
+      "frame_duration=20:application=voip" },
+    { "opus-raw", "libopus", AV_CODEC_ID_OPUS, 16000, 12000, FF_COMPRESSION_DEFAULT, EncoderContainer::LengthPrefixed, "",
+      "frame_duration=20:application=voip" },
+};
+
+// Ogg Opus的granule position按照48kHz计算(RFC 7845)
+static const int kOpusGranuleRate = 48000;
+// OpusHead中pre-skip的位置
+static const int kOpusHeadPreSkip = 10;
+static const int kOpusHeadSize = 19;
+
+// STREAMINFO元数据块的长度
+static const int kFlacStreamInfoSize = 34;
+
+// 按照优先顺序选择编码器支持的采样格式
+static const AVSampleFormat kSampleFormats[] = {
+    AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S32P,
+};
+
+static std::string lowercase(const std::string& text) {
+    std::string result = text;
+    std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+static const EncoderFormat* findFormat(const std::string& filetype) {
+    std::string name = lowercase(filetype);
+    for (const auto& format : kFormats) {
+        if (name == format.filetype)
+            return &format;
+    }
+    return nullptr;
+}
+
+static AVSampleFormat chooseSampleFormat(const AVCodec* codec) {
+    if (codec->sample_fmts == nullptr)
+        return AV_SAMPLE_FMT_S16;
+    for (AVSampleFormat preferred : kSampleFormats) {
+        for (const AVSampleFormat* fmt = codec->sample_fmts; *fmt != AV_SAMPLE_FMT_NONE; fmt++) {
+            if (*fmt == preferred)
+                return preferred;
+        }
+    }
+    return AV_SAMPLE_FMT_NONE;
+}
+
+bool AudioEncoder::supports(const std::string& filetype) {
+    return findFormat(filetype) != nullptr;
+}
+
+std::unique_ptr<AudioEncoder> AudioEncoder::create(const std::string& filetype) {
+    const EncoderFormat* format = findFormat(filetype);
+    if (format == nullptr)
+        return nullptr;
+    const AVCodec* codec = avcodec_find_encoder_by_name(format->codec);
+    if (codec == nullptr)
+        codec = avcodec_find_encoder(format->codecId);
+    if (codec == nullptr) {
+        LOG(WARNING) << "Could not find encoder " << format->codec << " for " << filetype;
+        return nullptr;
+    }
+    std::unique_ptr<AudioEncoder> encoder(new AudioEncoder(lowercase(filetype), *format, codec));
+    if (!encoder->open())
+        return nullptr;
+    return encoder;
+}
+
+AudioEncoder::AudioEncoder(const std::string& filetype, const EncoderFormat& format, const AVCodec* codec)
+        : filetype_(filetype), format_(format), codec_(codec) {}
+
+AudioEncoder::~AudioEncoder() {
+    if (context_)
+        avcodec_free_context(&context_);
+    if (frame_)
+        av_frame_free(&frame_);
+    if (packet_)
+        av_packet_free(&packet_);
+}
+
+int AudioEncoder::sampleRate() const {
+    return format_.sampleRate;
+}
+
+bool AudioEncoder::open() {
+    if (context_)
+        avcodec_free_context(&context_);
+    sampleFormat_ = chooseSampleFormat(codec_);
+    if (sampleFormat_ == AV_SAMPLE_FMT_NONE) {
+        LOG(ERROR) << "Encoder " << codec_->name << " has no supported sample format";
+        return false;
+    }
+    context_ = avcodec_alloc_context3(codec_);
+    if (!context_) {
+        LOG(ERROR) << "Could not allocate encoder context " << codec_->name;
+        return false;
+    }
+    context_->sample_fmt = sampleFormat_;
+    context_->sample_rate = format_.sampleRate;
+    context_->channel_layout = AV_CH_LAYOUT_MONO;
+    context_->channels = 1;
+    if (format_.bitRate > 0)
+        context_->bit_rate = format_.bitRate;
+    if (format_.compressionLevel != FF_COMPRESSION_DEFAULT)
+        context_->compression_level = format_.compressionLevel;
+    AVDictionary* options = nullptr;
+    if (*format_.options != '\0')
+        av_dict_parse_string(&options, format_.options, "=", ":", 0);
+    int ret = avcodec_open2(context_, codec_, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        LOG(ERROR) << "Could not open encoder " << codec_->name << ", error " << ret;
+        avcodec_free_context(&context_);
+        return false;
+    }
+
+    int frameSize = context_->frame_size > 0 ? context_->frame_size : kDefaultFrameSize;
+    if (!frame_ || frameSize != frameSize_) {
+        if (frame_)
+            av_frame_free(&frame_);
+        frame_ = av_frame_alloc();
+        if (!frame_)
+            return false;
+        frame_->format = sampleFormat_;
+        frame_->channel_layout = AV_CH_LAYOUT_MONO;
+        frame_->channels = 1;
+        frame_->sample_rate = format_.sampleRate;
+        frame_->nb_samples = frameSize;
+        if (av_frame_get_buffer(frame_, 0) < 0) {
+            LOG(ERROR) << "Could not allocate encoder frame";
+            av_frame_free(&frame_);
+            return false;
+        }
+        frameSize_ = frameSize;
+    }
+    if (!packet_)
+        packet_ = av_packet_alloc();
+    pending_.reserve(frameSize_);
+    return packet_ != nullptr;
+}
+
+// OpusHead(RFC 7845 5.1)，编码器没有给出时按照单声道生成
+static std::vector<uint8_t> opusHead(const AVCodecContext* context, int sampleRate) {
+    if (context->extradata != nullptr && context->extradata_size >= kOpusHeadSize)
+        return std::vector<uint8_t>(context->extradata, context->extradata + context->extradata_size);
+    std::vector<uint8_t> head(kOpusHeadSize, 0);
+    memcpy(head.data(), "OpusHead", 8);
+    head[8] = 1;
+    head[9] = 1;
+    int preSkip = context->initial_padding * kOpusGranuleRate / sampleRate;
+    head[10] = uint8_t(preSkip);
+    head[11] = uint8_t(preSkip >> 8);
+    head[12] = uint8_t(sampleRate);
+    head[13] = uint8_t(sampleRate >> 8);
+    head[14] = uint8_t(sampleRate >> 16);
+    head[15] = uint8_t(sampleRate >> 24);
+    return head;
+}
+
+// 只有vendor，没有注释的OpusTags
+static std::vector<uint8_t> opusTags() {
+    static const char kVendor[] = "libavcodec";
+    std::vector<uint8_t> tags(8 + 4 + sizeof(kVendor) - 1 + 4, 0);
+    memcpy(tags.data(), "OpusTags", 8);
+    tags[8] = uint8_t(sizeof(kVendor) - 1);
+    memcpy(tags.data() + 12, kVendor, sizeof(kVendor) - 1);
+    return tags;
+}
+
+bool AudioEncoder::begin(AudioBuffer& out) {
+    headerBuffer_ = &out;
+    headerOffset_ = out.size();
+    if (!out.append(format_.magic, strlen(format_.magic)))
+        return false;
+    if (format_.container == EncoderContainer::Ogg) {
+        // OpusHead和OpusTags各占一页，之后是音频
+        static std::atomic<uint32_t> nextSerial(1);
+        std::vector<uint8_t> head = opusHead(context_, format_.sampleRate);
+        std::vector<uint8_t> tags = opusTags();
+        preSkip_ = head[kOpusHeadPreSkip] | (head[kOpusHeadPreSkip + 1] << 8);
+        packetSamples_ = 0;
+        ogg_.reset(nextSerial++);
+        return ogg_.addPacket(head.data(), head.size(), 0, out) && ogg_.flush(out, true)
+               && ogg_.addPacket(tags.data(), tags.size(), 0, out) && ogg_.flush(out);
+    }
+    if (format_.container == EncoderContainer::Flac) {
+        if (context_->extradata_size < kFlacStreamInfoSize) {
+            LOG(ERROR) << "Missing flac STREAMINFO";
+            return false;
+        }
+        // 最后一个元数据块，类型0(STREAMINFO)，长度34
+        const uint8_t blockHeader[4] = { 0x80, 0, 0, kFlacStreamInfoSize };
+        if (!out.append(blockHeader, sizeof(blockHeader)) || !out.append(context_->extradata, kFlacStreamInfoSize))
+            return false;
+    }
+    return true;
+}
+
+bool AudioEncoder::encode(const int16_t* samples, size_t count, AudioBuffer& out) {
+    // 先补齐上一次剩下的不完整的帧
+    if (!pending_.empty()) {
+        size_t fill = std::min(count, size_t(frameSize_) - pending_.size());
+        pending_.insert(pending_.end(), samples, samples + fill);
+        samples += fill;
+        count -= fill;
+        if (pending_.size() < size_t(frameSize_))
+            return true;
+        if (!sendFrame(pending_.data(), pending_.size(), out))
+            return false;
+        pending_.clear();
+    }
+    while (count >= size_t(frameSize_)) {
+        if (!sendFrame(samples, frameSize_, out))
+            return false;
+        samples += frameSize_;
+        count -= frameSize_;
+    }
+    pending_.assign(samples, samples + count);
+    // 流式输出时每个分片的编码结果都是完整的页
+    if (format_.container == EncoderContainer::Ogg)
+        return ogg_.flush(out);
+    return true;
+}
+
+bool AudioEncoder::finish(AudioBuffer& out) {
+    if (!pending_.empty()) {
+        // 不支持较短的最后一帧时补静音
+        if (!(codec_->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE))) {
+            size_t valid = pending_.size();
+            pending_.resize(frameSize_, 0);
+            if (!sendFrame(pending_.data(), pending_.size(), out))
+                return false;
+            samples_ -= int64_t(frameSize_ - valid);
+        } else if (!sendFrame(pending_.data(), pending_.size(), out)) {
+            return false;
+        }
+        pending_.clear();
+    }
+    if (!sendFrame(nullptr, 0, out))
+        return false;
+    if (format_.container == EncoderContainer::Ogg) {
+        // 最后一页的granule position去掉补齐最后一帧的静音
+        int64_t end = preSkip_ + samples_ * kOpusGranuleRate / format_.sampleRate;
+        ogg_.setGranule(std::min(packetSamples_ * kOpusGranuleRate / format_.sampleRate, end));
+        return ogg_.flush(out, false, true);
+    }
+    return true;
+}
+
+bool AudioEncoder::reset() {
+    pending_.clear();
+    samples_ = 0;
+    headerBuffer_ = nullptr;
+    headerOffset_ = 0;
+    if (codec_->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) {
+        avcodec_flush_buffers(context_);
+        return true;
+    }
+    return open();
+}
+
+bool AudioEncoder::sendFrame(const int16_t* samples, size_t count, AudioBuffer& out) {
+    int ret;
+    if (samples == nullptr) {
+        ret = avcodec_send_frame(context_, nullptr);
+    } else {
+        if (av_frame_make_writable(frame_) < 0)
+            return false;
+        frame_->nb_samples = int(count);
+        frame_->pts = samples_;
+        // 单声道的平面和交错格式相同
+        switch (sampleFormat_) {
+            case AV_SAMPLE_FMT_S16:
+            case AV_SAMPLE_FMT_S16P:
+                memcpy(frame_->data[0], samples, count * sizeof(int16_t));
+                break;
+            case AV_SAMPLE_FMT_FLT:
+            case AV_SAMPLE_FMT_FLTP:
+                s16ToFloat(samples, (float*) frame_->data[0], count);
+                break;
+            default: {
+                auto* dest = (int32_t*) frame_->data[0];
+                for (size_t i = 0; i < count; i++)
+                    dest[i] = int32_t(samples[i]) << 16;
+                break;
+            }
+        }
+        samples_ += int64_t(count);
+        ret = avcodec_send_frame(context_, frame_);
+    }
+    if (ret < 0) {
+        LOG(ERROR) << "avcodec_send_frame failed, encoder " << codec_->name << ", error " << ret;
+        return false;
+    }
+    return receivePackets(out);
+}
+
+bool AudioEncoder::receivePackets(AudioBuffer& out) {
+    while (true) {
+        int ret = avcodec_receive_packet(context_, packet_);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return true;
+        if (ret < 0) {
+            LOG(ERROR) << "avcodec_receive_packet failed, encoder " << codec_->name << ", error " << ret;
+            return false;
+        }
+        bool ok = true;
+        if (format_.container == EncoderContainer::Ogg) {
+            packetSamples_ += packet_->duration > 0 ? packet_->duration : frameSize_;
+            ok = ogg_.addPacket(packet_->data, packet_->size, packetSamples_ * kOpusGranuleRate / format_.sampleRate, out);
+        } else if (format_.container == EncoderContainer::LengthPrefixed) {
+            const uint8_t length[2] = { uint8_t(packet_->size >> 8), uint8_t(packet_->size) };
+            ok = out.append(length, sizeof(length)) && out.append(packet_->data, packet_->size);
+        } else {
+            ok = out.append(packet_->data, packet_->size);
+        }
+        // flac冲刷时给出最终的STREAMINFO，包含总采样数和MD5
+        int extradataSize = 0;
+        uint8_t* extradata = av_packet_get_side_data(packet_, AV_PKT_DATA_NEW_EXTRADATA, &extradataSize);
+        if (format_.container == EncoderContainer::Flac && extradata != nullptr && extradataSize >= kFlacStreamInfoSize
+            && headerBuffer_ == &out && out.size() >= headerOffset_ + 8 + kFlacStreamInfoSize)
+            memcpy(out.data() + headerOffset_ + 8, extradata, kFlacStreamInfoSize);
+        av_packet_unref(packet_);
+        if (!ok)
+            return false;
+    }
+}
+
+EncoderPool::EncoderPool(size_t maxIdlePerType)
+        : maxIdlePerType_(maxIdlePerType) {}
+
+std::unique_ptr<AudioEncoder> EncoderPool::acquire(const std::string& filetype) {
+    if (!AudioEncoder::supports(filetype))
+        return nullptr;
+    std::string key = lowercase(filetype);
+    if (unavailable_.count(key) > 0)
+        return nullptr;
+    auto it = idle_.find(key);
+    if (it != idle_.end() && !it->second.empty()) {
+        std::unique_ptr<AudioEncoder> encoder = std::move(it->second.back());
+        it->second.pop_back();
+        return encoder;
+    }
+    std::unique_ptr<AudioEncoder> encoder = AudioEncoder::create(key);
+    if (!encoder) {
+        LOG(WARNING) << "Native encoder for " << key << " is unavailable, use sox";
+        unavailable_.insert(key);
+    }
+    return encoder;
+}
+
+void EncoderPool::release(std::unique_ptr<AudioEncoder> encoder) {
+    if (!encoder || !encoder->reset())
+        return;
+    auto& encoders = idle_[encoder->filetype()];
+    if (encoders.size() < maxIdlePerType_)
+        encoders.push_back(std::move(encoder));
+}
+
+}
@@ -0,0 +1,129 @@
+#ifndef SERVICE_BASE_AUDIO_ENCODER_H_
+#define SERVICE_BASE_AUDIO_ENCODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "server_base/audio_buffer.h"
+#include "server_base/ogg_writer.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace WL::Service::Base {
+
+struct EncoderFormat;
+
+/**
+ * 使用libavcodec直接编码单声道s16，代替sox memstream的格式层
+ * 支持mp3(libmp3lame)、flac和amr-nb(libopencore_amrnb)，码率和fill_filetype_encoding相同；
+ * ogg的容器需要sox，仍然由sox编码。
+ * opus(libopus，20ms帧)没有sox的编码：filetype为"opus"时封装为Ogg Opus，每次encode输出完整的Ogg页；
+ * "opus-raw"时每个packet之前是2字节大端的长度
+ *
+ * 编码器可以reset之后复用：支持AV_CODEC_CAP_ENCODER_FLUSH的编码器直接冲刷，
+ * 其他编码器只重新打开AVCodecContext，编码器查找、AVFrame、AVPacket和帧缓存都保留
+ *
+ * 用法:
+ *   encoder->begin(out);                  // 文件头，flac的STREAMINFO、amr-nb的"#!AMR\n"、OpusHead和OpusTags
+ *   encoder->encode(samples, count, out); // 可以多次调用，不足一帧的数据留到下一次
+ *   encoder->finish(out);
+ *   encoder->reset();
+ */
+class AudioEncoder {
+public:
+    // 没有编码器时使用的帧长
+    static const int kDefaultFrameSize = 2048;
+
+    // filetype是否可以使用AudioEncoder编码，不检查编码器是否可用
+    static bool supports(const std::string& filetype);
+
+    /**
+     * @return filetype不支持或者编码器无法打开时返回nullptr
+     */
+    static std::unique_ptr<AudioEncoder> create(const std::string& filetype);
+
+    AudioEncoder(const AudioEncoder&) = delete;
+    AudioEncoder& operator=(const AudioEncoder&) = delete;
+    ~AudioEncoder();
+
+    const std::string& filetype() const { return filetype_; }
+
+    // 输入的采样率，amr-nb为8000，其他为16000
+    int sampleRate() const;
+
+    // 已经送入的采样数
+    int64_t samples() const { return samples_; }
+
+    bool begin(AudioBuffer& out);
+
+    bool encode(const int16_t* samples, size_t count, AudioBuffer& out);
+
+    /**
+     * 编码剩余的数据并冲刷编码器，之后需要reset才能再次使用
+     * out和begin的是同一个缓存时，flac的STREAMINFO更新为最终的长度和MD5
+     */
+    bool finish(AudioBuffer& out);
+
+    // 恢复到begin之前的状态，失败时编码器不能再使用
+    bool reset();
+
+private:
+    AudioEncoder(const std::string& filetype, const EncoderFormat& format, const AVCodec* codec);
+
+    bool open();
+    // samples为nullptr时冲刷编码器
+    bool sendFrame(const int16_t* samples, size_t count, AudioBuffer& out);
+    bool receivePackets(AudioBuffer& out);
+
+    std::string filetype_;
+    const EncoderFormat& format_;
+    const AVCodec* codec_;
+    AVCodecContext* context_ = nullptr;
+    AVFrame* frame_ = nullptr;
+    AVPacket* packet_ = nullptr;
+    AVSampleFormat sampleFormat_ = AV_SAMPLE_FMT_NONE;
+    int frameSize_ = 0;
+    // 不足一帧的输入
+    std::vector<int16_t> pending_;
+    int64_t samples_ = 0;
+    // 写入文件头的缓存和文件头的位置，用于更新flac的STREAMINFO
+    const AudioBuffer* headerBuffer_ = nullptr;
+    size_t headerOffset_ = 0;
+    // Ogg Opus的页、pre-skip和已经输出的packet的采样数
+    OggPageWriter ogg_;
+    int preSkip_ = 0;
+    int64_t packetSamples_ = 0;
+};
+
+/**
+ * 编码器池，按照filetype保存reset之后的编码器
+ * 属于一个WorkerContext，只在一个线程中使用，不加锁
+ */
+class EncoderPool {
+public:
+    explicit EncoderPool(size_t maxIdlePerType = 2);
+
+    /**
+     * 取出一个编码器，池中没有时新建
+     *
+     * @return filetype不支持或者编码器不可用时返回nullptr，不可用的filetype之后不再尝试
+     */
+    std::unique_ptr<AudioEncoder> acquire(const std::string& filetype);
+
+    // 归还编码器，reset失败的编码器直接释放
+    void release(std::unique_ptr<AudioEncoder> encoder);
+
+private:
+    size_t maxIdlePerType_;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<AudioEncoder>>> idle_;
+    std::unordered_set<std::string> unavailable_;
+};
+
+}
+#endif
@@ -1,16 +1,22 @@
 #include "glog/logging.h"
 #include "server_base/audio_utils.h"
+#include "server_base/audio_buffer.h"
+#include "server_base/audio_encoder.h"
+#include "server_base/effect_chain.h"
+#include "server_base/parallel_stretch.h"
+#include "server_base/pitch_shift.h"
+#include "server_base/section_processor.h"
+#include "server_base/sox_decoder.h"
+#include "server_base/tempo_map.h"
+#include "server_base/worker_context.h"
+#include <algorithm>
 #include <fstream>
-#include <filesystem>
 #include <iostream>
-#include <cassert>
 #include <strings.h>
 #include <stdlib.h>
 #include <math.h>
 
 namespace WL::Service::Base {
-    // 获取唯一文件名
-    static std::atomic_uint64_t uniqueFileBase = ATOMIC_VAR_INIT(0);
 
 template <>
 void writeFormat<float>(std::ofstream& stream) {
@@ -54,6 +60,17 @@ void writeWAVHeader(
     memcpy(buffer+40, &buffersize, 4);
 }
 
+void writeStreamingWAVHeader(
+    char* buffer,
+    int sampleRate,
+    short channels)
+{
+    writeWAVHeader(buffer, 0, sampleRate, channels);
+    uint32_t unknown = 0xFFFFFFFF;
+    memcpy(buffer+4, &unknown, 4);
+    memcpy(buffer+40, &unknown, 4);
+}
+
 sox_encodinginfo_t *fill_filetype_encoding(sox_encodinginfo_t *encoding, const char* filetype)
 {
     if (filetype==NULL || *filetype=='\0' || strcasecmp(filetype, "wav")==0)
@@ -143,7 +160,7 @@ void dumpSndFile(const snd_file& sndFile) {
 void* process_sox_decode_wav(const void *data, size_t size, const char* sourcefiletype, size_t *outsize)
 {
     void* outbuf = NULL;
-    sox_format_t *in = sox_open_mem_read((void *)data, size, NULL, NULL, sourcefiletype);
+    sox_format_t *in = soxOpenMemRead(data, size, sourcefiletype);
     if (in == NULL)
     {
         LOG(ERROR) << "sox_open_mem_read failed";
@@ -152,26 +169,26 @@ void* process_sox_decode_wav(const void *data, size_t size, const char* sourcefi
     VLOG(1) << "sox_in: err=" << in->sox_errstr << " rate=" << in->signal.rate << " channels=" << in->signal.channels << " precision=" << in->signal.precision << " length="  << in->signal.length;
     char tmpheader[44];
     writeWAVHeader(tmpheader, 0, 16000, 1);
-    sox_format_t *tmp = sox_open_mem_read((void *)tmpheader, 44, NULL, NULL, "wav");
+    sox_format_t *tmp = soxOpenMemRead(tmpheader, 44, "wav");
     if (tmp == NULL)
     {
         LOG(ERROR) << "sox_open_mem_read failed";
         return NULL;
     }
-    sox_format_t *out = sox_open_memstream_write((char **)&outbuf, outsize, &tmp->signal, &tmp->encoding, "wav", NULL);
-    sox_close(tmp);
+    sox_format_t *out = soxOpenMemstreamWrite((char **)&outbuf, outsize, &tmp->signal, &tmp->encoding, "wav");
+    soxClose(tmp);
     if (out == NULL)
     {
         LOG(ERROR) << "sox_open_mem_write failed";
-        sox_close(in);
+        soxClose(in);
         return NULL;
     }
     VLOG(1) << "sox_out: err=" << out->sox_errstr << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length; 
     sox_effects_chain_t *chain = sox_create_effects_chain(&in->encoding, &out->encoding);
     if (chain == NULL)
     {
-        sox_close(out);
-        sox_close(in);
+        soxClose(out);
+        soxClose(in);
         return NULL;
     }
     sox_signalinfo_t interm_signal = in->signal;
@@ -189,10 +206,29 @@ void* process_sox_decode_wav(const void *data, size_t size, const char* sourcefi
         LOG(ERROR) << "sox_add_effect_option(input) failed";
         if (ei != NULL) free(ei);
         sox_delete_effects_chain(chain);
-        sox_close(out);
-        sox_close(in);
+        soxClose(out);
+        soxClose(in);
         return NULL;
     }
+    // 输出固定为16k单声道，输入的采样率和声道数不同时需要转换
+    if (interm_signal.rate != out->signal.rate)
+    {
+        sox_effect_t *er = sox_create_effect(sox_find_effect("rate"));
+        if (er != NULL && sox_effect_options(er, 0, NULL) == SOX_SUCCESS)
+        {
+            sox_add_effect(chain, er, &interm_signal, &out->signal);
+        }
+        free(er);
+    }
+    if (interm_signal.channels != out->signal.channels)
+    {
+        sox_effect_t *ec = sox_create_effect(sox_find_effect("channels"));
+        if (ec != NULL && sox_effect_options(ec, 0, NULL) == SOX_SUCCESS)
+        {
+            sox_add_effect(chain, ec, &interm_signal, &out->signal);
+        }
+        free(ec);
+    }
     char *outargs[1];
     outargs[0] = (char *)out;
     sox_effect_t *eo = sox_create_effect(sox_find_effect("output"));
@@ -207,28 +243,288 @@ void* process_sox_decode_wav(const void *data, size_t size, const char* sourcefi
         LOG(ERROR) << "sox_add_effect_option(output) failed";
         if (eo != NULL) free(eo);
         sox_delete_effects_chain(chain);
-        sox_close(out);
-        sox_close(in);
+        soxClose(out);
+        soxClose(in);
         return NULL;
     }
-    if (sox_flow_effects(chain, NULL, NULL) != SOX_SUCCESS)
+    if (soxFlowEffects(chain) != SOX_SUCCESS)
     {
         LOG(ERROR) << "sox_flow_effects failed";
         sox_delete_effects_chain(chain);
-        sox_close(out);
-        sox_close(in);
+        soxClose(out);
+        soxClose(in);
         return NULL;
     }
     VLOG(0) << "Wav) size=" << outsize << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length;
     sox_delete_effects_chain(chain);
-    sox_close(out);
-    sox_close(in);
+    soxClose(out);
+    soxClose(in);
     return outbuf;
 }
 
+// 多段效果的中间缓存，不足时增长，已有的数据不变
+static bool reserve_outbuf(void **outbuf, size_t *outsize, size_t need)
+{
+    if (*outbuf != NULL && need <= *outsize)
+    {
+        return true;
+    }
+    size_t capacity = *outbuf != NULL ? std::max(need, *outsize + *outsize / 4) : need;
+    void *grown = realloc(*outbuf, capacity);
+    if (grown == NULL)
+    {
+        LOG(ERROR) << "outbuf realloc failed, size " << capacity;
+        return false;
+    }
+    *outbuf = grown;
+    *outsize = capacity;
+    return true;
+}
+
+// 按照每一段的效果链估计多段效果的中间结果大小，包括44字节的WAV头
+static size_t estimate_sections_output(const std::vector<std::tuple<std::string, int, int>> &soxlist, size_t size)
+{
+    size_t total = 44;
+    size_t previous = 0;
+    for (const auto &section : soxlist)
+    {
+        const std::string &sox = std::get<0>(section);
+        size_t end = std::min(size_t(std::max(std::get<1>(section), 0)) / 2 * 2, size);
+        size_t duration = end > previous ? end - previous : 0;
+        previous = end;
+        if (sox.compare(0, 4, "pad=") == 0)
+        {
+            total += (size_t)round(std::max(atof(sox.c_str() + 4), 0.0) * 32000);
+        }
+        else if (sox.empty())
+        {
+            total += duration;
+        }
+        else
+        {
+            total += WorkerContext::current().effectChain(sox)->estimateOutputSize(duration);
+        }
+    }
+    return total;
+}
+
+// 一段效果的输出需要的缓存，in为这一段的输入
+static size_t estimate_section_output(const std::string &sox, const sox_format_t *in, size_t size)
+{
+    size_t insize = in->signal.length != SOX_UNKNOWN_LEN ? in->signal.length * (in->signal.precision > 16 ? 4 : 2) : size;
+    return WorkerContext::current().effectChain(sox)->estimateOutputSize(insize);
+}
+
+// 和1.0相差小于这个值的tempo听不出区别，按照不变速处理
+static const double kIdentityTempoTolerance = 0.005;
+
+// 只有一个数值参数的效果，例如"tempo=1.0"，返回参数是否解析成功
+static bool parse_single_effect_arg(const std::string &effect, size_t prefix, double *value)
+{
+    if (effect.find('_') != std::string::npos || effect.length() <= prefix)
+    {
+        return false;
+    }
+    const char *arg = effect.c_str() + prefix;
+    char *parsed = NULL;
+    *value = strtod(arg, &parsed);
+    return parsed != arg && *parsed == '\0';
+}
+
+static bool is_identity_effect(const std::string &effect)
+{
+    double value = 0.0;
+    if (effect.compare(0, 6, "tempo=") == 0 && parse_single_effect_arg(effect, 6, &value))
+    {
+        return fabs(value - 1.0) < kIdentityTempoTolerance;
+    }
+    if (effect.compare(0, 4, "vol=") == 0 && parse_single_effect_arg(effect, 4, &value))
+    {
+        return value == 1.0;
+    }
+    if (effect.compare(0, 6, "pitch=") == 0 && parse_single_effect_arg(effect, 6, &value))
+    {
+        return value == 0.0;
+    }
+    return false;
+}
+
+bool normalize_sox_list(std::vector<std::tuple<std::string, int, int>> &soxlist)
+{
+    bool changed = false;
+    std::vector<std::tuple<std::string, int, int>> normalized;
+    normalized.reserve(soxlist.size());
+    int prevend = 0;
+    for (size_t i = 0; i < soxlist.size(); i++)
+    {
+        std::string &sox = std::get<0>(soxlist[i]);
+        int end = std::get<1>(soxlist[i]);
+        double pad = 0.0;
+        if (sox.compare(0, 4, "pad=") == 0)
+        {
+            // 长度为0的pad=0没有任何作用，整段去掉
+            if (parse_single_effect_arg(sox, 4, &pad) && pad == 0.0 && end/2*2 == prevend/2*2)
+            {
+                changed = true;
+                continue;
+            }
+        }
+        else
+        {
+            std::string others;
+            size_t start = 0;
+            while (start < sox.length())
+            {
+                size_t pos = sox.find('#', start);
+                if (pos == std::string::npos)
+                {
+                    pos = sox.length();
+                }
+                std::string effect = sox.substr(start, pos - start);
+                start = pos + 1;
+                if (effect.empty() || is_identity_effect(effect))
+                {
+                    changed = true;
+                    continue;
+                }
+                others = others.empty() ? effect : others + "#" + effect;
+            }
+            sox = others;
+        }
+        prevend = end;
+        normalized.push_back(soxlist[i]);
+    }
+    // 所有段都没有效果时合并为一段，和空的soxlist一样不做任何处理
+    bool allempty = normalized.size() > 1;
+    for (size_t i = 0; allempty && i < normalized.size(); i++)
+    {
+        allempty = std::get<0>(normalized[i]).empty();
+    }
+    if (allempty)
+    {
+        int phones = 0;
+        for (size_t i = 0; i < normalized.size(); i++)
+        {
+            phones += std::get<2>(normalized[i]);
+        }
+        std::get<2>(normalized.back()) = phones;
+        normalized.erase(normalized.begin(), normalized.end() - 1);
+        changed = true;
+    }
+    if (changed)
+    {
+        soxlist.swap(normalized);
+    }
+    return changed;
+}
+
+// 输入音频的适配，统一为process_sox_chain_list使用的16k单声道s16裸数据
+typedef struct sox_source {
+    const void *data;
+    size_t size;
+    // 解码时分配的缓存，data指向其中，需要free
+    void *owned;
+} sox_source;
+
+// 找到WAV的data块，格式为16k单声道s16时返回true
+static bool find_wav_pcm(const void *data, size_t size, size_t *offset, size_t *length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    if (size < 12 || memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0)
+    {
+        return false;
+    }
+    bool pcm16k = false;
+    size_t pos = 12;
+    while (pos + 8 <= size)
+    {
+        uint32_t chunksize = bytes[pos + 4] | (bytes[pos + 5] << 8) | (bytes[pos + 6] << 16) | ((uint32_t)bytes[pos + 7] << 24);
+        if (memcmp(bytes + pos, "fmt ", 4) == 0 && pos + 24 <= size)
+        {
+            int format = bytes[pos + 8] | (bytes[pos + 9] << 8);
+            int channels = bytes[pos + 10] | (bytes[pos + 11] << 8);
+            uint32_t rate = bytes[pos + 12] | (bytes[pos + 13] << 8) | (bytes[pos + 14] << 16) | ((uint32_t)bytes[pos + 15] << 24);
+            int bits = bytes[pos + 22] | (bytes[pos + 23] << 8);
+            pcm16k = format == 1 && channels == 1 && rate == 16000 && bits == 16;
+        }
+        else if (memcmp(bytes + pos, "data", 4) == 0)
+        {
+            // 流式写入的WAV长度可能没有填写，以实际数据为准
+            *offset = pos + 8;
+            *length = std::min((size_t)chunksize, size - pos - 8) / 2 * 2;
+            return pcm16k;
+        }
+        pos += 8 + chunksize + (chunksize & 1);
+    }
+    return false;
+}
+
+/**
+ * 按照sourcefiletype把输入转换为裸数据：raw直接使用，16k单声道s16的WAV跳过文件头，
+ * 其他WAV和压缩格式经过sox解码
+ */
+static bool open_sox_source(const void *data, size_t size, const char* sourcefiletype, sox_source *source)
+{
+    source->data = data;
+    source->size = size;
+    source->owned = NULL;
+    if (*sourcefiletype == '\0' || strcasecmp(sourcefiletype, "raw") == 0)
+    {
+        source->size = size / 2 * 2;
+        return true;
+    }
+    size_t offset = 0;
+    size_t length = 0;
+    if (strcasecmp(sourcefiletype, "wav") == 0 && find_wav_pcm(data, size, &offset, &length))
+    {
+        source->data = (const char *)data + offset;
+        source->size = length;
+        return true;
+    }
+    size_t decoded = 0;
+    source->owned = process_sox_decode_wav(data, size, sourcefiletype, &decoded);
+    if (source->owned == NULL || !find_wav_pcm(source->owned, decoded, &offset, &length))
+    {
+        LOG(ERROR) << "decode " << sourcefiletype << " failed";
+        free(source->owned);
+        source->owned = NULL;
+        return false;
+    }
+    source->data = (const char *)source->owned + offset;
+    source->size = length;
+    return true;
+}
+
+// 单段效果中的tempo和pitch交给变速器，并且从sections中去掉
+// usable为false时变速器创建失败，需要使用逐段的处理；不需要变速时返回NULL
+static std::unique_ptr<AudioStretcher> create_section_stretcher(std::vector<std::tuple<std::string, int, int>> &sections, std::vector<std::string> &appliedsox, bool *usable)
+{
+    TempoMap map;
+    std::unique_ptr<AudioStretcher> stretcher;
+    bool hastempo = extractTempoMap(sections, map, appliedsox);
+    // pitch和tempo在同一个变速器中完成，不再经过sox的pitch效果
+    float cents = 0.0f;
+    bool haspitch = extractPitch(std::get<0>(sections[0]), cents);
+    if (haspitch)
+    {
+        stretcher = std::make_unique<PitchShiftStretcher>(defaultStretchEngine(), map.initialTempo(), cents);
+        if (!stretcher->valid())
+        {
+            stretcher.reset();
+        }
+    }
+    else if (hastempo)
+    {
+        stretcher = createTempoMapStretcher(defaultStretchEngine(), map);
+    }
+    *usable = stretcher || (!hastempo && !haspitch);
+    return stretcher;
+}
+
 snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype, const char* sourcefiletype)
 {
     snd_file out_snd = { NULL, 0 };
+    normalize_sox_list(soxlist);
     if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && strcasecmp(filetype, sourcefiletype)==0 )
     {
         out_snd.buffer = (char *)data;
@@ -237,57 +533,114 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
         out_snd.timems = (*sourcefiletype=='\0' || strcasecmp(sourcefiletype, "raw")==0) ? size/32 : strcasecmp(filetype, "wav")==0 ? (size-44)/32 : -1;
         return out_snd;
     }
-    char* inbuf = NULL;
-    if (*sourcefiletype=='\0' || strcasecmp(sourcefiletype, "raw")==0)
+    // 压缩格式只有一段效果时边解码边处理，不需要保存完整的解码结果
+    // 多段的位置按照裸数据计算，仍然需要先完整解码
+    size_t wavoffset = 0;
+    size_t wavlength = 0;
+    bool compressed = *sourcefiletype != '\0' && strcasecmp(sourcefiletype, "raw") != 0
+        && !(strcasecmp(sourcefiletype, "wav") == 0 && find_wav_pcm(data, size, &wavoffset, &wavlength));
+    if (compressed && soxlist.size() <= 1 && (soxlist.empty() || std::get<0>(soxlist[0]).compare(0, 4, "pad=") != 0))
     {
-        if (inbuf==NULL)
+        std::vector<std::tuple<std::string, int, int>> sections = soxlist;
+        if (sections.empty())
         {
-            return out_snd;
+            sections.push_back(std::make_tuple(std::string(), 0, 0));
         }
-        writeWAVHeader(inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0]) : size, 16000, 1);
-        memcpy(inbuf + 44, data, size);
-        out_snd.buffer = inbuf;
-        out_snd.offset = 0;
-        out_snd.size = size + 44;
-        out_snd.timems = size/32;
-        if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && (strcasecmp(filetype, "wav")==0 || strcmp(filetype, "")==0) )
+        std::vector<std::string> appliedsox;
+        bool usable = false;
+        std::unique_ptr<AudioStretcher> stretcher = create_section_stretcher(sections, appliedsox, &usable);
+        if (usable)
         {
-            return out_snd;
+            out_snd = process_sox_decode_stream(stretcher.get(), std::get<0>(sections[0]), data, size, sourcefiletype, filetype);
+            if (out_snd.buffer != NULL)
+            {
+                return out_snd;
+            }
         }
-        sourcefiletype = "wav";
+        LOG(WARNING) << "stream decode " << sourcefiletype << " failed, fall back to full decode";
     }
-    else if (strcasecmp(sourcefiletype, "wav")==0)
+    // 所有输入格式都转换为裸数据之后使用同一个处理流程
+    sox_source source;
+    if (!open_sox_source(data, size, sourcefiletype, &source))
     {
-        out_snd.buffer = (void*)data;
-        out_snd.offset = 0;
-        out_snd.size = size;
-        out_snd.timems = (size-44)/32;
-        inbuf = (char*)data;
-        size -= 44;
+        return out_snd;
     }
-    else
+    out_snd = process_sox_chain_list(soxlist, source.data, source.size, filetype);
+    // 输出直接使用输入时，返回整个缓存和偏移，调用者按照原来的方式判断和释放
+    const char *result = (const char *)out_snd.buffer;
+    const char *base = source.owned != NULL ? (const char *)source.owned : (const char *)data;
+    bool aliased = result != NULL && result >= (const char *)source.data && result <= (const char *)source.data + source.size;
+    if (aliased && out_snd.size > 0)
+    {
+        out_snd.buffer = (void *)base;
+        out_snd.offset += result - base;
+        return out_snd;
+    }
+    if (aliased)
     {
-        out_snd.buffer = (void*)data;
+        // 空的输出不保留输入的缓存，下面释放之后不能再指向它
+        out_snd.buffer = NULL;
         out_snd.offset = 0;
+        out_snd.size = 0;
+    }
+    free(source.owned);
+    return out_snd;
+}
+
+// appliedsox为每一段已经完成的效果(目前只有tempo)，只需要记录在parts中
+static snd_file process_sox_chain_list_sections(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype, const std::vector<std::string> &appliedsox)
+{
+    snd_file out_snd = { NULL, 0 };
+    if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && strcasecmp(filetype, "raw")==0 )
+    {
+        out_snd.buffer = (char *)data;
         out_snd.size = size;
-        out_snd.timems = -1;
-        if ( soxlist.size() <= 1 )
+        out_snd.offset = 0;
+        out_snd.timems = size/32;
+        return out_snd;
+    }
+    // 单段的效果链直接连接线程内的编码器，opus没有sox的编码，只能这样输出
+    if (soxlist.size() <= 1 && AudioEncoder::supports(filetype) && (soxlist.empty() || std::get<0>(soxlist[0]).compare(0, 4, "pad=") != 0))
+    {
+        out_snd = process_sox_stream(NULL, soxlist.empty() ? "" : std::get<0>(soxlist[0]), data, size, filetype, true);
+        if (out_snd.buffer != NULL)
         {
-            inbuf = (char*)data;
+            return out_snd;
         }
-        else
+    }
+    // 只有vol、pitch和pad时所有段在一次处理中完成，不需要每一段打开和关闭sox，最后只编码一次
+    if (soxlist.size() > 1 && SectionProcessor::supports(soxlist))
+    {
+        // 同一个线程的请求复用SectionProcessor的缓存
+        SectionProcessor &processor = WorkerContext::current().sectionProcessor();
+        if (processor.process(soxlist, data, size, appliedsox))
         {
-            size_t insize = 0;
-            inbuf = (char*)process_sox_decode_wav(data, size, sourcefiletype, &insize);
-            if (inbuf==NULL)
+            const std::vector<int16_t> &pcm = processor.pcm();
+            out_snd = process_sox_stream(NULL, "", pcm.data(), pcm.size() * sizeof(int16_t), filetype, true);
+            if (out_snd.buffer != NULL)
             {
-                LOG(ERROR) << "decode_wav failed";
+                out_snd.parts = processor.parts();
+                out_snd.timems = processor.timems();
                 return out_snd;
             }
-            out_snd.size = insize;
-            size = insize;
-            sourcefiletype = "wav";
         }
+        LOG(WARNING) << "SectionProcessor failed, fall back to sox sections";
+    }
+    char* inbuf = (char*)malloc(size + 44);
+    if (inbuf==NULL)
+    {
+        return out_snd;
+    }
+    writeWAVHeader(inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2 : size, 16000, 1);
+    memcpy(inbuf + 44, data, size);
+    out_snd.buffer = inbuf;
+    out_snd.offset = 0;
+    out_snd.size = size + 44;
+    out_snd.timems = size/32;
+    //LOG(INFO)<<out_snd.size;
+    if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && (strcasecmp(filetype, "wav")==0 || strcmp(filetype, "")==0) )
+    {
+        return out_snd;
     }
     //for unknown reason, calling sox_init() and sox_quit() will crash at the second call of open_memstream_write(filetype=mp3)
     //if (sox_init() != SOX_SUCCESS)
@@ -300,7 +653,9 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
     size_t totalout = 0;
     size_t totalms = 0;
     void *outbuf = NULL;
-    size_t outsize = size * 16 + 44; 
+    // 中间缓存按照效果链估计的大小分配，不再按照输入的16倍预留
+    size_t outsize = estimate_sections_output(soxlist, size);
+    size_t tmpsize = 0;
     for (size_t i=0; i<soxlist.size()+1; i++)
     {
         if (i < soxlist.size() && std::get<0>(soxlist[i]).substr(0, 4)=="pad=")
@@ -310,6 +665,20 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
             int breakms = (pos == std::string::npos) ? pad/32 : (int)round(atof(std::get<0>(soxlist[i]).substr(pos+1).c_str()) * 1000);
             int duration = std::get<1>(soxlist[i])/2*2 - (i > 0 ? std::get<1>(soxlist[i-1])/2*2 : 0);
             totalin += duration;
+            if (i == 0) //first of multiple sox sections
+            {
+                outbuf = malloc(outsize);
+                if (outbuf == NULL)
+                {
+                    LOG(ERROR) << "outbuf malloc failed";
+                    return out_snd;
+                }
+            }
+            if (!reserve_outbuf(&outbuf, &outsize, totalout + 44 + pad))
+            {
+                free(outbuf);
+                return out_snd;
+            }
             memset((char*)outbuf + totalout + 44, 0, pad);
             totalout += pad;
             totalms += pad/32;
@@ -323,7 +692,7 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
             }
             VLOG(0) << "[" << i << "] pad=" << totalout << " in=" << totalin << " timems=" << totalms;
             continue;
-        }    
+        }
         if (soxlist.size()==i && i>1) //last of multiple sox section performs filetype conversion
         {
             if (strcasecmp(filetype, "wav")==0 || strcasecmp(filetype, "")==0) //wav don't need conversion, just fill header
@@ -343,29 +712,47 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
                 out_snd.timems = totalms;
                 break;
             }
+            else if (AudioEncoder::supports(filetype)) //encoder from the worker's pool, no sox format needed
+            {
+                snd_file encoded = process_sox_stream(NULL, "", (char*)outbuf + 44, totalout, filetype, true);
+                if (encoded.buffer != NULL)
+                {
+                    free(outbuf);
+                    out_snd.buffer = encoded.buffer;
+                    out_snd.offset = 0;
+                    out_snd.size = encoded.size;
+                    out_snd.timems = totalms;
+                    break;
+                }
+            }
             writeWAVHeader((char*)outbuf, totalout, 16000, 1);
-            in = sox_open_mem_read((void *)outbuf, totalout + 44, NULL, NULL, "wav");
-        }
-        else if (strcasecmp(sourcefiletype, "wav")!=0)
-        {
-            in = sox_open_mem_read((char*)inbuf, size, NULL, NULL, sourcefiletype);
-            totalin += size;
+            in = soxOpenMemRead(outbuf, totalout + 44, "wav");
         }
         else if (i < soxlist.size() && std::get<0>(soxlist[i]).empty() && std::get<1>(soxlist[i]) > 0)
         {
             if (i == 0) //first of multiple sox sections
             {
-                outbuf = malloc(size * 16 + 44);
+                outbuf = malloc(outsize);
                 if (outbuf == NULL)
                 {
                     LOG(ERROR) << "outbuf malloc failed";
-                    sox_close(in);
+                    soxClose(in);
                     //sox_quit();
                     return out_snd;
                 }
             }
             int partsize = std::get<1>(soxlist[i])/2*2-totalin;
+            if (!reserve_outbuf(&outbuf, &outsize, totalout + 44 + partsize))
+            {
+                free(outbuf);
+                return out_snd;
+            }
             memcpy((char*)outbuf + totalout + 44, (char*)inbuf + totalin + 44, partsize);
+            if (i < appliedsox.size() && !appliedsox[i].empty())
+            {
+                std::vector<std::string> partsox(1, appliedsox[i]);
+                out_snd.parts.push_back(snd_part(totalout, totalout + partsize, totalms, totalms + partsize / 32, std::get<2>(soxlist[i]), partsox));
+            }
             totalout += partsize;
             totalin += partsize;
             totalms += partsize/32;
@@ -374,21 +761,22 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
         }
         else if (i==0)
         {
-            if (soxlist.size() > 1 && std::get<1>(soxlist[0])/2*2 < (int)size)
-            {
-                writeWAVHeader(inbuf, std::get<1>(soxlist[0])/2*2, 16000, 1);
-            }
-            in = sox_open_mem_read((char*)inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2+44 : size+44, NULL, NULL, "wav");
+            in = soxOpenMemRead(inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2+44 : size+44, "wav");
             totalin += soxlist.size()>1 ? std::get<1>(soxlist[i])/2*2 : size;
         }
         else
         {
             //char temp[44];
             //memcpy(temp, (char*)data + totalin - 44, 44);
-            writeWAVHeader((char*)inbuf + totalin, std::get<1>(soxlist[i])/2*2 - totalin, 16000, 1);
-            in = sox_open_mem_read((char*)inbuf + totalin, std::get<1>(soxlist[i])/2*2 - totalin + 44, NULL, NULL, "wav");
-            //memcpy((char*)data + totalin - 44, temp, 44);
-            totalin += std::get<1>(soxlist[i])/2*2 - (i > 0 ? std::get<1>(soxlist[i-1])/2*2 : 0);
+            if (i == soxlist.size()) {
+                in = soxOpenMemRead(inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2+44 : size+44, "wav");
+                totalin += soxlist.size()>1 ? std::get<1>(soxlist[i])/2*2 : size;
+            } else {
+                writeWAVHeader((char *)inbuf + totalin, std::get<1>(soxlist[i]) / 2 * 2 - totalin, 16000, 1);
+                in = soxOpenMemRead(inbuf + totalin, std::get<1>(soxlist[i]) / 2 * 2 - totalin + 44, "wav");
+                // memcpy((char*)data + totalin - 44, temp, 44);
+                totalin += std::get<1>(soxlist[i]) / 2 * 2 - (i > 0 ? std::get<1>(soxlist[i - 1]) / 2 * 2 : 0);
+            }
         }
         if (in == NULL)
         {
@@ -397,52 +785,51 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
             free(outbuf);
             return out_snd;
         }
-        VLOG(1) << "sox_in: err=" << in->sox_errstr << " rate=" << in->signal.rate << " channels=" << in->signal.channels << " precision=" << in->signal.precision << " length="  << in->signal.length;
+        VLOG(2) << "sox_in: err=" << in->sox_errstr << " rate=" << in->signal.rate << " channels=" << in->signal.channels << " precision=" << in->signal.precision << " length="  << in->signal.length;
         sox_format_t *out;
         if (soxlist.size()==i || soxlist.size()<=1) //last of multiple sox sections or not multiple sox sections
         {
             sox_encodinginfo_t out_encoding;
-            if (get_filetype_rate(sourcefiletype) != get_filetype_rate(filetype))
-            {
-                sox_signalinfo_t outsignal = in->signal;
-                outsignal.rate=get_filetype_rate(filetype);
-                out = sox_open_memstream_write((char **)&out_snd.buffer, &out_snd.size, &outsignal, fill_filetype_encoding(&out_encoding, filetype), filetype, NULL);
-            }
-            else
-            {
-                out = sox_open_memstream_write((char **)&out_snd.buffer, &out_snd.size, &in->signal, fill_filetype_encoding(&out_encoding, filetype), filetype, NULL);
-            }
+            out = soxOpenMemstreamWrite((char **)&out_snd.buffer, &out_snd.size, &in->signal, fill_filetype_encoding(&out_encoding, filetype), filetype);
         }
         else if (i == 0) //first of multiple sox sections
         {
-            outbuf = malloc(size * 16 + 44);
+            outbuf = malloc(outsize);
             if (outbuf == NULL)
             {
                 LOG(ERROR) << "outbuf malloc failed";
-                sox_close(in);
+                soxClose(in);
                 //sox_quit();
                 return out_snd;
             }
-            out = sox_open_mem_write((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw", NULL);
+            out = NULL;
+            if (reserve_outbuf(&outbuf, &outsize, totalout + 44 + estimate_section_output(std::get<0>(soxlist[i]), in, size)))
+            {
+                out = soxOpenMemWrite((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw");
+            }
         }
         else //neither first nor last of multiple sox sections
         {
-            out = sox_open_mem_write((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw", NULL);
+            out = NULL;
+            if (reserve_outbuf(&outbuf, &outsize, totalout + 44 + estimate_section_output(std::get<0>(soxlist[i]), in, size)))
+            {
+                out = soxOpenMemWrite((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw");
+            }
         }
         if (out == NULL)
         {
             LOG(ERROR) << "sox_open_mem_write failed";
-            sox_close(in);
+            soxClose(in);
             //sox_quit();
             free(outbuf);
             return out_snd;
         }
-        VLOG(1) << "sox_out: err=" << out->sox_errstr << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length; 
+        VLOG(2) << "sox_out: err=" << out->sox_errstr << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length; 
         sox_effects_chain_t *chain = sox_create_effects_chain(&in->encoding, &out->encoding);
         if (chain == NULL)
         {
-            sox_close(out);
-            sox_close(in);
+            soxClose(out);
+            soxClose(in);
             //sox_quit();
             free(outbuf);
             return out_snd;
@@ -462,61 +849,20 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
             LOG(ERROR) << "sox_add_effect_option(input) failed";
             if (ei != NULL) free(ei);
             sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
+            soxClose(out);
+            soxClose(in);
             //sox_quit();
             free(outbuf);
             return out_snd;
         }
-        size_t start = 0;
         std::string sox = (i==soxlist.size()) ? std::string("") : std::get<0>(soxlist[i]);
         std::vector<std::string> outputsox;
-        while (start < sox.length())
+        if (i < appliedsox.size() && !appliedsox[i].empty())
         {
-            std::string cmd;
-            char* userargs[10];
-            size_t userargc=0;
-            size_t end = sox.find('#', start);
-            if (end == std::string::npos)
-            {
-                end = sox.length();        
-            }
-            size_t pos = sox.find('=', start);
-            if (pos > start && pos < end)
-            {
-                cmd = sox.substr(start, pos-start);
-                char *value = (char *)sox.substr(pos+1, end-pos-1).c_str();
-                while (value != NULL && *value != '\0' && userargc < 10)
-                {
-                    userargs[userargc] = value;
-                    value = strchr(value, '_');
-                    if (value!=NULL)
-                    {
-                        *value = '\0';
-                        value++;
-                    }
-                    userargc++;
-                }
-            }
-            else
-            {
-                cmd = sox.substr(start, end);
-            }
-            sox_effect_t *eu = sox_create_effect(sox_find_effect(cmd.c_str()));
-            if (eu != NULL)
-            {
-                if (sox_effect_options(eu, userargc, userargs)==SOX_SUCCESS)
-                {
-                    if (sox_add_effect(chain, eu, &interm_signal, &out->signal)==SOX_SUCCESS)
-                    {
-                        outputsox.push_back(sox.substr(start, end));
-                        VLOG(0) << chain->length << ") sox_" << cmd << " " << (userargc>0?userargs[0]:"") << " " << (userargc>1?userargs[1]:"") << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;     
-                    }
-                }
-                free(eu);
-            }
-            start = end + 1;
+            outputsox.push_back(appliedsox[i]);
         }
+        std::shared_ptr<const EffectChain> effects = WorkerContext::current().effectChain(sox);
+        effects->addTo(chain, &interm_signal, &out->signal, &outputsox);
         char* rateargs[1];
         rateargs[0] = (char *)(out->signal.rate==8000 ? "8k" : "16k");
         if (interm_signal.rate != out->signal.rate)
@@ -530,7 +876,7 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
                     {
                         outputsox.push_back("rate " + std::string(rateargs[0]));
                         VLOG(0) << chain->length << ") sox_rate" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;
-                    }                    
+                    }
                 }
                 free(er);
             }
@@ -545,7 +891,7 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
                     if (sox_add_effect(chain, ec, &interm_signal, &out->signal) == SOX_SUCCESS)
                     {
                         outputsox.push_back("channel");
-                        VLOG(0) << chain->length << ") sox_channels" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;
+                        VLOG(0) << chain->length << ") sox_channels" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;     
                     }
                 }
                 free(ec);
@@ -565,28 +911,29 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
             LOG(ERROR) << "sox_add_effect_option(output) failed";
             if (eo != NULL) free(eo);
             sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
+            soxClose(out);
+            soxClose(in);
             //sox_quit();
             free(outbuf);
             return out_snd;
         }
-        if (sox_flow_effects(chain, NULL, NULL) != SOX_SUCCESS)
+        if (soxFlowEffects(chain) != SOX_SUCCESS)
         {
             LOG(ERROR) << "sox_flow_effects failed";
             sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
+            soxClose(out);
+            soxClose(in);
             //sox_quit();
             free(outbuf);
             return out_snd;
         }
-        sox_delete_effects_chain(chain);
-        sox_close(out);
-        sox_close(in);
         if (soxlist.size()==i || (i==0 && soxlist.size()<=1)) //last of multiple sox section or single sox section
         {
+            tmpsize = out_snd.size;
             VLOG(0) << "[Out] size=" << out_snd.size << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length;
+            sox_delete_effects_chain(chain);
+            soxClose(out);
+            soxClose(in);
             if (outbuf != NULL)
             {
                 free(outbuf);
@@ -600,13 +947,19 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
         }
         else
         {
+            sox_delete_effects_chain(chain);
+            soxClose(out);
+            soxClose(in);
             out_snd.parts.push_back(snd_part(totalout, totalout + interm_signal.length * 2, totalms, totalms + interm_signal.length / 16, std::get<2>(soxlist[i]), outputsox));
             totalout += interm_signal.length * 2;
             totalms += interm_signal.length / 16;
             VLOG(0) << "[" << i << "] out=" << totalout << " in=" << totalin << " timems=" << totalms;
         }
     }
-    if (out_snd.buffer != inbuf && data != inbuf)
+    if (out_snd.size == 0 && tmpsize > 0) {
+        out_snd.size = -tmpsize;
+    }
+    if (out_snd.buffer != inbuf)
     {
         free(inbuf);
     }
@@ -614,361 +967,469 @@ snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, in
     return out_snd;
 }
 
-snd_file process_sox_chain_list(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype)
+// 效果链的输入，每次从变速器或者原始数据中取出一个数据块
+typedef struct sox_stream_source
 {
-    snd_file out_snd = { NULL, 0 };
-    if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && strcasecmp(filetype, "raw")==0 )
+    AudioStretcher *stretcher;
+    SoxDecoder *decoder;        // 不为NULL时从解码器读取原始数据，不使用data
+    std::vector<int16_t> decoded;
+    const int16_t *data;
+    size_t samples;             // 原始数据的采样数
+    size_t consumed;            // 已经送入的采样数
+    bool finish;                // 原始数据送完之后是否冲刷变速器
+    bool finished;
+    std::vector<int16_t> block; // 变速器的输出
+    const int16_t *blockdata;
+    size_t blocksize;
+    size_t blockpos;
+} sox_stream_source;
+
+// 每次送入变速器的采样数，输出缓存的大小和这个值成正比
+static const size_t kSoxStreamBlock = 4096;
+
+// 原始数据的下一块，来自解码器或者data，没有数据时返回0
+static size_t sox_stream_next(sox_stream_source *source, const int16_t **samples)
+{
+    if (source->decoder != NULL)
     {
-        out_snd.buffer = (char *)data;
-        out_snd.size = size;
-        out_snd.offset = 0;
-        out_snd.timems = size/32;
-        return out_snd;
+        size_t count = source->decoder->read(source->decoded, kSoxStreamBlock);
+        *samples = source->decoded.data();
+        return count;
     }
-    char* inbuf = (char*)malloc(size + 44);
-    if (inbuf==NULL)
+    if (source->consumed >= source->samples)
+        return 0;
+    size_t count = std::min(kSoxStreamBlock, source->samples - source->consumed);
+    *samples = source->data + source->consumed;
+    source->consumed += count;
+    return count;
+}
+
+// 取出下一个数据块，没有数据时返回false
+static bool sox_stream_fill(sox_stream_source *source)
+{
+    source->blockpos = 0;
+    source->blocksize = 0;
+    if (source->stretcher == NULL)
     {
-        return out_snd;
+        // 不变速时直接使用原始数据
+        source->blocksize = sox_stream_next(source, &source->blockdata);
+        return source->blocksize > 0;
     }
-    writeWAVHeader(inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2 : size, 16000, 1);
-    memcpy(inbuf + 44, data, size);
-    out_snd.buffer = inbuf;
-    out_snd.offset = 0;
-    out_snd.size = size + 44;
-    out_snd.timems = size/32;
-    //LOG(INFO)<<out_snd.size;
-    if ( (0 == soxlist.size() || (1 == soxlist.size() && std::get<0>(soxlist[0]).empty())) && (strcasecmp(filetype, "wav")==0 || strcmp(filetype, "")==0) )
+    source->block.clear();
+    SampleSink sink = [source](const uint8_t *data, size_t size) {
+        const int16_t *samples = (const int16_t *)data;
+        source->block.insert(source->block.end(), samples, samples + size / sizeof(int16_t));
+    };
+    while (source->block.empty())
     {
-        return out_snd;
-    }
-    //for unknown reason, calling sox_init() and sox_quit() will crash at the second call of open_memstream_write(filetype=mp3)
-    //if (sox_init() != SOX_SUCCESS)
-    //{
-    //    LOG(ERROR) << "sox_init failed";
-    //   return out_snd;
-    //}
-    sox_format_t *in=NULL;
-    size_t totalin = 0;
-    size_t totalout = 0;
-    size_t totalms = 0;
-    void *outbuf = NULL;
-    size_t outsize = size * 16 + 44; 
-    size_t tmpsize = 0;
-    for (size_t i=0; i<soxlist.size()+1; i++)
-    {
-        if (i < soxlist.size() && std::get<0>(soxlist[i]).substr(0, 4)=="pad=")
-        {
-            size_t pos = std::get<0>(soxlist[i]).find('@');
-            int pad = (int)round(atof(std::get<0>(soxlist[i]).substr(4).c_str()) * 32000);
-            int breakms = (pos == std::string::npos) ? pad/32 : (int)round(atof(std::get<0>(soxlist[i]).substr(pos+1).c_str()) * 1000);
-            int duration = std::get<1>(soxlist[i])/2*2 - (i > 0 ? std::get<1>(soxlist[i-1])/2*2 : 0);
-            totalin += duration;
-            if (i == 0) //first of multiple sox sections
-            {
-                outbuf = malloc(size * 16 + 44);
-                if (outbuf == NULL)
-                {
-                    LOG(ERROR) << "outbuf malloc failed";
-                    return out_snd;
-                }
-            }
-            memset((char*)outbuf + totalout + 44, 0, pad);
-            totalout += pad;
-            totalms += pad/32;
-            auto last = out_snd.parts.rbegin();
-            if (last != out_snd.parts.rend())
-            {
-                last->length += pad;
-                last->timems += pad/32;
-                last->padms = pad > 0 ? pad / 32 : - duration / 32;
-                last->breakms = breakms;
-            }
-            VLOG(0) << "[" << i << "] pad=" << totalout << " in=" << totalin << " timems=" << totalms;
-            continue;
-        }
-        if (soxlist.size()==i && i>1) //last of multiple sox section performs filetype conversion
+        bool more = true;
+        const int16_t *samples = NULL;
+        size_t count = source->finished ? 0 : sox_stream_next(source, &samples);
+        if (count > 0)
         {
-            if (strcasecmp(filetype, "wav")==0 || strcasecmp(filetype, "")==0) //wav don't need conversion, just fill header
-            {
-                writeWAVHeader((char*)outbuf, totalout, 16000, 1);
-                out_snd.buffer = outbuf;
-                out_snd.offset = 0;
-                out_snd.size = totalout + 44;
-                out_snd.timems = totalms;
-                break;
-            }
-            else if (strcasecmp(filetype, "raw")==0) //raw don't need conversion, just offset buffer
-            {
-                out_snd.buffer = outbuf;
-                out_snd.offset = 44;
-                out_snd.size = totalout;
-                out_snd.timems = totalms;
-                break;
-            }
-            writeWAVHeader((char*)outbuf, totalout, 16000, 1);
-            in = sox_open_mem_read((void *)outbuf, totalout + 44, NULL, NULL, "wav");
+            if (!source->stretcher->push(samples, count * sizeof(int16_t)))
+                return false;
         }
-        else if (i < soxlist.size() && std::get<0>(soxlist[i]).empty() && std::get<1>(soxlist[i]) > 0)
+        else if (source->finish && !source->finished)
         {
-            if (i == 0) //first of multiple sox sections
-            {
-                outbuf = malloc(size * 16 + 44);
-                if (outbuf == NULL)
-                {
-                    LOG(ERROR) << "outbuf malloc failed";
-                    sox_close(in);
-                    //sox_quit();
-                    return out_snd;
-                }
-            }
-            int partsize = std::get<1>(soxlist[i])/2*2-totalin;
-            memcpy((char*)outbuf + totalout + 44, (char*)inbuf + totalin + 44, partsize);
-            totalout += partsize;
-            totalin += partsize;
-            totalms += partsize/32;
-            VLOG(0) << "[" << i << "] cpy=" << totalout << " in=" << totalin << " timems=" << totalms;
-            continue;
-        }
-        else if (i==0)
-        {
-            in = sox_open_mem_read((char*)inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2+44 : size+44, NULL, NULL, "wav");
-            totalin += soxlist.size()>1 ? std::get<1>(soxlist[i])/2*2 : size;
+            source->stretcher->finish();
+            source->finished = true;
         }
         else
         {
-            //char temp[44];
-            //memcpy(temp, (char*)data + totalin - 44, 44);
-            if (i == soxlist.size()) {
-                in = sox_open_mem_read((char*)inbuf, soxlist.size()>1 ? std::get<1>(soxlist[0])/2*2+44 : size+44, NULL, NULL, "wav");
-                totalin += soxlist.size()>1 ? std::get<1>(soxlist[i])/2*2 : size;
-            } else {
-                writeWAVHeader((char *)inbuf + totalin, std::get<1>(soxlist[i]) / 2 * 2 - totalin, 16000, 1);
-                in = sox_open_mem_read((char *)inbuf + totalin, std::get<1>(soxlist[i]) / 2 * 2 - totalin + 44, NULL, NULL, "wav");
-                // memcpy((char*)data + totalin - 44, temp, 44);
-                totalin += std::get<1>(soxlist[i]) / 2 * 2 - (i > 0 ? std::get<1>(soxlist[i - 1]) / 2 * 2 : 0);
-            }
+            more = false;
         }
-        if (in == NULL)
+        source->stretcher->pull(sink);
+        if (!more)
+            break;
+    }
+    source->blockdata = source->block.data();
+    source->blocksize = source->block.size();
+    return source->blocksize > 0;
+}
+
+static int sox_stream_drain(sox_effect_t *effp, sox_sample_t *obuf, size_t *osamp)
+{
+    sox_stream_source *source = *(sox_stream_source **)effp->priv;
+    size_t done = 0;
+    while (done < *osamp)
+    {
+        if (source->blockpos >= source->blocksize && !sox_stream_fill(source))
+            break;
+        size_t count = std::min(*osamp - done, source->blocksize - source->blockpos);
+        const int16_t *samples = source->blockdata + source->blockpos;
+        for (size_t i = 0; i < count; i++)
         {
-            LOG(ERROR) << "sox_open_mem_read failed";
-            //sox_quit();
-            free(outbuf);
-            return out_snd;
+            obuf[done + i] = SOX_SIGNED_16BIT_TO_SAMPLE(samples[i], 0);
         }
-        VLOG(2) << "sox_in: err=" << in->sox_errstr << " rate=" << in->signal.rate << " channels=" << in->signal.channels << " precision=" << in->signal.precision << " length="  << in->signal.length;
-        sox_format_t *out;
-        if (soxlist.size()==i || soxlist.size()<=1) //last of multiple sox sections or not multiple sox sections
+        source->blockpos += count;
+        done += count;
+    }
+    *osamp = done;
+    return done > 0 ? SOX_SUCCESS : SOX_EOF;
+}
+
+static const sox_effect_handler_t *sox_stream_source_handler()
+{
+    static sox_effect_handler_t handler = {
+        "stream_input", NULL, SOX_EFF_MCHAN | SOX_EFF_MODIFY,
+        NULL, NULL, NULL, sox_stream_drain, NULL, NULL, sizeof(sox_stream_source *)
+    };
+    return &handler;
+}
+
+// sox效果链的输出，效果处理之后的数据直接送入编码器
+typedef struct sox_stream_sink
+{
+    AudioEncoder *encoder;
+    AudioBuffer *out;
+    std::vector<int16_t> samples;
+    // sox把flow返回的SOX_EOF当作正常结束，编码失败需要单独记录
+    bool failed;
+} sox_stream_sink;
+
+static int sox_stream_sink_flow(sox_effect_t *effp, const sox_sample_t *ibuf, sox_sample_t *obuf, size_t *isamp, size_t *osamp)
+{
+    SOX_SAMPLE_LOCALS;
+    sox_stream_sink *sink = *(sox_stream_sink **)effp->priv;
+    sink->samples.resize(*isamp);
+    for (size_t i = 0; i < *isamp; i++)
+    {
+        sink->samples[i] = SOX_SAMPLE_TO_SIGNED_16BIT(ibuf[i], effp->clips);
+    }
+    *osamp = 0;
+    if (!sink->encoder->encode(sink->samples.data(), sink->samples.size(), *sink->out))
+    {
+        sink->failed = true;
+        return SOX_EOF;
+    }
+    return SOX_SUCCESS;
+}
+
+static const sox_effect_handler_t *sox_stream_sink_handler()
+{
+    static sox_effect_handler_t handler = {
+        "stream_output", NULL, SOX_EFF_MCHAN,
+        NULL, NULL, sox_stream_sink_flow, NULL, NULL, NULL, sizeof(sox_stream_sink *)
+    };
+    return &handler;
+}
+
+// 效果链的采样率和输出不同时增加rate效果
+static void add_sox_rate_effect(sox_effects_chain_t *chain, sox_signalinfo_t *interm_signal, const sox_signalinfo_t *out_signal)
+{
+    if (interm_signal->rate == out_signal->rate)
+    {
+        return;
+    }
+    char* rateargs[1];
+    rateargs[0] = (char *)(out_signal->rate==8000 ? "8k" : "16k");
+    sox_effect_t *er = sox_create_effect(sox_find_effect("rate"));
+    if (er != NULL)
+    {
+        if (sox_effect_options(er, 1, rateargs) == SOX_SUCCESS)
         {
-            sox_encodinginfo_t out_encoding;
-            out = sox_open_memstream_write((char **)&out_snd.buffer, &out_snd.size, &in->signal, fill_filetype_encoding(&out_encoding, filetype), filetype, NULL);
+            sox_add_effect(chain, er, interm_signal, out_signal);
         }
-        else if (i == 0) //first of multiple sox sections
+        free(er);
+    }
+}
+
+/**
+ * 使用线程内的编码器编码，不打开sox的输出格式
+ * 没有效果并且编码器的采样率为16k时不建立sox效果链，否则效果链的最后是stream_output
+ */
+static bool encode_sox_stream_source(sox_stream_source &source, const std::string &sox, AudioEncoder *encoder, AudioBuffer &outbuf)
+{
+    if (sox.empty() && encoder->sampleRate() == 16000)
+    {
+        while (sox_stream_fill(&source))
         {
-            outbuf = malloc(size * 16 + 44);
-            if (outbuf == NULL)
+            if (!encoder->encode(source.blockdata, source.blocksize, outbuf))
             {
-                LOG(ERROR) << "outbuf malloc failed";
-                sox_close(in);
-                //sox_quit();
-                return out_snd;
+                return false;
             }
-            out = sox_open_mem_write((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw", NULL);
         }
-        else //neither first nor last of multiple sox sections
+        return true;
+    }
+
+    sox_signalinfo_t in_signal = { 16000, 1, 16, SOX_UNKNOWN_LEN, NULL };
+    sox_encodinginfo_t in_encoding = { SOX_ENCODING_SIGN2, 16, 0, sox_option_default, sox_option_default, sox_option_default, sox_false };
+    sox_signalinfo_t out_signal = in_signal;
+    out_signal.rate = encoder->sampleRate();
+    sox_effects_chain_t *chain = sox_create_effects_chain(&in_encoding, &in_encoding);
+    if (chain == NULL)
+    {
+        return false;
+    }
+    sox_signalinfo_t interm_signal = in_signal;
+    sox_effect_t *ei = sox_create_effect(sox_stream_source_handler());
+    sox_effect_t *es = sox_create_effect(sox_stream_sink_handler());
+    if (ei == NULL || es == NULL)
+    {
+        LOG(ERROR) << "sox_create_effect(stream_input/stream_output) failed";
+        free(ei);
+        free(es);
+        sox_delete_effects_chain(chain);
+        return false;
+    }
+    *(sox_stream_source **)ei->priv = &source;
+    sox_add_effect(chain, ei, &interm_signal, &in_signal);
+    free(ei);
+
+    std::shared_ptr<const EffectChain> effects = WorkerContext::current().effectChain(sox);
+    effects->addTo(chain, &interm_signal, &out_signal);
+    add_sox_rate_effect(chain, &interm_signal, &out_signal);
+
+    sox_stream_sink sink;
+    sink.encoder = encoder;
+    sink.out = &outbuf;
+    sink.failed = false;
+    *(sox_stream_sink **)es->priv = &sink;
+    sox_add_effect(chain, es, &interm_signal, &out_signal);
+    free(es);
+
+    int err = soxFlowEffects(chain);
+    sox_delete_effects_chain(chain);
+    if (err != SOX_SUCCESS)
+    {
+        LOG(ERROR) << "sox_flow_effects failed";
+        return false;
+    }
+    if (sink.failed)
+    {
+        LOG(ERROR) << "stream_output encode " << encoder->filetype() << " failed";
+        return false;
+    }
+    return true;
+}
+
+static void init_sox_stream_source(sox_stream_source *source, AudioStretcher *stretcher, const void *data, size_t size, bool finish)
+{
+    source->stretcher = stretcher;
+    source->decoder = NULL;
+    source->data = (const int16_t *)data;
+    source->samples = size / sizeof(int16_t);
+    source->consumed = 0;
+    source->finish = finish;
+    source->finished = false;
+    source->blockdata = NULL;
+    source->blocksize = 0;
+    source->blockpos = 0;
+}
+
+// size为输出之前的原始数据大小，只用于预先分配输出缓存
+static snd_file process_sox_stream_source(sox_stream_source &source, const std::string &sox, size_t size, const char* filetype)
+{
+    snd_file out_snd = { NULL, 0 };
+    AudioStretcher *stretcher = source.stretcher;
+    bool wav = strcasecmp(filetype, "wav")==0 || strcasecmp(filetype, "")==0;
+    bool raw = strcasecmp(filetype, "raw")==0;
+    if (sox.empty() && (wav || raw))
+    {
+        // 不需要效果和编码，变速结果直接写入输出缓存
+        AudioBuffer outbuf(size_t(size / (stretcher != NULL ? stretcher->tempo() : 1.0f)) + 44);
+        char header[44] = { 0 };
+        if (wav)
         {
-            out = sox_open_mem_write((char*)outbuf + totalout + 44, outsize - totalout - 44, &in->signal, NULL, "raw", NULL);
+            outbuf.append(header, sizeof(header));
         }
-        if (out == NULL)
+        while (sox_stream_fill(&source))
         {
-            LOG(ERROR) << "sox_open_mem_write failed";
-            sox_close(in);
-            //sox_quit();
-            free(outbuf);
-            return out_snd;
+            outbuf.append(source.blockdata, source.blocksize * sizeof(int16_t));
         }
-        VLOG(2) << "sox_out: err=" << out->sox_errstr << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length; 
-        sox_effects_chain_t *chain = sox_create_effects_chain(&in->encoding, &out->encoding);
-        if (chain == NULL)
+        if (outbuf.size() == (wav ? 44u : 0u) && !outbuf.failed())
         {
-            sox_close(out);
-            sox_close(in);
-            //sox_quit();
-            free(outbuf);
+            // 变速器还在缓存数据，本次没有输出
+            out_snd.buffer = (void*)"";
             return out_snd;
         }
-        sox_signalinfo_t interm_signal = in->signal;
-        char *inargs[1];
-        inargs[0] = (char *)in;  
-        sox_effect_t *ei = sox_create_effect(sox_find_effect("input"));
-        if (ei != NULL && sox_effect_options(ei, 1, inargs) == SOX_SUCCESS)
-        {
-            sox_add_effect(chain, ei, &interm_signal, &in->signal);
-            VLOG(1) << chain->length << ") sox_input: rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;     
-            free(ei);
-        }
-        else
+        size_t outsize = 0;
+        out_snd.buffer = outbuf.release(outsize);
+        if (out_snd.buffer == NULL)
         {
-            LOG(ERROR) << "sox_add_effect_option(input) failed";
-            if (ei != NULL) free(ei);
-            sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
-            //sox_quit();
-            free(outbuf);
             return out_snd;
         }
-        size_t start = 0;
-        std::string sox = (i==soxlist.size()) ? std::string("") : std::get<0>(soxlist[i]);
-        std::vector<std::string> outputsox;
-        while (start < sox.length())
-        {
-            std::string cmd;
-            std::string cmdparam;
-            char* userargs[10];
-            size_t userargc=0;
-            size_t end = sox.find('#', start);
-            if (end == std::string::npos)
-            {
-                end = sox.length();        
-            }
-            size_t pos = sox.find('=', start);
-            if (pos > start && pos < end)
-            {
-                cmd = sox.substr(start, pos-start);
-                cmdparam = sox.substr(pos+1, end-pos-1);
-                char *value = (char *)cmdparam.c_str();
-                while (value != NULL && *value != '\0' && userargc < 10)
-                {
-                    userargs[userargc] = value;
-                    value = strchr(value, '_');
-                    if (value!=NULL)
-                    {
-                        *value = '\0';
-                        value++;
-                    }
-                    userargc++;
-                }
-            }
-            else
-            {
-                cmd = sox.substr(start, end);
-            }
-            sox_effect_t *eu = sox_create_effect(sox_find_effect(cmd.c_str()));
-            if (eu != NULL)
-            {
-                if (sox_effect_options(eu, userargc, userargs)==SOX_SUCCESS)
-                {
-                    if (sox_add_effect(chain, eu, &interm_signal, &out->signal) == SOX_SUCCESS)
-                    {
-                        outputsox.push_back(sox.substr(start, end));
-                        VLOG(0) << chain->length << ") sox_" << cmd << " " << (userargc>0?userargs[0]:"") << " " << (userargc>1?userargs[1]:"") << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;
-                    }
-                }
-                free(eu);
-            }
-            start = end + 1;
-        }
-        char* rateargs[1];
-        rateargs[0] = (char *)(out->signal.rate==8000 ? "8k" : "16k");
-        if (interm_signal.rate != out->signal.rate)
-        {
-            sox_effect_t *er = sox_create_effect(sox_find_effect("rate"));
-            if (er != NULL)
-            {
-                if (sox_effect_options(er, 1, rateargs) == SOX_SUCCESS)
-                {
-                    if (sox_add_effect(chain, er, &interm_signal, &out->signal) == SOX_SUCCESS)
-                    {
-                        outputsox.push_back("rate " + std::string(rateargs[0]));
-                        VLOG(0) << chain->length << ") sox_rate" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;
-                    }
-                }
-                free(er);
-            }
-        }
-        if (interm_signal.channels != out->signal.channels) 
+        out_snd.size = outsize;
+        out_snd.offset = 0;
+        if (wav)
         {
-            sox_effect_t *ec = sox_create_effect(sox_find_effect("channels"));
-            if (ec != NULL)
-            {
-                if (sox_effect_options(ec, 0, rateargs) == SOX_SUCCESS)
-                {
-                    if (sox_add_effect(chain, ec, &interm_signal, &out->signal) == SOX_SUCCESS)
-                    {
-                        outputsox.push_back("channel");
-                        VLOG(0) << chain->length << ") sox_channels" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;     
-                    }
-                }
-                free(ec);
-            }
+            writeWAVHeader((char*)out_snd.buffer, outsize - 44, 16000, 1);
         }
-        char *outargs[1];
-        outargs[0] = (char *)out;
-        sox_effect_t *eo = sox_create_effect(sox_find_effect("output"));
-        if (eo != NULL && sox_effect_options(eo, 1, outargs) == SOX_SUCCESS)
+        out_snd.timems = (outsize - (wav ? 44 : 0)) / 32;
+        return out_snd;
+    }
+
+    // mp3、flac和amr-nb使用当前线程编码器池中的编码器，不需要每次打开sox的输出格式和新建编码器
+    EncoderPool &encoders = WorkerContext::current().encoderPool();
+    std::unique_ptr<AudioEncoder> encoder = encoders.acquire(filetype);
+    if (encoder)
+    {
+        AudioBuffer outbuf(size / 4 + 4096);
+        if (!encoder->begin(outbuf) || !encode_sox_stream_source(source, sox, encoder.get(), outbuf) || !encoder->finish(outbuf) || outbuf.failed())
         {
-            sox_add_effect(chain, eo, &interm_signal, &out->signal);
-            VLOG(1) << chain->length << ") sox_output" << " rate=" << interm_signal.rate << " channels=" << interm_signal.channels << " precision=" << interm_signal.precision << " length="  << interm_signal.length;     
-            free(eo);
+            LOG(ERROR) << "encode " << filetype << " failed";
+            return out_snd;
         }
-        else
+        int64_t outsamples = encoder->samples();
+        int rate = encoder->sampleRate();
+        encoders.release(std::move(encoder));
+        if (outsamples == 0)
         {
-            LOG(ERROR) << "sox_add_effect_option(output) failed";
-            if (eo != NULL) free(eo);
-            sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
-            //sox_quit();
-            free(outbuf);
+            out_snd.buffer = (void*)"";
             return out_snd;
         }
-        if (sox_flow_effects(chain, NULL, NULL) != SOX_SUCCESS)
+        size_t outsize = 0;
+        out_snd.buffer = outbuf.release(outsize);
+        if (out_snd.buffer == NULL)
         {
-            LOG(ERROR) << "sox_flow_effects failed";
-            sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
-            //sox_quit();
-            free(outbuf);
             return out_snd;
         }
-        if (soxlist.size()==i || (i==0 && soxlist.size()<=1)) //last of multiple sox section or single sox section
+        out_snd.size = outsize;
+        out_snd.offset = 0;
+        out_snd.timems = outsamples * 1000 / rate;
+        VLOG(0) << "[Stream] size=" << out_snd.size << " timems=" << out_snd.timems << " encoder=" << filetype;
+        return out_snd;
+    }
+
+    sox_signalinfo_t in_signal = { 16000, 1, 16, SOX_UNKNOWN_LEN, NULL };
+    sox_encodinginfo_t in_encoding = { SOX_ENCODING_SIGN2, 16, 0, sox_option_default, sox_option_default, sox_option_default, sox_false };
+    sox_signalinfo_t out_signal = in_signal;
+    out_signal.rate = get_filetype_rate(filetype);
+    sox_encodinginfo_t out_encoding;
+    sox_format_t *out = soxOpenMemstreamWrite((char **)&out_snd.buffer, &out_snd.size, &out_signal, fill_filetype_encoding(&out_encoding, filetype), filetype);
+    if (out == NULL)
+    {
+        LOG(ERROR) << "sox_open_memstream_write failed";
+        return out_snd;
+    }
+    sox_effects_chain_t *chain = sox_create_effects_chain(&in_encoding, &out->encoding);
+    if (chain == NULL)
+    {
+        soxClose(out);
+        free(out_snd.buffer);
+        out_snd.buffer = NULL;
+        return out_snd;
+    }
+    sox_signalinfo_t interm_signal = in_signal;
+    sox_effect_t *ei = sox_create_effect(sox_stream_source_handler());
+    if (ei == NULL)
+    {
+        LOG(ERROR) << "sox_create_effect(stream_input) failed";
+        sox_delete_effects_chain(chain);
+        soxClose(out);
+        free(out_snd.buffer);
+        out_snd.buffer = NULL;
+        return out_snd;
+    }
+    *(sox_stream_source **)ei->priv = &source;
+    sox_add_effect(chain, ei, &interm_signal, &in_signal);
+    free(ei);
+
+    std::shared_ptr<const EffectChain> effects = WorkerContext::current().effectChain(sox);
+    effects->addTo(chain, &interm_signal, &out->signal);
+    add_sox_rate_effect(chain, &interm_signal, &out->signal);
+    char *outargs[1];
+    outargs[0] = (char *)out;
+    sox_effect_t *eo = sox_create_effect(sox_find_effect("output"));
+    if (eo == NULL || sox_effect_options(eo, 1, outargs) != SOX_SUCCESS)
+    {
+        LOG(ERROR) << "sox_add_effect_option(output) failed";
+        if (eo != NULL) free(eo);
+        sox_delete_effects_chain(chain);
+        soxClose(out);
+        free(out_snd.buffer);
+        out_snd.buffer = NULL;
+        return out_snd;
+    }
+    sox_add_effect(chain, eo, &interm_signal, &out->signal);
+    free(eo);
+
+    int err = soxFlowEffects(chain);
+    sox_delete_effects_chain(chain);
+    uint64_t outsamples = out->olength;
+    soxClose(out);
+    if (err != SOX_SUCCESS)
+    {
+        LOG(ERROR) << "sox_flow_effects failed";
+        free(out_snd.buffer);
+        out_snd.buffer = NULL;
+        out_snd.size = 0;
+        return out_snd;
+    }
+    if (outsamples == 0)
+    {
+        free(out_snd.buffer);
+        out_snd.buffer = (void*)"";
+        out_snd.size = 0;
+        return out_snd;
+    }
+    if (wav)
+    {
+        writeWAVHeader((char*)out_snd.buffer, out_snd.size-44, 16000, 1);
+    }
+    out_snd.offset = 0;
+    out_snd.timems = outsamples * 1000 / out_signal.rate;
+    VLOG(0) << "[Stream] size=" << out_snd.size << " timems=" << out_snd.timems;
+    return out_snd;
+}
+
+snd_file process_sox_stream(AudioStretcher *stretcher, const std::string &sox, const void *data, size_t size, const char* filetype, bool finish)
+{
+    sox_stream_source source;
+    init_sox_stream_source(&source, stretcher, data, size, finish);
+    return process_sox_stream_source(source, sox, size, filetype);
+}
+
+snd_file process_sox_decode_stream(AudioStretcher *stretcher, const std::string &sox, const void *data, size_t size, const char* sourcefiletype, const char* filetype)
+{
+    snd_file out_snd = { NULL, 0 };
+    SoxDecoder decoder(data, size, sourcefiletype);
+    if (!decoder.valid())
+    {
+        return out_snd;
+    }
+    sox_stream_source source;
+    init_sox_stream_source(&source, stretcher, NULL, 0, true);
+    source.decoder = &decoder;
+    return process_sox_stream_source(source, sox, decoder.estimatedFrames() * sizeof(int16_t), filetype);
+}
+
+snd_file process_sox_chain_list(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype)
+{
+    std::vector<std::string> appliedsox;
+    normalize_sox_list(soxlist);
+    // 单段时变速、效果和编码在一条效果链中完成，不需要为变速结果和WAV头分配中间缓存
+    // 长文本整段变速可以拆分到多个线程，不使用单线程的效果链
+    bool parallel = useParallelStretch(size);
+    if (size > 0 && !parallel && soxlist.size() == 1 && !std::get<0>(soxlist[0]).empty() && std::get<0>(soxlist[0]).compare(0, 4, "pad=") != 0)
+    {
+        std::vector<std::tuple<std::string, int, int>> sections = soxlist;
+        bool usable = false;
+        std::unique_ptr<AudioStretcher> stretcher = create_section_stretcher(sections, appliedsox, &usable);
+        if (usable)
         {
-            tmpsize = out_snd.size;
-            VLOG(0) << "[Out] size=" << out_snd.size << " rate=" << out->signal.rate << " channels=" << out->signal.channels << " precision=" << out->signal.precision << " length="  << out->signal.length;
-            sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
-            if (outbuf != NULL)
+            snd_file out_snd = process_sox_stream(stretcher.get(), std::get<0>(sections[0]), data, size, filetype, true);
+            if (out_snd.buffer != NULL)
             {
-                free(outbuf);
-            }
-            if (strcasecmp(filetype, "wav")==0 || strcasecmp(filetype, "")==0)
-            {
-                writeWAVHeader((char*)out_snd.buffer, out_snd.size-44, 16000, 1);
+                return out_snd;
             }
-            out_snd.timems = (i>0) ? totalms : (strcasecmp(filetype, "wav")==0 || strcasecmp(filetype, "")==0 || strcasecmp(filetype, "raw")==0) ? (out_snd.size-44) /32 : interm_signal.length / 16;
-            break;
-        }
-        else
-        {
-            sox_delete_effects_chain(chain);
-            sox_close(out);
-            sox_close(in);
-            out_snd.parts.push_back(snd_part(totalout, totalout + interm_signal.length * 2, totalms, totalms + interm_signal.length / 16, std::get<2>(soxlist[i]), outputsox));
-            totalout += interm_signal.length * 2;
-            totalms += interm_signal.length / 16;
-            VLOG(0) << "[" << i << "] out=" << totalout << " in=" << totalin << " timems=" << totalms;
         }
+        appliedsox.clear();
     }
-    if (out_snd.size == 0 && tmpsize > 0) {
-        out_snd.size = -tmpsize;
+    // 多段的tempo使用同一个变速器一次完成，不需要为每一段建立sox效果链
+    void *stretched = NULL;
+    size_t stretchedsize = 0;
+    if ((soxlist.size() > 1 || parallel) && stretchSoxTempoMap(soxlist, data, size, &stretched, stretchedsize, appliedsox))
+    {
+        data = stretched;
+        size = stretchedsize;
     }
-    if (out_snd.buffer != inbuf)
+    snd_file out_snd = process_sox_chain_list_sections(soxlist, data, size, filetype, appliedsox);
+    if (stretched != NULL && out_snd.buffer != stretched)
     {
-        free(inbuf);
+        free(stretched);
     }
-    //sox_quit();
     return out_snd;
 }
 /*
@@ -1220,216 +1681,22 @@ snd_file process_sox_chain(std::string sox, const void *data, size_t size, const
 }
 */
 
-    snd_file process_sox_effect_chain(std::vector<std::tuple<std::string, int, int>>& soxList,
+    snd_file process_sox_effect_list(std::vector<std::tuple<std::string, int, int>>& soxList,
                                       const void* data,
                                       size_t size,
                                       const char* filetype) {
-        // 初始化结构体
-        snd_file out_snd;
-        out_snd.buffer = nullptr;
-        out_snd.offset = 0;
-        out_snd.size = 0;
-        out_snd.timems = 0;
-        out_snd.parts.clear();
-
-        if (soxList.empty() && strcasecmp(filetype, "raw") == 0) {
-            // 表示没有效果要处理，同时是裸数据，那么直接通过
-            out_snd.buffer = (char*) data;
-            out_snd.size = size;
-            out_snd.timems = size / 2 / 16000 * 1000;
-            return out_snd;
-        }
-
-        // 将输入构建成为wav的形式
-        char* inbuf = (char*) calloc(size + 44, sizeof(char));
-        if (inbuf == nullptr) {
-            // 分配内存失败
-            LOG(ERROR) << "Calloc buffer failed, size " << size + 44;
-            return out_snd;
-        }
-
-        // 将wav文件头写入到inbuf中
-        writeWAVHeader(inbuf, size, 16000, 1);
-        // 将数据写入到inbuf中
-        memcpy(inbuf + 44, data, size);
-
-//        // dump inbuf数据
-//        std::ofstream outStream("inbuf.wav",
-//                                std::ios::out | std::ios::binary);
-//        for (int i = 0; i < size + 44; i++) {
-//            outStream.write(inbuf + i, sizeof(char));
-//        }
-
-        out_snd.buffer = inbuf;
-        out_snd.offset = 0;
-        out_snd.size = size + 44;
-        out_snd.timems = size / 32;
-
-        if (soxList.empty() && (strcasecmp(filetype, "wav") == 0 || strcasecmp(filetype, "") == 0)) {
-            return out_snd;
-        }
-
-        // Reading and writing audio files stored in memory buffers
-        // rather than actual files.
-//        char* inBufferData = inbuf;
-//        int inBufferSize = int(size) + 44;
-//
-//        sox_format_t* in, *out;
-//
-//        in = sox_open_mem_read(inBufferData, inBufferSize, NULL, NULL, NULL);
-//        out = sox_open_write("outBuffer.wav", &in->signal, NULL, NULL, NULL, NULL);
-//
-//#define MAX_SAMPLES (size_t)2048
-//        size_t numberRead;
-//        sox_sample_t samples[MAX_SAMPLES];
-//        while ((numberRead = sox_read(in, samples, MAX_SAMPLES))) {
-//            sox_write(out, samples, numberRead);
-//        }
-//        sox_close(in);
-//        sox_close(out);
-
-        // 效果处理
-        sox_format_t* in, *out;     // input and output files
-        sox_effects_chain_t* chain;
-        sox_effect_t* e;
-        char* args[10];
-
-        sox_signalinfo_t interm_signal; // intermediate points in the chain.
-        char* inBufferData = inbuf;
-        int inBufferSize = int(size) + 44;
-
-        // 默认使用MP3进行输出
-        sox_encodinginfo_t out_encoding = {
-                SOX_ENCODING_MP3,
-                0,
-                32,
-                sox_option_default,
-                sox_option_default,
-                sox_option_default,
-                sox_false
-        };
-
-        if (strcasecmp(filetype, "wav") == 0) {
-            out_encoding.encoding = SOX_ENCODING_FLOAT;
-            out_encoding.compression = 0;
-        }
-
-        sox_signalinfo_t out_signal = {
-                16000,
-                1,
-                0,
-                0,
-                nullptr
-        };
-
-        in = sox_open_mem_read(inBufferData,
-                               inBufferSize,
-                               nullptr,
-                               nullptr,
-                               "wav");
-
-        uint64_t unique_num = uniqueFileBase.fetch_add(1);
-        std::string file_name;
-        if (strcasecmp(filetype, "mp3") == 0)
-            file_name = std::to_string(unique_num) + ".mp3";
-        else if (strcasecmp(filetype, "wav") == 0)
-            file_name = std::to_string(unique_num) + ".wav";
-
-        out = sox_open_write(file_name.c_str(),
-                             &out_signal,
-                             &out_encoding,
-                             nullptr,
-                             nullptr,
-                             nullptr);
-
-        chain = sox_create_effects_chain(&in->encoding, &out->encoding);
-
-        interm_signal = in->signal; // deep copy
-
-        e = sox_create_effect(sox_find_effect("input"));
-        args[0] = (char*) in;
-        assert(sox_effect_options(e, 1, args) == SOX_SUCCESS);
-        assert(sox_add_effect(chain, e, &interm_signal, &in->signal) == SOX_SUCCESS);
-        free(e);
-
-        if (in->signal.rate != out->signal.rate) {
-            e = sox_create_effect(sox_find_effect("rate"));
-            assert(sox_effect_options(e, 0, nullptr) == SOX_SUCCESS);
-            assert(sox_add_effect(chain, e, &interm_signal, &out->signal) == SOX_SUCCESS);
-            free(e);
-        }
-
-        if (in->signal.channels != out->signal.channels) {
-            e = sox_create_effect(sox_find_effect("channels"));
-            assert (sox_effect_options(e, 0, nullptr) == SOX_SUCCESS);
-            assert(sox_add_effect(chain, e, &interm_signal, &out->signal) == SOX_SUCCESS);
-            free(e);
-        }
-
-        // 增加需要处理的效果
-        std::vector<std::string> effects;
-        effects.reserve(soxList.size());
+        // 所有效果作用于整段音频，合并为一段之后使用process_sox_chain_list的处理流程
+        std::string effects;
+        int phoneCount = 0;
         for (auto& l : soxList) {
-            effects.push_back(std::get<0>(l));
-        }
-
-        for (auto& effect : effects) {
-            size_t equal_pos = effect.find('=');
-            if (equal_pos != std::string::npos) {
-                std::string command = effect.substr(0, equal_pos);
-                std::string param = effect.substr(equal_pos + 1);   // 跳过等号
-
-                e = sox_create_effect(sox_find_effect(command.c_str()));
-                args[0] = (char*) param.c_str();
-                assert(sox_effect_options(e, 1, args) == SOX_SUCCESS);
-                assert(sox_add_effect(chain, e, &interm_signal, &out->signal) == SOX_SUCCESS);
-                free(e);
-
-                if (command == "tempo") {
-                    // 如果是变速，需要修改时间长度
-                    out_snd.timems = int(double(out_snd.timems) / strtod(param.c_str(), nullptr));
-                }
-            } else {
-                e = sox_create_effect(sox_find_effect(effect.c_str()));
-                assert(sox_effect_options(e, 0, nullptr) == SOX_SUCCESS);
-                assert(sox_add_effect(chain, e, &interm_signal, &out->signal) == SOX_SUCCESS);
-                free(e);
-            }
-        }
-
-        e = sox_create_effect(sox_find_effect("output"));
-        args[0] = (char*) out;
-        assert(sox_effect_options(e, 1, args) == SOX_SUCCESS);
-        assert(sox_add_effect(chain, e, &interm_signal, &out->signal) == SOX_SUCCESS);
-        free(e);
-
-        sox_flow_effects(chain, nullptr, nullptr);
-
-        sox_delete_effects_chain(chain);
-        sox_close(out);
-        sox_close(in);
-
-        uint64_t file_size = std::filesystem::file_size(file_name);
-
-        // 读文件操作
-        std::ifstream in_stream;
-        in_stream.open(file_name, std::ios::binary);
-
-        char* out_buffer = (char*) calloc(file_size, sizeof(char));
-        in_stream.read((char*) out_buffer, long (sizeof(char)) * long(file_size));
-
-        out_snd.buffer = out_buffer;
-        out_snd.size = file_size;
-
-        // 关闭流
-        in_stream.close();
-
-        if (inbuf) {
-            free(inbuf);
-            inbuf = nullptr;
+            if (std::get<0>(l).empty())
+                continue;
+            effects += (effects.empty() ? "" : "#") + std::get<0>(l);
+            phoneCount += std::get<2>(l);
         }
-        std::remove(file_name.c_str());
-
-        return out_snd;
+        std::vector<std::tuple<std::string, int, int>> sections;
+        if (!effects.empty())
+            sections.emplace_back(effects, int(size), phoneCount);
+        return process_sox_chain_list(sections, data, size, filetype);
     }
 }
@@ -16,6 +16,12 @@ void writeWAVHeader(
     int sampleRate,
     short channels);
 
+// 流式WAV的44字节文件头，长度未知，RIFF和data的大小都是0xFFFFFFFF，之后直接拼接裸数据
+void writeStreamingWAVHeader(
+    char* buffer,
+    int sampleRate,
+    short channels);
+
 template <typename T>
 void write(std::ofstream& stream, const T& t) {
   stream.write((const char*)&t, sizeof(T));
@@ -90,27 +96,68 @@ typedef struct snd_file {
 
 void dumpSndFile(const snd_file& sndFile);
 
+/**
+ * 在建立任何效果链之前去掉不起作用的效果：tempo=1.0(误差0.005以内)，vol=1，pitch=0，以及长度为0的pad=0
+ * 所有段都没有效果时合并为一段空效果，之后和空的soxlist一样直接输出
+ *
+ * @return soxlist是否有变化
+ */
+bool normalize_sox_list(std::vector<std::tuple<std::string, int, int>> &soxlist);
+
+// 把sourcefiletype格式的音频解码为16k单声道s16的WAV，返回的缓存由调用者free
 void* process_sox_decode_wav(const void *data, size_t size, const char* sourcefiletype, size_t *outsize);
+/**
+ * 和process_sox_chain_list相同，输入可以是raw、WAV或者sox支持的压缩格式
+ * raw和16k单声道s16的WAV直接使用，其他格式先解码，之后都使用process_sox_chain_list处理
+ * 压缩格式只有一段效果时使用process_sox_decode_stream边解码边处理
+ * 输出直接使用输入时，buffer为data，offset为数据在data中的偏移
+ */
 snd_file process_sox_chain_list_type(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype, const char* sourcefiletype);
 snd_file process_sox_chain_list(std::vector<std::tuple<std::string, int, int>> &soxlist, const void *data, size_t size, const char* filetype);
+
+class AudioStretcher;
+
+/**
+ * 变速、sox效果和编码在一条sox效果链中完成
+ * 变速器作为效果链的输入，每次只处理一个数据块，不需要为变速结果、WAV头和效果输出分配完整的中间缓存
+ *
+ * @param stretcher 变速器，为NULL时不变速，流式处理时可以在多次调用之间保持状态
+ * @param sox sox效果，格式和soxlist中的一段相同，例如"vol=2#pitch=100"，不能包含pad
+ * @param data 16k单声道s16裸数据
+ * @param filetype 输出的文件类型，opus为Ogg Opus，opus-raw为带2字节长度的opus packet
+ * @param finish 数据送完之后是否冲刷变速器，流式处理的最后一个分片为true
+ * @return 失败时buffer为NULL；没有输出采样时size为0，buffer不需要释放；其他情况buffer由调用者free
+ */
+snd_file process_sox_stream(AudioStretcher *stretcher, const std::string &sox, const void *data, size_t size, const char* filetype, bool finish);
+
+/**
+ * 和process_sox_stream相同，输入为sourcefiletype格式的压缩音频(mp3、ogg等)
+ * 解码器每次只解码一块送入变速器和效果链，不保存完整的解码结果
+ *
+ * @return 无法解码时buffer为NULL
+ */
+snd_file process_sox_decode_stream(AudioStretcher *stretcher, const std::string &sox, const void *data, size_t size, const char* sourcefiletype, const char* filetype);
 //snd_file process_sox_chain(std::string sox, const void *data, size_t size, const char* filetype);
 
 /**
  * 将sox效果作用于音频流上，比如变速
+ * 所有效果合并为一段，使用process_sox_chain_list处理
+ * 代替原来的process_sox_effect_chain：输出格式和内存的归属都和原来不同(见下面的返回值)，
+ * 因此使用新的名称，原来的调用者需要按照新的约定修改
  *
- * @param soxList 实际上std::vector没有作用，相当于size位1，可以通过"tempo=0.94" 104960 65 进行构建
+ * @param soxList 每一项为一个效果，全部作用于整段音频，可以通过"tempo=0.94" 104960 65 进行构建
  *                tempo=0.94表示sox音效，104960表示文件大小，65表示phone个数，phone这里没有用到
  * @param data 一串裸数据，比如数据格式为s16le, 声道数量为1, 采样率为16000
  *             可以通过ffplay -f s16le -ac 1 -ar 16000 data进行播放
  *             后续对音频的所有操作都暗示数据格式必须为s16le，声道数为1，采样率为16000
  * @param size 裸数据的大小，byte为单位，和soxList里面size相同
- * @param filetype 想要得到的文件类型，有"wav", "mp3"两种类型
+ * @param filetype 想要得到的文件类型，和process_sox_chain_list相同，例如"wav", "raw", "mp3", "flac"
  * @return 返回snd_file结构体，buffer存储目标文件的内存；offset表示目前文件相对于buffer起始位置的偏移；
  *          size表示buffer的总大小，文件的大小为(size - offset)bytes；timems表示文件的时长，ms为单位
- *          经过变速后的时长和最初文件的时长不相等；parts目前为空，没有用到
- *          重点：buffer数据使用者负责清理，返回的数据格式mp3为fltp，wav为flt
+ *          经过变速后的时长和最初文件的时长不相等；parts记录效果，没有用到
+ *          重点：buffer可能直接指向data，不是data时由使用者负责清理；wav为s16格式，和process_sox_chain_list相同
  */
-snd_file process_sox_effect_chain(std::vector<std::tuple<std::string, int, int>>& soxList,
+snd_file process_sox_effect_list(std::vector<std::tuple<std::string, int, int>>& soxList,
                                   const void* data,
                                   size_t size,
                                   const char* filetype);
@@ -0,0 +1,236 @@
+#include "glog/logging.h"
+#include "server_base/effect_chain.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace WL::Service::Base {
+
+static const size_t kDefaultCacheSize = 256;
+// tempo按照重叠的分段处理，输出会比理想长度多出一些
+static const double kEstimateMargin = 1.05;
+static const size_t kEstimateSlack = 8192;
+
+// 只改变音量、音色或者采样率的效果，输出按照输入的采样率计算时长度不变
+static const char* const kLengthPreserving[] = {
+    "vol", "gain", "pitch", "bass", "treble", "equalizer", "highpass", "lowpass", "bandpass",
+    "bandreject", "norm", "dither", "channels", "rate", "remix", "contrast", "compand", "overdrive",
+    "fade", "dcshift", "loudness", "allpass", "band",
+};
+
+// 释放没有添加到效果链中的效果
+static void deleteEffect(sox_effect_t* effp) {
+    if (effp == nullptr)
+        return;
+    if (effp->handler.kill != nullptr)
+        effp->handler.kill(effp);
+    free(effp->priv);
+    free(effp);
+}
+
+static EffectType effectType(const std::string& name) {
+    if (name == "tempo")
+        return EffectType::Tempo;
+    if (name == "vol")
+        return EffectType::Vol;
+    if (name == "pitch")
+        return EffectType::Pitch;
+    if (name == "pad")
+        return EffectType::Pad;
+    return EffectType::Other;
+}
+
+static bool parseEffect(const std::string& text, SoxEffect& effect) {
+    effect.text = text;
+    size_t pos = text.find('=');
+    effect.name = text.substr(0, pos);
+    if (pos != std::string::npos) {
+        size_t start = pos + 1;
+        while (start < text.length() && effect.args.size() < SoxEffect::kMaxArgs) {
+            size_t end = text.find('_', start);
+            if (end == std::string::npos)
+                end = text.length();
+            effect.args.push_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    effect.type = effectType(effect.name);
+    if (!effect.args.empty() && !effect.args[0].empty()) {
+        char* parsed = nullptr;
+        effect.value = strtod(effect.args[0].c_str(), &parsed);
+        effect.numeric = *parsed == '\0';
+    }
+
+    effect.handler = sox_find_effect(effect.name.c_str());
+    if (effect.handler == nullptr) {
+        LOG(WARNING) << "Unknown sox effect " << effect.name;
+        return false;
+    }
+    // 参数只检查一次，sox_effect_options失败的效果在之后的请求中也不再尝试
+    sox_effect_t* effp = sox_create_effect(effect.handler);
+    if (effp == nullptr)
+        return false;
+    char* argv[SoxEffect::kMaxArgs];
+    for (size_t i = 0; i < effect.args.size(); i++)
+        argv[i] = (char*) effect.args[i].c_str();
+    if (sox_effect_options(effp, (int) effect.args.size(), argv) != SOX_SUCCESS) {
+        LOG(WARNING) << "Invalid sox effect " << text;
+        deleteEffect(effp);
+        return false;
+    }
+    // 有kill的效果在解析参数时分配了内存，不能共用，每次重新解析
+    if (effp->handler.kill == nullptr)
+        effect.prototype.reset(effp, deleteEffect);
+    else
+        deleteEffect(effp);
+    return true;
+}
+
+static bool preservesLength(const std::string& name) {
+    for (const char* known : kLengthPreserving) {
+        if (name == known)
+            return true;
+    }
+    return false;
+}
+
+// pad的参数为"长度"或者"长度@位置"，每个参数增加一段静音
+static double padLength(const SoxEffect& effect) {
+    double seconds = 0.0;
+    for (const auto& arg : effect.args)
+        seconds += std::max(atof(arg.c_str()), 0.0);
+    return seconds;
+}
+
+std::shared_ptr<const EffectChain> EffectChain::compile(const std::string& sox) {
+    auto chain = std::make_shared<EffectChain>();
+    chain->source_ = sox;
+    size_t start = 0;
+    while (start < sox.length()) {
+        size_t end = sox.find('#', start);
+        if (end == std::string::npos)
+            end = sox.length();
+        std::string text = sox.substr(start, end - start);
+        start = end + 1;
+        if (text.empty())
+            continue;
+        SoxEffect effect;
+        if (!parseEffect(text, effect))
+            continue;
+        if ((effect.type == EffectType::Tempo || effect.name == "speed") && effect.numeric && effect.value > 0.0)
+            chain->lengthRatio_ /= effect.value;
+        else if (effect.type == EffectType::Pad)
+            chain->padSeconds_ += padLength(effect) / chain->lengthRatio_;
+        else if (!preservesLength(effect.name))
+            chain->bounded_ = false;
+        chain->effects_.push_back(std::move(effect));
+    }
+    return chain;
+}
+
+size_t EffectChain::estimateOutputSize(size_t inputSize, int bytesPerSecond) const {
+    if (!bounded_)
+        return inputSize * kUnboundedRatio + kEstimateSlack;
+    double estimate = (double(inputSize) + padSeconds_ * bytesPerSecond) * lengthRatio_ * kEstimateMargin;
+    return size_t(estimate) + kEstimateSlack;
+}
+
+const SoxEffect* EffectChain::find(EffectType type) const {
+    for (const auto& effect : effects_) {
+        if (effect.type == type)
+            return &effect;
+    }
+    return nullptr;
+}
+
+size_t EffectChain::addTo(sox_effects_chain_t* chain,
+                          sox_signalinfo_t* intermSignal,
+                          const sox_signalinfo_t* outSignal,
+                          std::vector<std::string>* applied) const {
+    size_t count = 0;
+    for (const auto& effect : effects_) {
+        sox_effect_t* effp = sox_create_effect(effect.handler);
+        if (effp == nullptr)
+            continue;
+        bool ok = true;
+        if (effect.prototype) {
+            // 和sox_add_effect为多个声道复制效果的方式相同
+            if (effect.handler->priv_size > 0)
+                memcpy(effp->priv, effect.prototype->priv, effect.handler->priv_size);
+            effp->out_signal = effect.prototype->out_signal;
+        } else {
+            char* argv[SoxEffect::kMaxArgs];
+            for (size_t i = 0; i < effect.args.size(); i++)
+                argv[i] = (char*) effect.args[i].c_str();
+            ok = sox_effect_options(effp, (int) effect.args.size(), argv) == SOX_SUCCESS;
+        }
+        if (ok && sox_add_effect(chain, effp, intermSignal, outSignal) == SOX_SUCCESS) {
+            count++;
+            if (applied != nullptr)
+                applied->push_back(effect.text);
+            VLOG(1) << chain->length << ") sox_" << effect.text << " rate=" << intermSignal->rate
+                    << " channels=" << intermSignal->channels << " length=" << intermSignal->length;
+        } else {
+            // 添加成功时priv属于效果链，失败时仍然属于effp
+            free(effp->priv);
+        }
+        free(effp);
+    }
+    return count;
+}
+
+// 最近使用的在前面
+static std::mutex cacheMutex;
+static size_t cacheCapacity = kDefaultCacheSize;
+static std::list<std::pair<std::string, std::shared_ptr<const EffectChain>>> cacheList;
+static std::unordered_map<std::string, decltype(cacheList)::iterator> cacheIndex;
+
+static void trimCache() {
+    while (cacheList.size() > cacheCapacity) {
+        cacheIndex.erase(cacheList.back().first);
+        cacheList.pop_back();
+    }
+}
+
+std::shared_ptr<const EffectChain> compileEffectChain(const std::string& sox) {
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto found = cacheIndex.find(sox);
+        if (found != cacheIndex.end()) {
+            cacheList.splice(cacheList.begin(), cacheList, found->second);
+            return found->second->second;
+        }
+    }
+
+    // 解析时不持有锁，其他线程同时编译了相同的字符串时使用先放入缓存的结果
+    std::shared_ptr<const EffectChain> chain = EffectChain::compile(sox);
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (cacheCapacity == 0)
+        return chain;
+    auto found = cacheIndex.find(sox);
+    if (found != cacheIndex.end()) {
+        cacheList.splice(cacheList.begin(), cacheList, found->second);
+        return found->second->second;
+    }
+    cacheList.emplace_front(sox, chain);
+    cacheIndex[sox] = cacheList.begin();
+    trimCache();
+    return chain;
+}
+
+void setEffectChainCacheSize(size_t size) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    cacheCapacity = size;
+    trimCache();
+}
+
+size_t effectChainCacheSize() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return cacheCapacity;
+}
+
+}
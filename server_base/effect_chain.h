@@ -0,0 +1,107 @@
+#ifndef SERVICE_BASE_EFFECT_CHAIN_H_
+#define SERVICE_BASE_EFFECT_CHAIN_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sox.h"
+
+namespace WL::Service::Base {
+
+// 需要单独处理的效果，其他效果都是Other
+enum class EffectType {
+    Tempo,
+    Vol,
+    Pitch,
+    Pad,
+    Other
+};
+
+/**
+ * 解析之后的一个sox效果，例如"tempo=0.94"
+ * 参数之间使用'_'分隔，最多kMaxArgs个
+ */
+struct SoxEffect {
+    static const size_t kMaxArgs = 10;
+
+    EffectType type = EffectType::Other;
+    // 原始文本，记录到snd_part的soxlist中
+    std::string text;
+    std::string name;
+    std::vector<std::string> args;
+    // 第一个参数为数字时的值
+    bool numeric = false;
+    double value = 0.0;
+    const sox_effect_handler_t* handler = nullptr;
+    // 已经通过sox_effect_options的效果，没有kill的效果可以直接复制私有数据，不需要再次解析参数
+    std::shared_ptr<sox_effect_t> prototype;
+};
+
+/**
+ * soxlist一段的效果链，例如"tempo=0.94#vol=1.2"
+ *
+ * 编译时完成分词、查找效果和检查参数，未知的效果和参数错误的效果被去掉。
+ * 编译之后不再修改，可以在多个线程中共用
+ */
+class EffectChain {
+public:
+    // 解析并检查sox字符串，不使用缓存
+    static std::shared_ptr<const EffectChain> compile(const std::string& sox);
+
+    const std::string& source() const { return source_; }
+
+    const std::vector<SoxEffect>& effects() const { return effects_; }
+
+    bool empty() const { return effects_.empty(); }
+
+    // 找到第一个type类型的效果，没有时返回nullptr
+    const SoxEffect* find(EffectType type) const;
+
+    /**
+     * 把效果依次添加到sox效果链中，效果的参数在链删除之前需要保持有效，调用者需要持有EffectChain
+     *
+     * @param applied 不为空时记录成功添加的效果文本
+     * @return 成功添加的效果数
+     */
+    size_t addTo(sox_effects_chain_t* chain,
+                 sox_signalinfo_t* intermSignal,
+                 const sox_signalinfo_t* outSignal,
+                 std::vector<std::string>* applied = nullptr) const;
+
+    /**
+     * 估计输出的大小，用于分配输出缓存，结果略大于实际的输出
+     * tempo、speed和pad按照参数计算，不改变长度的效果不计算，
+     * 其他效果(例如reverb、repeat)的输出长度无法预测，按照输入的kUnboundedRatio倍估计
+     *
+     * @param inputSize 输入的大小，byte为单位，输出和输入的采样格式相同
+     * @param bytesPerSecond 每秒的字节数，用于计算pad
+     */
+    size_t estimateOutputSize(size_t inputSize, int bytesPerSecond = 32000) const;
+
+    // 输出长度是否可以按照参数计算
+    bool bounded() const { return bounded_; }
+
+    static const int kUnboundedRatio = 16;
+
+private:
+    std::string source_;
+    std::vector<SoxEffect> effects_;
+    // 输出和输入的长度之比，以及pad增加的秒数
+    double lengthRatio_ = 1.0;
+    double padSeconds_ = 0.0;
+    bool bounded_ = true;
+};
+
+/**
+ * 通过LRU缓存取得编译之后的效果链，相同的sox字符串只解析一次
+ * 缓存线程安全，容量为effectChainCacheSize()
+ */
+std::shared_ptr<const EffectChain> compileEffectChain(const std::string& sox);
+
+// 缓存容量，初始为256，设置为0时不使用缓存
+void setEffectChainCacheSize(size_t size);
+size_t effectChainCacheSize();
+
+}
+#endif
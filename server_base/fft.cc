@@ -0,0 +1,80 @@
+#include "glog/logging.h"
+#include "server_base/fft.h"
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace WL::Service::Base {
+
+const FFTPlan& FFTPlan::get(int size) {
+    static std::mutex mutex;
+    static std::map<int, std::unique_ptr<FFTPlan>> plans;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<FFTPlan>& plan = plans[size];
+    if (!plan) {
+        CHECK(size > 0 && (size & (size - 1)) == 0) << "FFT size must be power of 2, size " << size;
+        plan.reset(new FFTPlan(size));
+    }
+    return *plan;
+}
+
+FFTPlan::FFTPlan(int size)
+        : size_(size),
+          bitReverse_(size),
+          twiddles_(size / 2) {
+    int bits = 0;
+    while ((1 << bits) < size)
+        bits++;
+    for (int i = 0; i < size; i++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b))
+                reversed |= 1 << (bits - 1 - b);
+        }
+        bitReverse_[i] = reversed;
+    }
+    for (int i = 0; i < size / 2; i++) {
+        double angle = -2.0 * M_PI * i / size;
+        twiddles_[i] = std::complex<float>(float(std::cos(angle)), float(std::sin(angle)));
+    }
+}
+
+void FFTPlan::forward(std::complex<float>* data) const {
+    transform(data, false);
+}
+
+void FFTPlan::inverse(std::complex<float>* data) const {
+    transform(data, true);
+    const float scale = 1.0f / float(size_);
+    for (int i = 0; i < size_; i++) {
+        data[i] *= scale;
+    }
+}
+
+void FFTPlan::transform(std::complex<float>* data, bool inverse) const {
+    for (int i = 0; i < size_; i++) {
+        int j = bitReverse_[i];
+        if (i < j)
+            std::swap(data[i], data[j]);
+    }
+    for (int len = 2; len <= size_; len <<= 1) {
+        int half = len / 2;
+        int step = size_ / len;
+        for (int start = 0; start < size_; start += len) {
+            for (int k = 0; k < half; k++) {
+                // 手动展开复数乘法，避免std::complex对inf和nan的额外检查
+                const std::complex<float>& w = twiddles_[k * step];
+                float wr = w.real();
+                float wi = inverse ? -w.imag() : w.imag();
+                const std::complex<float>& x = data[start + k + half];
+                std::complex<float> t(wr * x.real() - wi * x.imag(), wr * x.imag() + wi * x.real());
+                data[start + k + half] = data[start + k] - t;
+                data[start + k] += t;
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef SERVICE_BASE_FFT_H_
+#define SERVICE_BASE_FFT_H_
+
+#include <complex>
+#include <vector>
+
+namespace WL::Service::Base {
+
+/**
+ * 基2复数FFT的计算计划，包含位反转表和旋转因子表
+ * 同一个大小的计划在进程内只创建一次，创建之后只读，可以在多个线程中同时使用
+ */
+class FFTPlan {
+public:
+    /**
+     * 获取指定大小的计划，第一次获取时创建
+     *
+     * @param size FFT大小，必须是2的幂
+     */
+    static const FFTPlan& get(int size);
+
+    int size() const { return size_; }
+
+    // 原地正变换
+    void forward(std::complex<float>* data) const;
+
+    // 原地逆变换，结果已经除以size
+    void inverse(std::complex<float>* data) const;
+
+private:
+    explicit FFTPlan(int size);
+
+    void transform(std::complex<float>* data, bool inverse) const;
+
+    int size_;
+    std::vector<int> bitReverse_;
+    // twiddles_[i] = exp(-2 * pi * i / size), i < size / 2
+    std::vector<std::complex<float>> twiddles_;
+};
+
+}
+#endif
@@ -0,0 +1,128 @@
+#ifndef SERVICE_BASE_FLOAT_STRETCHER_H_
+#define SERVICE_BASE_FLOAT_STRETCHER_H_
+
+#include <algorithm>
+#include <vector>
+#include "glog/logging.h"
+#include "server_base/sample_utils.h"
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 把只处理float数据的变速内核包装成AudioStretcher，负责s16和float之间的转换
+ * 数据为交错格式，planar采样格式按照对应的交错格式处理
+ *
+ * Engine需要提供(数据都是交错的float，nbFrames为每个声道的采样数):
+ *   Engine(float tempo, int sampleRate, int channels);
+ *   float tempo() const;
+ *   void setTempo(float tempo);
+ *   void push(const float* samples, size_t nbFrames);
+ *   size_t pull(std::vector<float>& out);
+ *   void finish();
+ *   void reset();
+ *   int64_t latency() const;
+ *   static constexpr float kMinTempo, kMaxTempo;
+ */
+template <typename Engine>
+class FloatStretcher : public AudioStretcher {
+public:
+    FloatStretcher(float tempo,
+                   int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                   int sampleRate = 16000,
+                   AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16)
+            : engine_(tempo, sampleRate, std::max(av_get_channel_layout_nb_channels(channelLayout), 1)),
+              sampleFormat_(av_get_packed_sample_fmt(sampleFormat)),
+              channels_(av_get_channel_layout_nb_channels(channelLayout)) {
+        if (tempo < Engine::kMinTempo || tempo > Engine::kMaxTempo) {
+            LOG(ERROR) << "Invalid tempo param, tempo " << tempo;
+            return;
+        }
+        if (channels_ <= 0) {
+            LOG(ERROR) << "Invalid channelLayout " << channelLayout;
+            return;
+        }
+        if (sampleFormat_ != AV_SAMPLE_FMT_S16 && sampleFormat_ != AV_SAMPLE_FMT_FLT) {
+            LOG(ERROR) << "Only s16 and flt are supported, sampleFormat " << sampleFormat;
+            return;
+        }
+        valid_ = true;
+    }
+
+    bool valid() const override { return valid_; }
+
+    float tempo() const override { return engine_.tempo(); }
+
+    bool setTempo(float tempo) override {
+        if (!valid_)
+            return false;
+        if (tempo < Engine::kMinTempo || tempo > Engine::kMaxTempo) {
+            LOG(ERROR) << "Invalid tempo param, tempo " << tempo;
+            return false;
+        }
+        engine_.setTempo(tempo);
+        return true;
+    }
+
+    bool push(const void* data, size_t size) override {
+        if (!valid_)
+            return false;
+        // 上一段已经冲刷，开始新的一段
+        if (finished_) {
+            engine_.reset();
+            finished_ = false;
+        }
+        if (sampleFormat_ == AV_SAMPLE_FMT_FLT) {
+            engine_.push((const float*) data, size / (sizeof(float) * channels_));
+            return true;
+        }
+        size_t nbFrames = size / (sizeof(int16_t) * channels_);
+        samples_.resize(nbFrames * channels_);
+        s16ToFloat((const int16_t*) data, samples_.data(), samples_.size());
+        engine_.push(samples_.data(), nbFrames);
+        return true;
+    }
+
+    using AudioStretcher::pull;
+
+    size_t pull(const SampleSink& sink) override {
+        if (!valid_)
+            return 0;
+        samples_.clear();
+        engine_.pull(samples_);
+        if (samples_.empty())
+            return 0;
+        if (sampleFormat_ == AV_SAMPLE_FMT_FLT) {
+            sink((const uint8_t*) samples_.data(), samples_.size() * sizeof(float));
+            return samples_.size() * sizeof(float);
+        }
+        converted_.resize(samples_.size());
+        floatToS16(samples_.data(), converted_.data(), samples_.size());
+        sink((const uint8_t*) converted_.data(), converted_.size() * sizeof(int16_t));
+        return converted_.size() * sizeof(int16_t);
+    }
+
+    bool finish() override {
+        if (!valid_)
+            return false;
+        engine_.finish();
+        finished_ = true;
+        return true;
+    }
+
+    int64_t latency() const override { return engine_.latency(); }
+
+protected:
+    Engine engine_;
+
+private:
+    AVSampleFormat sampleFormat_;
+    int channels_;
+    bool valid_ = false;
+    bool finished_ = false;
+    std::vector<float> samples_;
+    std::vector<int16_t> converted_;
+};
+
+}
+#endif
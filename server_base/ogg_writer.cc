@@ -0,0 +1,82 @@
+#include "server_base/ogg_writer.h"
+#include <cstring>
+
+namespace WL::Service::Base {
+
+static const size_t kPageHeaderSize = 27;
+static const uint8_t kFlagBos = 0x02;
+static const uint8_t kFlagEos = 0x04;
+
+// Ogg的CRC32，多项式0x04c11db7，不反转，初值和结果都不异或
+static const uint32_t* crcTable() {
+    static const struct Table {
+        uint32_t values[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i << 24;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04c11db7u : crc << 1;
+                values[i] = crc;
+            }
+        }
+    } table;
+    return table.values;
+}
+
+static uint32_t oggCrc(const uint8_t* data, size_t size) {
+    const uint32_t* table = crcTable();
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; i++)
+        crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 0xff];
+    return crc;
+}
+
+static void writeLE(uint8_t* dest, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        dest[i] = uint8_t(value >> (8 * i));
+}
+
+OggPageWriter::OggPageWriter(uint32_t serial) : serial_(serial) {}
+
+void OggPageWriter::reset(uint32_t serial) {
+    serial_ = serial;
+    sequence_ = 0;
+    granule_ = 0;
+    segments_.clear();
+    body_.clear();
+}
+
+bool OggPageWriter::addPacket(const uint8_t* data, size_t size, int64_t granule, AudioBuffer& out) {
+    // 长度为255的整数倍的packet以0结束
+    size_t lacing = size / 255 + 1;
+    if (segments_.size() + lacing > kMaxSegments && !flush(out))
+        return false;
+    for (size_t i = 0; i < lacing - 1; i++)
+        segments_.push_back(255);
+    segments_.push_back(uint8_t(size % 255));
+    body_.insert(body_.end(), data, data + size);
+    granule_ = granule;
+    return true;
+}
+
+bool OggPageWriter::flush(AudioBuffer& out, bool bos, bool eos) {
+    if (segments_.empty() && !bos && !eos)
+        return true;
+    page_.assign(kPageHeaderSize + segments_.size() + body_.size(), 0);
+    uint8_t* header = page_.data();
+    memcpy(header, "OggS", 4);
+    header[4] = 0;
+    header[5] = (bos ? kFlagBos : 0) | (eos ? kFlagEos : 0);
+    writeLE(header + 6, uint64_t(granule_), 8);
+    writeLE(header + 14, serial_, 4);
+    writeLE(header + 18, sequence_++, 4);
+    header[26] = uint8_t(segments_.size());
+    memcpy(header + kPageHeaderSize, segments_.data(), segments_.size());
+    memcpy(header + kPageHeaderSize + segments_.size(), body_.data(), body_.size());
+    writeLE(header + 22, oggCrc(page_.data(), page_.size()), 4);
+    segments_.clear();
+    body_.clear();
+    return out.append(page_.data(), page_.size());
+}
+
+}
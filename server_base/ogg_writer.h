@@ -0,0 +1,57 @@
+#ifndef SERVICE_BASE_OGG_WRITER_H_
+#define SERVICE_BASE_OGG_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "server_base/audio_buffer.h"
+
+namespace WL::Service::Base {
+
+/**
+ * Ogg页的封装(RFC 3533)，只支持一个逻辑流，packet不跨页
+ *
+ * 加入的packet在flush时写成一页，流式输出时每个分片flush一次，
+ * 客户端收到的每个分片都是完整的页，可以直接送入解码器
+ */
+class OggPageWriter {
+public:
+    // 一页最多255个lacing值
+    static const size_t kMaxSegments = 255;
+
+    explicit OggPageWriter(uint32_t serial = 0);
+
+    // 重新开始一个逻辑流，页序号从0开始
+    void reset(uint32_t serial);
+
+    /**
+     * 加入一个完整的packet，lacing值超过一页时先输出之前的packet
+     *
+     * @param granule packet结束时的granule position
+     */
+    bool addPacket(const uint8_t* data, size_t size, int64_t granule, AudioBuffer& out);
+
+    // 最后一个packet的granule position，用于修正流结束时的位置
+    void setGranule(int64_t granule) { granule_ = granule; }
+
+    /**
+     * 把加入的packet写成一页，没有packet并且不是bos/eos时不输出
+     *
+     * @param bos 逻辑流的第一页
+     * @param eos 逻辑流的最后一页，没有packet时输出空的页
+     */
+    bool flush(AudioBuffer& out, bool bos = false, bool eos = false);
+
+    bool empty() const { return segments_.empty(); }
+
+private:
+    uint32_t serial_;
+    uint32_t sequence_ = 0;
+    int64_t granule_ = 0;
+    std::vector<uint8_t> segments_;
+    std::vector<uint8_t> body_;
+    std::vector<uint8_t> page_;
+};
+
+}
+#endif
@@ -0,0 +1,245 @@
+#include "glog/logging.h"
+#include "server_base/parallel_stretch.h"
+#include "server_base/audio_buffer.h"
+#include "server_base/sample_utils.h"
+#include "server_base/thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <mutex>
+
+namespace WL::Service::Base {
+
+// 每一段的长度，短于两段时不拆分
+static const int kChunkSeconds = 10;
+// 相邻两段的重叠，每一段开头和结尾的输出都会受到变速器启动和冲刷的影响，拼接时只使用中间部分
+static const double kOverlapSeconds = 0.1;
+static const int kCrossfadeMs = 20;
+static const int kSearchMs = 10;
+
+static std::mutex poolMutex;
+static int poolThreads = 0;
+static std::unique_ptr<ThreadPool> pool;
+
+void setStretchThreads(int threads) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    poolThreads = threads;
+}
+
+static ThreadPool* stretchPool() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (!pool)
+        pool = std::make_unique<ThreadPool>(poolThreads);
+    return pool.get();
+}
+
+static int stretchThreads() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (pool)
+        return int(pool->size());
+    return poolThreads > 0 ? poolThreads : int(std::thread::hardware_concurrency());
+}
+
+bool useParallelStretch(size_t srcSize,
+                        int64_t channelLayout,
+                        int sampleRate,
+                        AVSampleFormat sampleFormat) {
+    if (sampleFormat != AV_SAMPLE_FMT_S16 && sampleFormat != AV_SAMPLE_FMT_FLT)
+        return false;
+    int channels = av_get_channel_layout_nb_channels(channelLayout);
+    if (channels <= 0 || sampleRate <= 0)
+        return false;
+    size_t frames = srcSize / (size_t(av_get_bytes_per_sample(sampleFormat)) * channels);
+    return frames >= size_t(sampleRate) * kChunkSeconds * 2 && stretchThreads() > 1;
+}
+
+// 变速之后的一段
+struct StretchChunk {
+    // 输入中的范围，以帧为单位
+    int64_t begin;
+    int64_t end;
+    void* data = nullptr;
+    size_t size = 0;
+};
+
+static void toFloat(const uint8_t* src, AVSampleFormat sampleFormat, float* dest, size_t n) {
+    if (sampleFormat == AV_SAMPLE_FMT_S16)
+        s16ToFloat((const int16_t*) src, dest, n);
+    else
+        std::memcpy(dest, src, n * sizeof(float));
+}
+
+static void fromFloat(const float* src, AVSampleFormat sampleFormat, uint8_t* dest, size_t n) {
+    if (sampleFormat == AV_SAMPLE_FMT_S16)
+        floatToS16(src, (int16_t*) dest, n);
+    else
+        std::memcpy(dest, src, n * sizeof(float));
+}
+
+/**
+ * 所有声道之和，用于搜索拼接位置
+ */
+static std::vector<float> mixDown(const uint8_t* src, AVSampleFormat sampleFormat, int channels, size_t frames) {
+    std::vector<float> samples(frames * channels);
+    toFloat(src, sampleFormat, samples.data(), samples.size());
+    if (channels == 1)
+        return samples;
+    std::vector<float> mix(frames, 0.0f);
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            mix[i] += samples[i * channels + c];
+        }
+    }
+    return mix;
+}
+
+/**
+ * 在search中搜索和ref最相似的位置，相似度为归一化的互相关
+ *
+ * @param search 长度为count + length - 1
+ * @return 0到count - 1之间的偏移
+ */
+static int64_t findAlignment(const float* ref, const float* search, size_t length, int64_t count) {
+    float energy = dotProduct(search, search, length);
+    float bestScore = -INFINITY;
+    int64_t best = 0;
+    for (int64_t d = 0; d < count; d++) {
+        float corr = dotProduct(ref, search + d, length);
+        float score = corr / std::sqrt(std::max(energy, 0.0f) + 1e-9f);
+        if (score > bestScore) {
+            bestScore = score;
+            best = d;
+        }
+        if (d + 1 < count)
+            energy += search[d + length] * search[d + length] - search[d] * search[d];
+    }
+    return best;
+}
+
+bool parallelTimeStretch(const std::string& engine,
+                         const void* srcData,
+                         size_t srcSize,
+                         void** destData,
+                         size_t& destSize,
+                         float tempo,
+                         int64_t channelLayout,
+                         int sampleRate,
+                         AVSampleFormat sampleFormat) {
+    if (!useParallelStretch(srcSize, channelLayout, sampleRate, sampleFormat)) {
+        std::unique_ptr<AudioStretcher> stretcher = createStretcher(engine, tempo, channelLayout, sampleRate, sampleFormat);
+        return stretcher && stretchBuffer(*stretcher, srcData, srcSize, destData, destSize);
+    }
+
+    const int channels = av_get_channel_layout_nb_channels(channelLayout);
+    const size_t bytesPerFrame = size_t(av_get_bytes_per_sample(sampleFormat)) * channels;
+    const auto frames = int64_t(srcSize / bytesPerFrame);
+    const int64_t chunkFrames = int64_t(sampleRate) * kChunkSeconds;
+    const auto overlap = int64_t(std::ceil(sampleRate * kOverlapSeconds * std::max(1.0f, tempo)));
+
+    // 最后一段不足一段时合并到前一段
+    std::vector<StretchChunk> chunks(size_t(frames / chunkFrames));
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].begin = std::max<int64_t>(int64_t(i) * chunkFrames - overlap, 0);
+        chunks[i].end = i + 1 < chunks.size() ? int64_t(i + 1) * chunkFrames + overlap : frames;
+    }
+
+    ThreadPool* threads = stretchPool();
+    std::vector<std::future<bool>> results;
+    results.reserve(chunks.size());
+    for (StretchChunk& chunk : chunks) {
+        results.push_back(threads->submit([&chunk, &engine, srcData, bytesPerFrame, tempo,
+                                           channelLayout, sampleRate, sampleFormat]() {
+            std::unique_ptr<AudioStretcher> stretcher = createStretcher(engine, tempo, channelLayout,
+                                                                        sampleRate, sampleFormat);
+            return stretcher && stretchBuffer(*stretcher,
+                                              (const uint8_t*) srcData + chunk.begin * bytesPerFrame,
+                                              size_t(chunk.end - chunk.begin) * bytesPerFrame,
+                                              &chunk.data,
+                                              chunk.size);
+        }));
+    }
+    bool ok = true;
+    for (auto& result : results) {
+        ok = result.get() && ok;
+    }
+
+    AudioBuffer out(size_t(double(srcSize) / tempo) + 64);
+    const auto crossfade = int64_t(sampleRate) * kCrossfadeMs / 1000;
+    const auto tolerance = int64_t(sampleRate) * kSearchMs / 1000;
+    std::vector<float> blendA;
+    std::vector<float> blendB;
+    std::vector<uint8_t> blended;
+    // 当前段从start开始的部分还没有输出
+    int64_t start = 0;
+    for (size_t i = 0; ok && i < chunks.size(); i++) {
+        const StretchChunk& a = chunks[i];
+        const auto* dataA = (const uint8_t*) a.data;
+        const auto lenA = int64_t(a.size / bytesPerFrame);
+        if (i + 1 == chunks.size()) {
+            start = std::min(start, lenA);
+            out.append(dataA + start * bytesPerFrame, size_t(lenA - start) * bytesPerFrame);
+            break;
+        }
+
+        // 分界点在两段各自输出中的位置
+        const StretchChunk& b = chunks[i + 1];
+        const auto* dataB = (const uint8_t*) b.data;
+        const auto lenB = int64_t(b.size / bytesPerFrame);
+        const int64_t boundary = int64_t(i + 1) * chunkFrames;
+        auto p = int64_t(std::llround(double(boundary - a.begin) / tempo));
+        const auto q = int64_t(std::llround(double(boundary - b.begin) / tempo));
+        int64_t margin = std::max<int64_t>(std::min({ q, lenA - p, lenB - q, p - start }), 0);
+        int64_t half = std::min(crossfade / 2, margin / 2);
+        int64_t search = std::min(tolerance, margin - half);
+        if (half <= 0) {
+            // 变速结果过短，直接在分界点切换
+            p = std::clamp<int64_t>(p, start, lenA);
+            out.append(dataA + start * bytesPerFrame, size_t(p - start) * bytesPerFrame);
+            start = std::clamp<int64_t>(q, 0, lenB);
+            continue;
+        }
+
+        std::vector<float> ref = mixDown(dataA + (p - half) * bytesPerFrame, sampleFormat, channels, size_t(2 * half));
+        std::vector<float> cand = mixDown(dataB + (q - search - half) * bytesPerFrame, sampleFormat, channels,
+                                          size_t(2 * (search + half)));
+        int64_t delta = findAlignment(ref.data(), cand.data(), ref.size(), 2 * search + 1) - search;
+
+        out.append(dataA + start * bytesPerFrame, size_t(p - half - start) * bytesPerFrame);
+        const size_t n = size_t(2 * half) * channels;
+        blendA.resize(n);
+        blendB.resize(n);
+        blended.resize(size_t(2 * half) * bytesPerFrame);
+        toFloat(dataA + (p - half) * bytesPerFrame, sampleFormat, blendA.data(), n);
+        toFloat(dataB + (q + delta - half) * bytesPerFrame, sampleFormat, blendB.data(), n);
+        for (int64_t k = 0; k < 2 * half; k++) {
+            float w = (float(k) + 0.5f) / float(2 * half);
+            for (int c = 0; c < channels; c++) {
+                size_t j = size_t(k) * channels + c;
+                blendA[j] += (blendB[j] - blendA[j]) * w;
+            }
+        }
+        fromFloat(blendA.data(), sampleFormat, blended.data(), n);
+        out.append(blended.data(), blended.size());
+        start = q + delta + half;
+    }
+
+    for (StretchChunk& chunk : chunks) {
+        free(chunk.data);
+    }
+    if (!ok) {
+        LOG(ERROR) << "Parallel stretch failed, chunks " << chunks.size();
+        return false;
+    }
+    void* tempDestData = out.release(destSize);
+    if (!tempDestData) {
+        LOG(ERROR) << "Error allocating buffer";
+        return false;
+    }
+    (*destData) = tempDestData;
+    VLOG(1) << "Parallel stretch, chunks " << chunks.size() << ", size " << srcSize << " -> " << destSize;
+    return true;
+}
+
+}
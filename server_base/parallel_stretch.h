@@ -0,0 +1,47 @@
+#ifndef SERVICE_BASE_PARALLEL_STRETCH_H_
+#define SERVICE_BASE_PARALLEL_STRETCH_H_
+
+#include <cstdint>
+#include <string>
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 设置多线程变速使用的线程数，0为硬件线程数，1关闭多线程变速
+ * 线程池在第一次多线程变速时创建，需要在这之前设置
+ */
+void setStretchThreads(int threads);
+
+/**
+ * 数据是否足够长、值得拆分成多段并行变速
+ * 只支持AV_SAMPLE_FMT_S16和AV_SAMPLE_FMT_FLT，线程数为1时总是返回false
+ */
+bool useParallelStretch(size_t srcSize,
+                        int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                        int sampleRate = 16000,
+                        AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+/**
+ * 多线程变速，用于文章、章节这样的长文本合成
+ *
+ * 输入按照10秒拆分，相邻两段前后各重叠100ms(tempo大于1时按比例加长)，每一段在线程池中单独变速。
+ * 拼接时在每个分界点前后各10ms的范围内搜索和前一段最相似的位置，然后做20ms的交叉淡化。
+ * 输出总长度和整段变速相差每个分界点不超过10ms。
+ * useParallelStretch为false时直接整段变速
+ *
+ * @param engine 变速引擎，和createStretcher相同
+ * @param destData [out] 目标数据，malloc分配，需要调用者释放
+ */
+bool parallelTimeStretch(const std::string& engine,
+                         const void* srcData,
+                         size_t srcSize,
+                         void** destData,
+                         size_t& destSize,
+                         float tempo,
+                         int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                         int sampleRate = 16000,
+                         AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+}
+#endif
@@ -0,0 +1,261 @@
+#include "glog/logging.h"
+#include "server_base/phase_vocoder.h"
+#include "server_base/fft.h"
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+
+namespace WL::Service::Base {
+
+// 每个线程一份的临时缓存，多个实例之间共享，避免每帧分配
+struct VocoderScratch {
+    std::vector<std::complex<float>> spectrum;
+    std::vector<float> magnitude;
+    std::vector<float> phase;
+    std::vector<int> peaks;
+};
+
+static VocoderScratch& vocoderScratch(int fftSize) {
+    static thread_local VocoderScratch scratch;
+    scratch.spectrum.resize(fftSize);
+    scratch.magnitude.resize(fftSize / 2 + 1);
+    scratch.phase.resize(fftSize / 2 + 1);
+    scratch.peaks.reserve(fftSize / 2 + 1);
+    return scratch;
+}
+
+// 把相位折叠到[-pi, pi]
+static inline float principalArg(float phase) {
+    return phase - float(2.0 * M_PI) * std::nearbyint(phase / float(2.0 * M_PI));
+}
+
+// 帧长取不小于32ms的2的幂，16k时为512
+static int vocoderFrameSize(int sampleRate) {
+    int fftSize = 256;
+    while (fftSize < sampleRate * 32 / 1000)
+        fftSize <<= 1;
+    return fftSize;
+}
+
+PhaseVocoder::PhaseVocoder(float tempo, int sampleRate, int channels)
+        : tempo_(tempo),
+          channels_(channels),
+          fftSize_(vocoderFrameSize(sampleRate)),
+          hop_(fftSize_ / 4),
+          plan_(FFTPlan::get(fftSize_)) {
+
+    // 周期Hann窗，分析和合成都加窗，75%重叠时窗平方和为常数
+    window_.resize(fftSize_);
+    for (int i = 0; i < fftSize_; i++) {
+        window_[i] = float(0.5 - 0.5 * std::cos(2.0 * M_PI * i / fftSize_));
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < fftSize_; i += hop_) {
+        sum += window_[i] * window_[i];
+    }
+    olaScale_ = 1.0f / sum;
+
+    planes_.resize(channels_);
+    reset();
+}
+
+void PhaseVocoder::reset() {
+    // 补零的长度和当前的速度有关，每一段重新计算
+    prePad_ = fftSize_ / 2 + int64_t(std::ceil(tempo_ * fftSize_ / 2.0));
+    skipOut_ = std::llround(fftSize_ / 2.0 + double(prePad_ - fftSize_ / 2) / tempo_);
+    in_.assign(channels_, std::vector<float>(prePad_, 0.0f));
+    inOffset_ = 0;
+    inTotal_ = prePad_;
+    prevPhase_.assign(channels_, std::vector<float>(fftSize_ / 2 + 1, 0.0f));
+    synthPhase_.assign(channels_, std::vector<float>(fftSize_ / 2 + 1, 0.0f));
+    acc_.assign(channels_, std::vector<float>(fftSize_, 0.0f));
+    out_.clear();
+    frameIndex_ = 0;
+    prevFrame_ = 0;
+    outProduced_ = 0;
+    outTotal_ = 0;
+    outLimit_ = INT64_MAX;
+    anchorIn_ = 0.0;
+    anchorFrame_ = 0;
+    outPosition_ = 0.0;
+}
+
+void PhaseVocoder::setTempo(float tempo) {
+    // 从下一帧开始按照新的速度推进
+    anchorIn_ += double(frameIndex_ - anchorFrame_) * hop_ * tempo_;
+    anchorFrame_ = frameIndex_;
+    tempo_ = tempo;
+}
+
+int64_t PhaseVocoder::frameCenter(int64_t frameIndex) const {
+    return std::llround(anchorIn_ + double(frameIndex - anchorFrame_) * hop_ * tempo_);
+}
+
+float* const* PhaseVocoder::appendInput(size_t nbFrames) {
+    size_t oldSize = in_[0].size();
+    for (int c = 0; c < channels_; c++) {
+        in_[c].resize(oldSize + nbFrames, 0.0f);
+        planes_[c] = in_[c].data() + oldSize;
+    }
+    inTotal_ += int64_t(nbFrames);
+    return planes_.data();
+}
+
+void PhaseVocoder::push(const float* samples, size_t nbFrames) {
+    deinterleave(samples, appendInput(nbFrames), channels_, nbFrames);
+    outPosition_ += double(nbFrames) / tempo_;
+    process();
+}
+
+size_t PhaseVocoder::pull(std::vector<float>& out) {
+    size_t count = out_.size() / channels_;
+    out.insert(out.end(), out_.begin(), out_.end());
+    out_.clear();
+    return count;
+}
+
+void PhaseVocoder::finish() {
+    if (outLimit_ != INT64_MAX)
+        return;
+    outLimit_ = std::llround(outPosition_);
+    // 补零把最后几帧推出来
+    auto silence = size_t(fftSize_ + size_t(hop_ * tempo_));
+    while (outTotal_ < outLimit_) {
+        appendInput(silence);
+        process();
+    }
+}
+
+void PhaseVocoder::emit(size_t nbFrames) {
+    // 丢掉补零对应的输出
+    size_t skip = 0;
+    if (outProduced_ < skipOut_)
+        skip = size_t(std::min<int64_t>(int64_t(nbFrames), skipOut_ - outProduced_));
+    outProduced_ += int64_t(nbFrames);
+    if (outTotal_ >= outLimit_)
+        return;
+    auto count = size_t(std::min<int64_t>(int64_t(nbFrames - skip), outLimit_ - outTotal_));
+    for (int c = 0; c < channels_; c++) {
+        planes_[c] = acc_[c].data() + skip;
+    }
+    size_t oldSize = out_.size();
+    out_.resize(oldSize + count * channels_);
+    interleave(planes_.data(), out_.data() + oldSize, channels_, count);
+    outTotal_ += int64_t(count);
+}
+
+void PhaseVocoder::processFrame(int channel, int64_t frameBegin, int64_t analysisHop) {
+    VocoderScratch& scratch = vocoderScratch(fftSize_);
+    std::vector<std::complex<float>>& spectrum = scratch.spectrum;
+    std::vector<float>& magnitude = scratch.magnitude;
+    std::vector<float>& phase = scratch.phase;
+    std::vector<int>& peaks = scratch.peaks;
+    std::vector<float>& prevPhase = prevPhase_[channel];
+    std::vector<float>& synthPhase = synthPhase_[channel];
+    const int bins = fftSize_ / 2 + 1;
+
+    const float* frame = in_[channel].data() + (frameBegin - inOffset_);
+    for (int i = 0; i < fftSize_; i++) {
+        spectrum[i] = std::complex<float>(frame[i] * window_[i], 0.0f);
+    }
+    plan_.forward(spectrum.data());
+    for (int k = 0; k < bins; k++) {
+        magnitude[k] = std::abs(spectrum[k]);
+        phase[k] = std::arg(spectrum[k]);
+    }
+
+    if (frameIndex_ == 0 || analysisHop <= 0) {
+        std::copy(phase.begin(), phase.end(), synthPhase.begin());
+    } else {
+        // 谱峰: 比左右各两个频点都大
+        peaks.clear();
+        for (int k = 0; k < bins; k++) {
+            float m = magnitude[k];
+            if ((k < 1 || m > magnitude[k - 1]) && (k < 2 || m > magnitude[k - 2])
+                && (k + 1 >= bins || m >= magnitude[k + 1]) && (k + 2 >= bins || m >= magnitude[k + 2])) {
+                peaks.push_back(k);
+            }
+        }
+        // 谱峰按照瞬时频率推进相位
+        for (int p : peaks) {
+            float omega = float(2.0 * M_PI) * float(p) / float(fftSize_);
+            float delta = principalArg(phase[p] - prevPhase[p] - omega * float(analysisHop));
+            float frequency = omega + delta / float(analysisHop);
+            synthPhase[p] = principalArg(synthPhase[p] + frequency * float(hop_));
+        }
+        // 其他频点锁定到最近的谱峰，保持和谱峰之间的相位差
+        if (!peaks.empty()) {
+            size_t nearest = 0;
+            for (int k = 0; k < bins; k++) {
+                while (nearest + 1 < peaks.size()
+                       && std::abs(peaks[nearest + 1] - k) < std::abs(peaks[nearest] - k)) {
+                    nearest++;
+                }
+                int p = peaks[nearest];
+                if (p != k)
+                    synthPhase[k] = principalArg(synthPhase[p] + phase[k] - phase[p]);
+            }
+        }
+    }
+    std::copy(phase.begin(), phase.end(), prevPhase.begin());
+
+    // 使用合成相位重建频谱，实信号的频谱共轭对称
+    for (int k = 0; k < bins; k++) {
+        spectrum[k] = std::polar(magnitude[k], synthPhase[k]);
+    }
+    for (int k = bins; k < fftSize_; k++) {
+        spectrum[k] = std::conj(spectrum[fftSize_ - k]);
+    }
+    plan_.inverse(spectrum.data());
+    float* acc = acc_[channel].data();
+    for (int i = 0; i < fftSize_; i++) {
+        acc[i] += spectrum[i].real() * window_[i] * olaScale_;
+    }
+}
+
+void PhaseVocoder::process() {
+    while (true) {
+        auto frameBegin = frameCenter(frameIndex_);
+        if (frameBegin + fftSize_ > inTotal_)
+            break;
+
+        for (int c = 0; c < channels_; c++) {
+            processFrame(c, frameBegin, frameBegin - prevFrame_);
+        }
+
+        // 前hop_个采样已经不会再有其他帧叠加
+        emit(hop_);
+        for (auto& acc : acc_) {
+            std::memmove(acc.data(), acc.data() + hop_, (fftSize_ - hop_) * sizeof(float));
+            std::fill(acc.begin() + (fftSize_ - hop_), acc.end(), 0.0f);
+        }
+
+        prevFrame_ = frameBegin;
+        frameIndex_++;
+
+        // 丢掉之后不会再访问的输入
+        auto nextFrame = frameCenter(frameIndex_);
+        if (nextFrame - inOffset_ > 4096) {
+            for (auto& in : in_) {
+                in.erase(in.begin(), in.begin() + (nextFrame - inOffset_));
+            }
+            inOffset_ = nextFrame;
+        }
+    }
+}
+
+bool vocoderTimeStretch(const void* srcData,
+                        size_t srcSize,
+                        void** destData,
+                        size_t& destSize,
+                        float tempo,
+                        int64_t channelLayout,
+                        int sampleRate,
+                        AVSampleFormat sampleFormat) {
+    VocoderStretcher stretcher(tempo, channelLayout, sampleRate, sampleFormat);
+    return stretchBuffer(stretcher, srcData, srcSize, destData, destSize);
+}
+
+}
@@ -0,0 +1,111 @@
+#ifndef SERVICE_BASE_PHASE_VOCODER_H_
+#define SERVICE_BASE_PHASE_VOCODER_H_
+
+#include <cstdint>
+#include <vector>
+#include "server_base/float_stretcher.h"
+
+namespace WL::Service::Base {
+
+class FFTPlan;
+
+/**
+ * 相位锁定的相位声码器变速，适合0.5附近以及更慢的速度
+ *
+ * 帧长约32ms(2的幂)，合成帧移为帧长的1/4，分析帧移为合成帧移 * tempo。
+ * 谱峰处的相位按照瞬时频率推进，其他频点的相位锁定到最近的谱峰(identity phase locking)，
+ * 可以明显减少普通相位声码器的混响感。
+ *
+ * 多声道时每个声道分别保存相位，所有声道使用相同的帧位置。
+ * FFT计划在进程内只创建一次，FFT的临时缓存每个线程一份，实例中只保存相位等状态
+ */
+class PhaseVocoder {
+public:
+    static constexpr float kMinTempo = 0.25f;
+    static constexpr float kMaxTempo = 4.0f;
+
+    PhaseVocoder(float tempo, int sampleRate = 16000, int channels = 1);
+
+    float tempo() const { return tempo_; }
+
+    // 修改之后送入数据的速度，之后的帧从当前位置开始按照新的速度推进
+    void setTempo(float tempo);
+
+    // 送入交错的数据，nbFrames为每个声道的采样数
+    void push(const float* samples, size_t nbFrames);
+
+    // 取出目前可用的交错数据，追加到out的末尾，返回每个声道的采样数
+    size_t pull(std::vector<float>& out);
+
+    // 冲刷缓存，输出总长度为输入总长度 / tempo
+    void finish();
+
+    // 回到初始状态，可以处理新的一段音频
+    void reset();
+
+    // 一帧加上一个合成帧移
+    int64_t latency() const { return fftSize_ + hop_; }
+
+private:
+    // 每个声道的输入缓存末尾增加nbFrames个采样，返回新增部分的地址
+    float* const* appendInput(size_t nbFrames);
+    // 第frameIndex帧在输入中的理想位置
+    int64_t frameCenter(int64_t frameIndex) const;
+    void process();
+    void processFrame(int channel, int64_t frameBegin, int64_t analysisHop);
+    void emit(size_t nbFrames);
+
+    float tempo_;
+    int channels_;
+    int fftSize_;
+    int hop_;
+    // 构造时取出FFT计划，处理每一帧时不再访问全局的计划表
+    const FFTPlan& plan_;
+    // 输入前面补的静音长度，以及对应需要丢掉的输出长度，使得输出第0个采样对应输入第0个采样
+    int64_t prePad_;
+    int64_t skipOut_;
+    // 预先计算的Hann窗以及重叠相加的归一化系数
+    std::vector<float> window_;
+    float olaScale_;
+    // 每个声道的输入缓存，in_[c][0]对应(补零后)输入的第inOffset_个采样
+    std::vector<std::vector<float>> in_;
+    int64_t inOffset_ = 0;
+    int64_t inTotal_ = 0;
+    // 每个声道上一帧的分析相位和合成相位
+    std::vector<std::vector<float>> prevPhase_;
+    std::vector<std::vector<float>> synthPhase_;
+    // 每个声道的重叠相加缓存，长度为fftSize_
+    std::vector<std::vector<float>> acc_;
+    // 交错的输出
+    std::vector<float> out_;
+    std::vector<float*> planes_;
+    int64_t frameIndex_ = 0;
+    int64_t prevFrame_ = 0;
+    // 第anchorFrame_帧在输入中的理想位置为anchorIn_，之后每帧前进hop_ * tempo_
+    double anchorIn_ = 0.0;
+    int64_t anchorFrame_ = 0;
+    // 已经送入的数据对应的理想输出长度
+    double outPosition_ = 0.0;
+    int64_t outProduced_ = 0;
+    int64_t outTotal_ = 0;
+    int64_t outLimit_ = INT64_MAX;
+};
+
+// 相位声码器变速器，支持s16和flt格式的交错数据
+using VocoderStretcher = FloatStretcher<PhaseVocoder>;
+
+/**
+ * 使用相位声码器对音频进行变速处理，参数和timeStretch相同，tempo范围为[0.25, 4.0]
+ * 采样格式为AV_SAMPLE_FMT_S16或者AV_SAMPLE_FMT_FLT
+ */
+bool vocoderTimeStretch(const void* srcData,
+                        size_t srcSize,
+                        void** destData,
+                        size_t& destSize,
+                        float tempo = 1.0,
+                        int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                        int sampleRate = 16000,
+                        AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+}
+#endif
@@ -0,0 +1,175 @@
+#include "glog/logging.h"
+#include "server_base/pitch_shift.h"
+#include "server_base/sample_utils.h"
+#include <cmath>
+#include <cstdlib>
+
+namespace WL::Service::Base {
+
+static double centsToRatio(float cents) {
+    return std::pow(2.0, double(cents) / 1200.0);
+}
+
+PitchShiftStretcher::PitchShiftStretcher(const std::string& engine,
+                                         float tempo,
+                                         float cents,
+                                         int64_t channelLayout,
+                                         int sampleRate,
+                                         AVSampleFormat sampleFormat)
+        : resampler_(centsToRatio(cents), std::max(av_get_channel_layout_nb_channels(channelLayout), 1)),
+          sampleFormat_(sampleFormat),
+          channels_(av_get_channel_layout_nb_channels(channelLayout)),
+          tempo_(tempo),
+          cents_(cents) {
+    if (cents < kMinCents || cents > kMaxCents) {
+        LOG(ERROR) << "Invalid pitch param, cents " << cents;
+        return;
+    }
+    if (channels_ <= 0) {
+        LOG(ERROR) << "Invalid channelLayout " << channelLayout;
+        return;
+    }
+    if (sampleFormat_ != AV_SAMPLE_FMT_S16 && sampleFormat_ != AV_SAMPLE_FMT_FLT) {
+        LOG(ERROR) << "Only s16 and flt are supported, sampleFormat " << sampleFormat;
+        return;
+    }
+    stretcher_ = createStretcher(engine, float(tempo / centsToRatio(cents)), channelLayout, sampleRate, sampleFormat);
+    valid_ = true;
+}
+
+bool PitchShiftStretcher::setTempo(float tempo) {
+    if (!valid() || !stretcher_->setTempo(float(tempo / centsToRatio(cents_))))
+        return false;
+    tempo_ = tempo;
+    return true;
+}
+
+bool PitchShiftStretcher::setPitch(float cents) {
+    if (!valid())
+        return false;
+    if (cents < kMinCents || cents > kMaxCents) {
+        LOG(ERROR) << "Invalid pitch param, cents " << cents;
+        return false;
+    }
+    if (!stretcher_->setTempo(float(tempo_ / centsToRatio(cents))))
+        return false;
+    drain();
+    resampler_.setRatio(centsToRatio(cents));
+    cents_ = cents;
+    return true;
+}
+
+bool PitchShiftStretcher::push(const void* data, size_t size) {
+    if (!valid())
+        return false;
+    // 上一段已经冲刷，开始新的一段
+    if (finished_) {
+        resampler_.reset();
+        finished_ = false;
+    }
+    if (!stretcher_->push(data, size))
+        return false;
+    drain();
+    return true;
+}
+
+void PitchShiftStretcher::drain() {
+    stretcher_->pull([this](const uint8_t* data, size_t size) {
+        if (sampleFormat_ == AV_SAMPLE_FMT_FLT) {
+            resampler_.push((const float*) data, size / (sizeof(float) * channels_));
+            return;
+        }
+        size_t nbFrames = size / (sizeof(int16_t) * channels_);
+        samples_.resize(nbFrames * channels_);
+        s16ToFloat((const int16_t*) data, samples_.data(), samples_.size());
+        resampler_.push(samples_.data(), nbFrames);
+    });
+}
+
+size_t PitchShiftStretcher::pull(const SampleSink& sink) {
+    if (!valid())
+        return 0;
+    drain();
+    samples_.clear();
+    resampler_.pull(samples_);
+    if (samples_.empty())
+        return 0;
+    if (sampleFormat_ == AV_SAMPLE_FMT_FLT) {
+        sink((const uint8_t*) samples_.data(), samples_.size() * sizeof(float));
+        return samples_.size() * sizeof(float);
+    }
+    converted_.resize(samples_.size());
+    floatToS16(samples_.data(), converted_.data(), samples_.size());
+    sink((const uint8_t*) converted_.data(), converted_.size() * sizeof(int16_t));
+    return converted_.size() * sizeof(int16_t);
+}
+
+bool PitchShiftStretcher::finish() {
+    if (!valid() || !stretcher_->finish())
+        return false;
+    drain();
+    resampler_.finish();
+    finished_ = true;
+    return true;
+}
+
+int64_t PitchShiftStretcher::latency() const {
+    // 重采样的延迟按照输出计算，换算到变速之前的输入
+    double stretchTempo = tempo_ / centsToRatio(cents_);
+    return (stretcher_ ? stretcher_->latency() : 0) + std::llround(resampler_.latency() * stretchTempo);
+}
+
+bool pitchShift(const void* srcData,
+                size_t srcSize,
+                void** destData,
+                size_t& destSize,
+                float cents,
+                int64_t channelLayout,
+                int sampleRate,
+                AVSampleFormat sampleFormat) {
+    return pitchTimeStretch(srcData, srcSize, destData, destSize, 1.0f, cents,
+                            channelLayout, sampleRate, sampleFormat);
+}
+
+bool pitchTimeStretch(const void* srcData,
+                      size_t srcSize,
+                      void** destData,
+                      size_t& destSize,
+                      float tempo,
+                      float cents,
+                      int64_t channelLayout,
+                      int sampleRate,
+                      AVSampleFormat sampleFormat) {
+    PitchShiftStretcher stretcher(defaultStretchEngine(), tempo, cents, channelLayout, sampleRate, sampleFormat);
+    return stretchBuffer(stretcher, srcData, srcSize, destData, destSize);
+}
+
+bool extractPitch(std::string& sox, float& cents) {
+    std::string others;
+    bool found = false;
+    size_t begin = 0;
+    while (begin < sox.length()) {
+        size_t end = sox.find('#', begin);
+        if (end == std::string::npos)
+            end = sox.length();
+        std::string effect = sox.substr(begin, end - begin);
+        begin = end + 1;
+        if (!found && effect.compare(0, 6, "pitch=") == 0 && effect.find('_') == std::string::npos) {
+            char* parsed = nullptr;
+            float value = strtof(effect.c_str() + 6, &parsed);
+            if (parsed != effect.c_str() + 6 && *parsed == '\0'
+                && value >= PitchShiftStretcher::kMinCents && value <= PitchShiftStretcher::kMaxCents) {
+                cents = value;
+                found = true;
+                continue;
+            }
+        }
+        if (!effect.empty())
+            others = others.empty() ? effect : others + "#" + effect;
+    }
+    if (found)
+        sox = others;
+    return found;
+}
+
+}
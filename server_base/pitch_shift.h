@@ -0,0 +1,107 @@
+#ifndef SERVICE_BASE_PITCH_SHIFT_H_
+#define SERVICE_BASE_PITCH_SHIFT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "server_base/resampler.h"
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 变调变速器，代替sox的pitch效果
+ *
+ * 音调升高ratio = 2^(cents / 1200)倍时，先按照tempo / ratio变速，使时长变为ratio倍，
+ * 再按照ratio重采样，时长恢复并且音调升高。变速和变调在一次处理中完成，
+ * 变速引擎和createStretcher相同，支持s16和flt格式的交错数据
+ */
+class PitchShiftStretcher : public AudioStretcher {
+public:
+    static constexpr float kMinCents = -1200.0f;
+    static constexpr float kMaxCents = 1200.0f;
+
+    PitchShiftStretcher(const std::string& engine,
+                        float tempo,
+                        float cents,
+                        int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                        int sampleRate = 16000,
+                        AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+    bool valid() const override { return valid_ && stretcher_ && stretcher_->valid(); }
+
+    float tempo() const override { return tempo_; }
+
+    bool setTempo(float tempo) override;
+
+    float pitch() const { return cents_; }
+
+    /**
+     * 修改之后送入数据的音调，单位为音分，变速器中缓存的数据也会按照新的音调重采样
+     */
+    bool setPitch(float cents);
+
+    bool push(const void* data, size_t size) override;
+
+    using AudioStretcher::pull;
+
+    size_t pull(const SampleSink& sink) override;
+
+    bool finish() override;
+
+    int64_t latency() const override;
+
+private:
+    // 把变速器目前的输出送入重采样
+    void drain();
+
+    std::unique_ptr<AudioStretcher> stretcher_;
+    Resampler resampler_;
+    AVSampleFormat sampleFormat_;
+    int channels_;
+    float tempo_;
+    float cents_;
+    bool valid_ = false;
+    bool finished_ = false;
+    std::vector<float> samples_;
+    std::vector<int16_t> converted_;
+};
+
+/**
+ * 对音频进行变调处理，时长不变，参数和timeStretch相同，引擎为defaultStretchEngine()
+ *
+ * @param cents 音调变化，单位为音分，和sox的pitch效果相同
+ */
+bool pitchShift(const void* srcData,
+                size_t srcSize,
+                void** destData,
+                size_t& destSize,
+                float cents,
+                int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                int sampleRate = 16000,
+                AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+/**
+ * 一次完成变速和变调，相当于sox的"tempo=t#pitch=cents"
+ */
+bool pitchTimeStretch(const void* srcData,
+                      size_t srcSize,
+                      void** destData,
+                      size_t& destSize,
+                      float tempo,
+                      float cents,
+                      int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                      int sampleRate = 16000,
+                      AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+/**
+ * 从soxlist一段的效果中去掉pitch，格式和extractTempoMap相同
+ * 只有一个参数的pitch会被取出，带有其他参数时保留给sox处理
+ *
+ * @return 没有pitch时返回false，sox不变
+ */
+bool extractPitch(std::string& sox, float& cents);
+
+}
+#endif
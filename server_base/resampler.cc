@@ -0,0 +1,131 @@
+#include "server_base/resampler.h"
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <cmath>
+
+namespace WL::Service::Base {
+
+// 保留的历史输入按照最宽的滤波器计算，修改比例之后不会缺少数据
+static const int kMaxHalfWidth = int(Resampler::kZeroCrossings * Resampler::kMaxRatio / 0.95) + 1;
+
+Resampler::Resampler(double ratio, int channels)
+        : ratio_(std::clamp(ratio, kMinRatio, kMaxRatio)),
+          channels_(std::max(channels, 1)) {
+    buildFilter();
+    reset();
+}
+
+void Resampler::reset() {
+    // 开头补静音，第一个输出采样之前也有完整的抽头
+    in_.assign(size_t(kMaxHalfWidth) * channels_, 0.0f);
+    inOffset_ = -kMaxHalfWidth;
+    inTotal_ = 0;
+    position_ = 0.0;
+    out_.clear();
+    outPosition_ = 0.0;
+    outTotal_ = 0;
+    outLimit_ = INT64_MAX;
+}
+
+void Resampler::setRatio(double ratio) {
+    ratio = std::clamp(ratio, kMinRatio, kMaxRatio);
+    if (ratio == ratio_)
+        return;
+    ratio_ = ratio;
+    buildFilter();
+}
+
+void Resampler::buildFilter() {
+    const double cutoff = std::min(1.0, 1.0 / ratio_) * 0.95;
+    halfWidth_ = int(std::ceil(kZeroCrossings / cutoff));
+    const int taps = 2 * halfWidth_;
+    filter_.resize(size_t(kPhases + 1) * taps);
+    taps_.resize(taps);
+    for (int p = 0; p <= kPhases; p++) {
+        double frac = double(p) / kPhases;
+        float* row = filter_.data() + size_t(p) * taps;
+        for (int j = 0; j < taps; j++) {
+            // 第j个抽头对应输入floor(position) + j - halfWidth_ + 1
+            double x = double(j - halfWidth_ + 1) - frac;
+            double t = x * cutoff;
+            double sinc = std::abs(t) < 1e-9 ? 1.0 : std::sin(M_PI * t) / (M_PI * t);
+            double w = 0.5 + 0.5 * x / halfWidth_;
+            double window = (w <= 0.0 || w >= 1.0) ? 0.0
+                : 0.42 - 0.5 * std::cos(2.0 * M_PI * w) + 0.08 * std::cos(4.0 * M_PI * w);
+            row[j] = float(cutoff * sinc * window);
+        }
+    }
+}
+
+void Resampler::appendInput(const float* samples, size_t nbFrames) {
+    if (samples)
+        in_.insert(in_.end(), samples, samples + nbFrames * channels_);
+    else
+        in_.resize(in_.size() + nbFrames * channels_, 0.0f);
+    inTotal_ += int64_t(nbFrames);
+}
+
+void Resampler::push(const float* samples, size_t nbFrames) {
+    appendInput(samples, nbFrames);
+    outPosition_ += double(nbFrames) / ratio_;
+    process();
+}
+
+size_t Resampler::pull(std::vector<float>& out) {
+    size_t count = out_.size() / channels_;
+    out.insert(out.end(), out_.begin(), out_.end());
+    out_.clear();
+    return count;
+}
+
+void Resampler::finish() {
+    if (outLimit_ != INT64_MAX)
+        return;
+    outLimit_ = std::llround(outPosition_);
+    // 补静音把最后的采样推出来
+    while (outTotal_ < outLimit_) {
+        appendInput(nullptr, size_t(kMaxHalfWidth) * 2);
+        process();
+    }
+}
+
+void Resampler::process() {
+    const int taps = 2 * halfWidth_;
+    while (outTotal_ < outLimit_) {
+        auto base = int64_t(std::floor(position_));
+        if (base + halfWidth_ >= inTotal_)
+            break;
+        // 相邻两个相位之间线性插值
+        double phase = (position_ - double(base)) * kPhases;
+        int p = std::min(int(phase), kPhases - 1);
+        auto t = float(phase - p);
+        const float* h0 = filter_.data() + size_t(p) * taps;
+        const float* h1 = h0 + taps;
+        for (int j = 0; j < taps; j++) {
+            taps_[j] = h0[j] + (h1[j] - h0[j]) * t;
+        }
+        const float* x = in_.data() + size_t(base - halfWidth_ + 1 - inOffset_) * channels_;
+        if (channels_ == 1) {
+            out_.push_back(dotProduct(x, taps_.data(), taps));
+        } else {
+            for (int c = 0; c < channels_; c++) {
+                float sum = 0.0f;
+                for (int j = 0; j < taps; j++) {
+                    sum += x[size_t(j) * channels_ + c] * taps_[j];
+                }
+                out_.push_back(sum);
+            }
+        }
+        outTotal_++;
+        position_ += ratio_;
+    }
+
+    // 丢掉之后不会再访问的输入
+    int64_t keep = int64_t(std::floor(position_)) - kMaxHalfWidth;
+    if (keep - inOffset_ > 4096) {
+        in_.erase(in_.begin(), in_.begin() + size_t(keep - inOffset_) * channels_);
+        inOffset_ = keep;
+    }
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef SERVICE_BASE_RESAMPLER_H_
+#define SERVICE_BASE_RESAMPLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace WL::Service::Base {
+
+/**
+ * 流式多相重采样，用于变调
+ *
+ * 滤波器为Blackman窗的sinc，预先计算kPhases个相位，相位之间线性插值，支持任意比例。
+ * 截止频率为输入和输出中较低的奈奎斯特频率的0.95倍，降采样时不会混叠。
+ * 输出第n个采样对应输入的位置为n * ratio，开头和结尾按照静音处理，输出没有延迟，
+ * finish之后输出总长度为输入总长度 / ratio。状态可以通过reset复用
+ */
+class Resampler {
+public:
+    static const int kPhases = 256;
+    static const int kZeroCrossings = 16;
+    static constexpr double kMinRatio = 0.25;
+    static constexpr double kMaxRatio = 4.0;
+
+    /**
+     * @param ratio 输入采样数 / 输出采样数，大于1时输出变短，回放时音调升高
+     * @param channels 声道数，数据为交错格式
+     */
+    explicit Resampler(double ratio = 1.0, int channels = 1);
+
+    double ratio() const { return ratio_; }
+
+    // 修改之后送入数据的比例，超出范围时截断
+    void setRatio(double ratio);
+
+    // 送入交错的数据，nbFrames为每个声道的采样数
+    void push(const float* samples, size_t nbFrames);
+
+    // 取出目前可用的交错数据，追加到out的末尾，返回每个声道的采样数
+    size_t pull(std::vector<float>& out);
+
+    // 冲刷缓存，送入的数据全部可以取出
+    void finish();
+
+    void reset();
+
+    // 每一侧的抽头数
+    int64_t latency() const { return halfWidth_; }
+
+private:
+    void buildFilter();
+    void appendInput(const float* samples, size_t nbFrames);
+    void process();
+
+    double ratio_;
+    int channels_;
+    // 每一侧的抽头数，抽头总数为2 * halfWidth_
+    int halfWidth_ = 0;
+    // (kPhases + 1)行，每一行为一个相位的抽头
+    std::vector<float> filter_;
+    std::vector<float> taps_;
+
+    // in_[0]在输入中的位置，开头补静音时为负数
+    std::vector<float> in_;
+    int64_t inOffset_ = 0;
+    int64_t inTotal_ = 0;
+    // 下一个输出采样在输入中的位置
+    double position_ = 0.0;
+
+    std::vector<float> out_;
+    double outPosition_ = 0.0;
+    int64_t outTotal_ = 0;
+    int64_t outLimit_ = INT64_MAX;
+};
+
+}
+#endif
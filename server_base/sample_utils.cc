@@ -0,0 +1,279 @@
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_UTILS_X86 1
+#endif
+
+namespace WL::Service::Base {
+
+static float dotProductScalar(const float* a, const float* b, size_t n) {
+    // 使用4路累加，编译器可以自动向量化，同时减少累加误差
+    float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum0 += a[i] * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum2 += a[i + 2] * b[i + 2];
+        sum3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; i++) {
+        sum0 += a[i] * b[i];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+#ifdef SAMPLE_UTILS_X86
+__attribute__((target("avx2,fma")))
+static float dotProductAvx2(const float* a, const float* b, size_t n) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    // 水平求和
+    __m128 low = _mm256_castps256_ps128(sum0);
+    __m128 high = _mm256_extractf128_ps(sum0, 1);
+    low = _mm_add_ps(low, high);
+    low = _mm_add_ps(low, _mm_movehl_ps(low, low));
+    low = _mm_add_ss(low, _mm_shuffle_ps(low, low, 0x55));
+    float sum = _mm_cvtss_f32(low);
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#endif
+
+typedef float (*dot_product_t)(const float*, const float*, size_t);
+
+static dot_product_t selectDotProduct() {
+#ifdef SAMPLE_UTILS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return dotProductAvx2;
+#endif
+    return dotProductScalar;
+}
+
+float dotProduct(const float* a, const float* b, size_t n) {
+    static const dot_product_t impl = selectDotProduct();
+    return impl(a, b, n);
+}
+
+static void s16ToFloatScalar(const int16_t* src, float* dest, size_t n) {
+    const float scale = 1.0f / 32768.0f;
+    for (size_t i = 0; i < n; i++) {
+        dest[i] = float(src[i]) * scale;
+    }
+}
+
+static void floatToS16Scalar(const float* src, int16_t* dest, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float value = std::nearbyint(src[i] * 32768.0f);
+        if (value > 32767.0f)
+            value = 32767.0f;
+        else if (value < -32768.0f)
+            value = -32768.0f;
+        dest[i] = int16_t(value);
+    }
+}
+
+static void deinterleaveStereoScalar(const float* src, float* left, float* right, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
+
+static void interleaveStereoScalar(const float* left, const float* right, float* dest, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        dest[2 * i] = left[i];
+        dest[2 * i + 1] = right[i];
+    }
+}
+
+static void s16LevelsScalar(const int16_t* src, size_t n, int& peak, int64_t& energy) {
+    int maxValue = 0;
+    int minValue = 0;
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        maxValue = std::max<int>(maxValue, src[i]);
+        minValue = std::min<int>(minValue, src[i]);
+        sum += int(src[i]) * int(src[i]);
+    }
+    peak = std::max(maxValue, -minValue);
+    energy = sum;
+}
+
+#ifdef SAMPLE_UTILS_X86
+__attribute__((target("avx2")))
+static void s16LevelsAvx2(const int16_t* src, size_t n, int& peak, int64_t& energy) {
+    __m256i maxValue = _mm256_setzero_si256();
+    __m256i minValue = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i value = _mm256_loadu_si256((const __m256i*) (src + i));
+        // -32768的绝对值超出int16，最大值和最小值分别统计
+        maxValue = _mm256_max_epi16(maxValue, value);
+        minValue = _mm256_min_epi16(minValue, value);
+        // 相邻两个平方之和最大为2^31，按照无符号数扩展为64位累加
+        __m256i squares = _mm256_madd_epi16(value, value);
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(squares)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(squares, 1)));
+    }
+    alignas(32) int16_t maxLanes[16];
+    alignas(32) int16_t minLanes[16];
+    alignas(32) int64_t sumLanes[4];
+    _mm256_store_si256((__m256i*) maxLanes, maxValue);
+    _mm256_store_si256((__m256i*) minLanes, minValue);
+    _mm256_store_si256((__m256i*) sumLanes, sum);
+    int tailPeak = 0;
+    int64_t tailEnergy = 0;
+    s16LevelsScalar(src + i, n - i, tailPeak, tailEnergy);
+    peak = tailPeak;
+    for (int k = 0; k < 16; k++) {
+        peak = std::max({ peak, int(maxLanes[k]), -int(minLanes[k]) });
+    }
+    energy = tailEnergy + sumLanes[0] + sumLanes[1] + sumLanes[2] + sumLanes[3];
+}
+
+__attribute__((target("avx2")))
+static void s16ToFloatAvx2(const int16_t* src, float* dest, size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i value = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (src + i)));
+        _mm256_storeu_ps(dest + i, _mm256_mul_ps(_mm256_cvtepi32_ps(value), scale));
+    }
+    s16ToFloatScalar(src + i, dest + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void floatToS16Avx2(const float* src, int16_t* dest, size_t n) {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 upper = _mm256_set1_ps(32767.0f);
+    const __m256 lower = _mm256_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // 超出int32范围时cvtps得到0x80000000，先截断到s16的范围，和标量的结果一致
+        __m256 lowValue = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+        __m256 highValue = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+        lowValue = _mm256_max_ps(_mm256_min_ps(lowValue, upper), lower);
+        highValue = _mm256_max_ps(_mm256_min_ps(highValue, upper), lower);
+        // cvtps使用当前的舍入模式，和nearbyint一致
+        __m256i low = _mm256_cvtps_epi32(lowValue);
+        __m256i high = _mm256_cvtps_epi32(highValue);
+        __m256i packed = _mm256_packs_epi32(low, high);
+        // packs按照128位分别处理，需要调整顺序
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i*) (dest + i), packed);
+    }
+    floatToS16Scalar(src + i, dest + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void deinterleaveStereoAvx2(const float* src, float* left, float* right, size_t frames) {
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        // a = l0 r0 l1 r1 | l2 r2 l3 r3, b = l4 r4 l5 r5 | l6 r6 l7 r7
+        __m256 a = _mm256_loadu_ps(src + 2 * i);
+        __m256 b = _mm256_loadu_ps(src + 2 * i + 8);
+        // l0 l1 l4 l5 | l2 l3 l6 l7
+        __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(l), 0xD8));
+        r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(r), 0xD8));
+        _mm256_storeu_ps(left + i, l);
+        _mm256_storeu_ps(right + i, r);
+    }
+    deinterleaveStereoScalar(src + 2 * i, left + i, right + i, frames - i);
+}
+
+__attribute__((target("avx2")))
+static void interleaveStereoAvx2(const float* left, const float* right, float* dest, size_t frames) {
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 l = _mm256_loadu_ps(left + i);
+        __m256 r = _mm256_loadu_ps(right + i);
+        // l0 r0 l1 r1 | l4 r4 l5 r5
+        __m256 low = _mm256_unpacklo_ps(l, r);
+        // l2 r2 l3 r3 | l6 r6 l7 r7
+        __m256 high = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(dest + 2 * i, _mm256_permute2f128_ps(low, high, 0x20));
+        _mm256_storeu_ps(dest + 2 * i + 8, _mm256_permute2f128_ps(low, high, 0x31));
+    }
+    interleaveStereoScalar(left + i, right + i, dest + 2 * i, frames - i);
+}
+#endif
+
+static bool supportsAvx2() {
+#ifdef SAMPLE_UTILS_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+#ifdef SAMPLE_UTILS_X86
+#define SELECT_IMPL(name) (supportsAvx2() ? name##Avx2 : name##Scalar)
+#else
+#define SELECT_IMPL(name) (name##Scalar)
+#endif
+
+void s16ToFloat(const int16_t* src, float* dest, size_t n) {
+    static const auto impl = SELECT_IMPL(s16ToFloat);
+    impl(src, dest, n);
+}
+
+void floatToS16(const float* src, int16_t* dest, size_t n) {
+    static const auto impl = SELECT_IMPL(floatToS16);
+    impl(src, dest, n);
+}
+
+void s16Levels(const int16_t* src, size_t n, int& peak, int64_t& energy) {
+    static const auto impl = SELECT_IMPL(s16Levels);
+    impl(src, n, peak, energy);
+}
+
+void deinterleave(const float* src, float* const* dest, int channels, size_t frames) {
+    if (channels == 1) {
+        std::copy(src, src + frames, dest[0]);
+    } else if (channels == 2) {
+        static const auto impl = SELECT_IMPL(deinterleaveStereo);
+        impl(src, dest[0], dest[1], frames);
+    } else {
+        for (size_t i = 0; i < frames; i++) {
+            for (int c = 0; c < channels; c++) {
+                dest[c][i] = src[i * channels + c];
+            }
+        }
+    }
+}
+
+void interleave(const float* const* src, float* dest, int channels, size_t frames) {
+    if (channels == 1) {
+        std::copy(src[0], src[0] + frames, dest);
+    } else if (channels == 2) {
+        static const auto impl = SELECT_IMPL(interleaveStereo);
+        impl(src[0], src[1], dest, frames);
+    } else {
+        for (size_t i = 0; i < frames; i++) {
+            for (int c = 0; c < channels; c++) {
+                dest[i * channels + c] = src[c][i];
+            }
+        }
+    }
+}
+
+}
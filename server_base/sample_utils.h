@@ -0,0 +1,45 @@
+#ifndef SERVICE_BASE_SAMPLE_UTILS_H_
+#define SERVICE_BASE_SAMPLE_UTILS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace WL::Service::Base {
+
+/**
+ * 两个float数组的点积，支持AVX2的CPU上使用向量化实现，否则使用标量实现
+ * 第一次调用时检测CPU特性
+ */
+float dotProduct(const float* a, const float* b, size_t n);
+
+// s16转换为[-1.0, 1.0)范围的float，支持AVX2的CPU上使用向量化实现
+void s16ToFloat(const int16_t* src, float* dest, size_t n);
+
+// float转换为s16，超出范围的部分截断，支持AVX2的CPU上使用向量化实现
+void floatToS16(const float* src, int16_t* dest, size_t n);
+
+/**
+ * s16数据的峰值(绝对值的最大值)和平方和，用于判断静音，支持AVX2的CPU上使用向量化实现
+ *
+ * @param peak [out] 0到32768之间
+ * @param energy [out] 所有采样的平方和
+ */
+void s16Levels(const int16_t* src, size_t n, int& peak, int64_t& energy);
+
+/**
+ * 把交错的多声道数据拆分到各个声道
+ *
+ * @param src 交错的数据，长度为frames * channels
+ * @param dest 每个声道的目标地址，每个长度为frames
+ * @param channels 声道数，双声道在支持AVX2的CPU上使用向量化实现
+ * @param frames 每个声道的采样数
+ */
+void deinterleave(const float* src, float* const* dest, int channels, size_t frames);
+
+/**
+ * 把各个声道的数据合并为交错的数据，参数和deinterleave相反
+ */
+void interleave(const float* const* src, float* dest, int channels, size_t frames);
+
+}
+#endif
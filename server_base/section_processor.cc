@@ -0,0 +1,130 @@
+#include "glog/logging.h"
+#include "server_base/section_processor.h"
+#include "server_base/effect_chain.h"
+#include "server_base/stretcher.h"
+#include "server_base/worker_context.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace WL::Service::Base {
+
+static bool isPad(const std::string& sox) {
+    return sox.compare(0, 4, "pad=") == 0;
+}
+
+// 和sox的vol相同，超出范围的采样截断
+static void applyGain(int16_t* samples, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        float value = std::round(samples[i] * gain);
+        samples[i] = int16_t(std::min(std::max(value, -32768.0f), 32767.0f));
+    }
+}
+
+bool SectionProcessor::supports(const std::vector<std::tuple<std::string, int, int>>& soxlist) {
+    for (const auto& section : soxlist) {
+        const std::string& sox = std::get<0>(section);
+        if (sox.empty() || isPad(sox))
+            continue;
+        for (const auto& effect : WorkerContext::current().effectChain(sox)->effects()) {
+            if (effect.args.size() != 1 || !effect.numeric)
+                return false;
+            if (effect.type == EffectType::Vol)
+                continue;
+            if (effect.type == EffectType::Pitch && effect.value >= PitchShiftStretcher::kMinCents
+                && effect.value <= PitchShiftStretcher::kMaxCents)
+                continue;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SectionProcessor::processSection(const int16_t* src, size_t count, float gain, float cents) {
+    section_.assign(src, src + count);
+    if (gain != 1.0f)
+        applyGain(section_.data(), section_.size(), gain);
+    if (cents == 0.0f) {
+        pcm_.insert(pcm_.end(), section_.begin(), section_.end());
+        return true;
+    }
+
+    // 变调器每一段冲刷一次，之后修改音调继续使用
+    if (!pitch_)
+        pitch_ = std::make_unique<PitchShiftStretcher>(defaultStretchEngine(), 1.0f, cents);
+    if (!pitch_->valid() || !pitch_->setPitch(cents))
+        return false;
+    if (!pitch_->push(section_.data(), section_.size() * sizeof(int16_t)) || !pitch_->finish())
+        return false;
+    pitch_->pull([this](const uint8_t* data, size_t size) {
+        const auto* samples = (const int16_t*) data;
+        pcm_.insert(pcm_.end(), samples, samples + size / sizeof(int16_t));
+    });
+    return true;
+}
+
+bool SectionProcessor::process(const std::vector<std::tuple<std::string, int, int>>& soxlist,
+                               const void* data,
+                               size_t size,
+                               const std::vector<std::string>& appliedsox) {
+    pcm_.clear();
+    parts_.clear();
+    pcm_.reserve(size / sizeof(int16_t));
+    const auto* src = (const int16_t*) data;
+    size_t samples = size / sizeof(int16_t);
+    size_t totalin = 0;
+    size_t previous = 0;
+    for (size_t i = 0; i < soxlist.size(); i++) {
+        const std::string& sox = std::get<0>(soxlist[i]);
+        size_t end = std::min(size_t(std::max(std::get<1>(soxlist[i]), 0)) / 2, samples);
+        size_t duration = end > previous ? end - previous : 0;
+        previous = end;
+        if (isPad(sox)) {
+            // 和sox的pad相同，停顿的长度由参数决定，原来的停顿不输出
+            size_t pos = sox.find('@');
+            auto pad = size_t(std::llround(atof(sox.c_str() + 4) * 16000));
+            int breakms = pos == std::string::npos ? int(pad / 16) : int(std::lround(atof(sox.c_str() + pos + 1) * 1000));
+            totalin += duration;
+            pcm_.resize(pcm_.size() + pad, 0);
+            if (!parts_.empty()) {
+                snd_part& last = parts_.back();
+                last.length += pad * 2;
+                last.timems += pad / 16;
+                last.padms = pad > 0 ? int(pad / 16) : -int(duration / 16);
+                last.breakms = breakms;
+            }
+            continue;
+        }
+
+        size_t begin = std::min(totalin, end);
+        size_t outstart = pcm_.size();
+        std::vector<std::string> outputsox;
+        if (i < appliedsox.size() && !appliedsox[i].empty())
+            outputsox.push_back(appliedsox[i]);
+        float gain = 1.0f;
+        float cents = 0.0f;
+        for (const auto& effect : WorkerContext::current().effectChain(sox)->effects()) {
+            if (effect.type == EffectType::Vol)
+                gain *= float(effect.value);
+            else if (effect.type == EffectType::Pitch)
+                cents += float(effect.value);
+            outputsox.push_back(effect.text);
+        }
+        if (!processSection(src + begin, end - begin, gain, cents)) {
+            // 变调器中可能还有没有冲刷的数据，下一次使用时重新创建
+            pitch_.reset();
+            LOG(ERROR) << "Process section " << i << " failed, sox " << sox;
+            return false;
+        }
+        totalin = end;
+        // 没有效果的段只在有已经完成的效果时记录
+        size_t length = (pcm_.size() - outstart) * 2;
+        if (!sox.empty() || !outputsox.empty())
+            parts_.push_back(snd_part(outstart * 2, outstart * 2 + length, outstart / 16, (outstart * 2 + length) / 32,
+                                      std::get<2>(soxlist[i]), outputsox));
+        VLOG(1) << "[" << i << "] out=" << pcm_.size() * 2 << " in=" << totalin * 2 << " gain=" << gain << " cents=" << cents;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef SERVICE_BASE_SECTION_PROCESSOR_H_
+#define SERVICE_BASE_SECTION_PROCESSOR_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "server_base/audio_utils.h"
+#include "server_base/pitch_shift.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 多段soxlist的整体处理，代替每一段单独打开、建立、冲刷和关闭sox效果链
+ *
+ * 每一段的vol和pitch在这里完成，段之间只修改增益和音调，变调器在整个请求中只创建一次；
+ * pad直接补零。所有段处理完之后的16k单声道s16数据只需要编码一次。
+ * 其他效果仍然需要sox，这样的soxlist由supports()返回false，使用原来的逐段处理
+ */
+class SectionProcessor {
+public:
+    SectionProcessor() = default;
+    SectionProcessor(const SectionProcessor&) = delete;
+    SectionProcessor& operator=(const SectionProcessor&) = delete;
+
+    // soxlist中每一段都只有pad、单个参数的vol和pitch时返回true
+    static bool supports(const std::vector<std::tuple<std::string, int, int>>& soxlist);
+
+    /**
+     * 处理全部的段，结果通过pcm()、parts()和timems()取得
+     *
+     * @param data 16k单声道s16裸数据，每一段的结束位置为soxlist中的字节偏移
+     * @param appliedsox 每一段已经完成的效果，记录在parts中
+     */
+    bool process(const std::vector<std::tuple<std::string, int, int>>& soxlist,
+                 const void* data,
+                 size_t size,
+                 const std::vector<std::string>& appliedsox);
+
+    const std::vector<int16_t>& pcm() const { return pcm_; }
+
+    const std::vector<snd_part>& parts() const { return parts_; }
+
+    size_t timems() const { return pcm_.size() / 16; }
+
+private:
+    // 一段有效果的音频，gain和cents为1和0时不做处理
+    bool processSection(const int16_t* src, size_t count, float gain, float cents);
+
+    std::unique_ptr<PitchShiftStretcher> pitch_;
+    std::vector<int16_t> pcm_;
+    std::vector<int16_t> section_;
+    std::vector<snd_part> parts_;
+};
+
+}
+#endif
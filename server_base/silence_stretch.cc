@@ -0,0 +1,181 @@
+#include "glog/logging.h"
+#include "server_base/silence_stretch.h"
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <cmath>
+
+namespace WL::Service::Base {
+
+SilenceAwareStretcher::SilenceAwareStretcher(std::unique_ptr<AudioStretcher> stretcher,
+                                             int64_t channelLayout,
+                                             int sampleRate,
+                                             AVSampleFormat sampleFormat)
+        : stretcher_(std::move(stretcher)),
+          channels_(av_get_channel_layout_nb_channels(channelLayout)) {
+    enabled_ = av_get_packed_sample_fmt(sampleFormat) == AV_SAMPLE_FMT_S16 && channels_ > 0 && sampleRate > 0;
+    blockFrames_ = std::max(size_t(sampleRate) * kBlockMs / 1000, size_t(1));
+    minSilenceFrames_ = size_t(sampleRate) * kMinSilenceMs / 1000;
+    marginFrames_ = size_t(sampleRate) * kMarginMs / 1000;
+}
+
+bool SilenceAwareStretcher::setTempo(float tempo) {
+    return stretcher_ && stretcher_->setTempo(tempo);
+}
+
+bool SilenceAwareStretcher::isSilent(const int16_t* block, size_t nbFrames) const {
+    size_t count = nbFrames * channels_;
+    int peak = 0;
+    int64_t energy = 0;
+    s16Levels(block, count, peak, energy);
+    return peak < kPeakThreshold && energy < int64_t(kRmsThreshold) * kRmsThreshold * int64_t(count);
+}
+
+void SilenceAwareStretcher::drain() {
+    if (out_.empty())
+        return;
+    stretcher_->pull(out_);
+}
+
+bool SilenceAwareStretcher::pushBlock(const int16_t* block, size_t nbFrames) {
+    if (isSilent(block, nbFrames)) {
+        silence_.insert(silence_.end(), block, block + nbFrames * channels_);
+        silenceOut_ += double(nbFrames) / tempo();
+        return true;
+    }
+    if (!silence_.empty() && !flushSilence(false))
+        return false;
+    if (!stretcher_->push(block, nbFrames * channels_ * sizeof(int16_t)))
+        return false;
+    drain();
+    return true;
+}
+
+bool SilenceAwareStretcher::flushSilence(bool last) {
+    size_t frames = silence_.size() / channels_;
+    size_t head = marginFrames_;
+    size_t tail = last ? 0 : marginFrames_;
+    if (frames < std::max(minSilenceFrames_, head + tail + 1)) {
+        // 短的停顿交给变速引擎，和前后的有声部分一起处理
+        bool ok = stretcher_->push(silence_.data(), silence_.size() * sizeof(int16_t));
+        silence_.clear();
+        silenceOut_ = 0.0;
+        if (ok && last)
+            ok = stretcher_->finish();
+        drain();
+        return ok;
+    }
+
+    // 开头的过渡部分送入引擎之后冲刷，之前的输出全部放到out_中，保证在静音之前
+    size_t middle = frames - head - tail;
+    auto middleOut = size_t(std::llround(silenceOut_ * double(middle) / double(frames)));
+    const int16_t* src = silence_.data();
+    if (!stretcher_->push(src, head * channels_ * sizeof(int16_t)) || !stretcher_->finish())
+        return false;
+    stretcher_->pull(out_);
+
+    // 截短时保留首尾各一半，加长时在中间补零
+    const int16_t* mid = src + head * channels_;
+    size_t first = std::min(middle, middleOut) / 2;
+    size_t second = std::min(middle, middleOut) - first;
+    auto append = [this](const int16_t* data, size_t nbFrames) {
+        const auto* bytes = (const uint8_t*) data;
+        out_.insert(out_.end(), bytes, bytes + nbFrames * channels_ * sizeof(int16_t));
+    };
+    append(mid, first);
+    out_.resize(out_.size() + (middleOut - first - second) * channels_ * sizeof(int16_t), 0);
+    append(mid + (middle - second) * channels_, second);
+
+    bool ok = true;
+    if (tail > 0)
+        ok = stretcher_->push(mid + middle * channels_, tail * channels_ * sizeof(int16_t));
+    VLOG(2) << "Skip silence, frames " << middle << " -> " << middleOut;
+    silence_.clear();
+    silenceOut_ = 0.0;
+    drain();
+    return ok;
+}
+
+bool SilenceAwareStretcher::push(const void* data, size_t size) {
+    if (!valid())
+        return false;
+    if (!enabled_)
+        return stretcher_->push(data, size);
+
+    const auto* src = (const int16_t*) data;
+    size_t frames = size / (sizeof(int16_t) * channels_);
+    // 先补齐上一次剩下的不完整分块
+    if (!partial_.empty()) {
+        size_t need = std::min(blockFrames_ - partial_.size() / channels_, frames);
+        partial_.insert(partial_.end(), src, src + need * channels_);
+        src += need * channels_;
+        frames -= need;
+        if (partial_.size() / channels_ < blockFrames_)
+            return true;
+        if (!pushBlock(partial_.data(), blockFrames_))
+            return false;
+        partial_.clear();
+    }
+
+    // 连续的有声分块合并之后一次送入引擎
+    const int16_t* voiced = src;
+    size_t voicedFrames = 0;
+    for (; frames >= blockFrames_; frames -= blockFrames_, src += blockFrames_ * channels_) {
+        if (!isSilent(src, blockFrames_)) {
+            if (voicedFrames == 0) {
+                if (!silence_.empty() && !flushSilence(false))
+                    return false;
+                voiced = src;
+            }
+            voicedFrames += blockFrames_;
+            continue;
+        }
+        if (voicedFrames > 0) {
+            if (!stretcher_->push(voiced, voicedFrames * channels_ * sizeof(int16_t)))
+                return false;
+            voicedFrames = 0;
+        }
+        silence_.insert(silence_.end(), src, src + blockFrames_ * channels_);
+        silenceOut_ += double(blockFrames_) / tempo();
+    }
+    if (voicedFrames > 0 && !stretcher_->push(voiced, voicedFrames * channels_ * sizeof(int16_t)))
+        return false;
+    partial_.assign(src, src + frames * channels_);
+    drain();
+    return true;
+}
+
+size_t SilenceAwareStretcher::pull(const SampleSink& sink) {
+    if (!valid())
+        return 0;
+    if (out_.empty())
+        return stretcher_->pull(sink);
+    stretcher_->pull(out_);
+    size_t size = out_.size();
+    sink(out_.data(), size);
+    out_.clear();
+    return size;
+}
+
+int64_t SilenceAwareStretcher::latency() const {
+    int64_t buffered = enabled_ ? int64_t((partial_.size() + silence_.size()) / channels_) : 0;
+    return (stretcher_ ? stretcher_->latency() : 0) + buffered;
+}
+
+bool SilenceAwareStretcher::finish() {
+    if (!valid())
+        return false;
+    if (!enabled_)
+        return stretcher_->finish();
+    if (!partial_.empty()) {
+        if (!pushBlock(partial_.data(), partial_.size() / channels_))
+            return false;
+        partial_.clear();
+    }
+    if (!silence_.empty())
+        return flushSilence(true);
+    bool ok = stretcher_->finish();
+    drain();
+    return ok;
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef SERVICE_BASE_SILENCE_STRETCH_H_
+#define SERVICE_BASE_SILENCE_STRETCH_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 跳过静音的变速器，包装其他变速引擎
+ *
+ * 送入的数据按照10ms分块，峰值和RMS都低于阈值的块为静音。连续静音不短于kMinSilenceMs时，
+ * 前后各留kMarginMs交给变速引擎作为过渡，中间部分不经过变速引擎，
+ * 按照tempo直接截短(保留首尾，去掉中间)或者在中间补零。
+ * 引擎在每一段静音处冲刷一次，有声部分仍然使用原来的引擎。
+ *
+ * 只支持s16格式，其他格式直接交给内部的变速器。
+ * 未确定的静音会暂时缓存，流式处理时输出会推迟到静音结束
+ */
+class SilenceAwareStretcher : public AudioStretcher {
+public:
+    static const int kBlockMs = 10;
+    static const int kMinSilenceMs = 100;
+    static const int kMarginMs = 20;
+    // -40dBFS
+    static const int kPeakThreshold = 328;
+    // -50dBFS
+    static const int kRmsThreshold = 104;
+
+    SilenceAwareStretcher(std::unique_ptr<AudioStretcher> stretcher,
+                          int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                          int sampleRate = 16000,
+                          AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+    bool valid() const override { return stretcher_ && stretcher_->valid(); }
+
+    float tempo() const override { return stretcher_ ? stretcher_->tempo() : 1.0f; }
+
+    bool setTempo(float tempo) override;
+
+    bool push(const void* data, size_t size) override;
+
+    using AudioStretcher::pull;
+
+    size_t pull(const SampleSink& sink) override;
+
+    bool finish() override;
+
+    // 引擎的延迟加上目前缓存的静音和不完整的分块，静音越长延迟越大
+    int64_t latency() const override;
+
+private:
+    bool isSilent(const int16_t* block, size_t nbFrames) const;
+    // 送入一个分块，静音时缓存，有声时把之前的缓存一起送入变速引擎
+    bool pushBlock(const int16_t* block, size_t nbFrames);
+    // 处理缓存的静音，last为true时后面没有有声部分
+    bool flushSilence(bool last);
+    void drain();
+
+    std::unique_ptr<AudioStretcher> stretcher_;
+    bool enabled_;
+    int channels_;
+    size_t blockFrames_;
+    size_t minSilenceFrames_;
+    size_t marginFrames_;
+
+    // 不足一个分块的数据
+    std::vector<int16_t> partial_;
+    // 还没有确定的连续静音，以及它们按照送入时的tempo对应的理想输出长度
+    std::vector<int16_t> silence_;
+    double silenceOut_ = 0.0;
+    // 已经插入缩放后的静音时，之后的引擎输出需要先追加到out_，保证顺序
+    std::vector<uint8_t> out_;
+};
+
+}
+#endif
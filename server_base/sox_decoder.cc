@@ -0,0 +1,92 @@
+#include "glog/logging.h"
+#include "server_base/sox_decoder.h"
+#include "server_base/sample_utils.h"
+#include "server_base/worker_context.h"
+#include <cmath>
+
+namespace WL::Service::Base {
+
+// sox_sample_t的满刻度为2^31
+static const float kSampleScale = 1.0f / 2147483648.0f;
+
+SoxDecoder::SoxDecoder(const void* data, size_t size, const char* filetype) {
+    format_ = soxOpenMemRead(data, size, filetype);
+    if (format_ == nullptr) {
+        LOG(ERROR) << "sox_open_mem_read failed, filetype " << filetype;
+        return;
+    }
+    if (format_->signal.channels == 0 || format_->signal.rate <= 0) {
+        LOG(ERROR) << "Invalid signal, rate " << format_->signal.rate << " channels " << format_->signal.channels;
+        return;
+    }
+    double ratio = format_->signal.rate / kSampleRate;
+    if (ratio < Resampler::kMinRatio || ratio > Resampler::kMaxRatio) {
+        LOG(ERROR) << "Unsupported sample rate " << format_->signal.rate;
+        return;
+    }
+    channels_ = int(format_->signal.channels);
+    ratio_ = ratio;
+    resample_ = std::fabs(ratio - 1.0) > 1e-9;
+    resampler_.setRatio(ratio);
+    VLOG(1) << "SoxDecoder rate=" << format_->signal.rate << " channels=" << channels_
+            << " length=" << format_->signal.length;
+}
+
+SoxDecoder::~SoxDecoder() {
+    if (format_ != nullptr)
+        soxClose(format_);
+}
+
+uint64_t SoxDecoder::estimatedFrames() const {
+    if (!valid() || format_->signal.length == 0 || format_->signal.length == SOX_UNKNOWN_LEN)
+        return 0;
+    return uint64_t(double(format_->signal.length / channels_) / ratio_);
+}
+
+void SoxDecoder::append(std::vector<int16_t>& out, const float* samples, size_t count) {
+    size_t offset = out.size();
+    out.resize(offset + count);
+    floatToS16(samples, out.data() + offset, count);
+}
+
+size_t SoxDecoder::read(std::vector<int16_t>& out, size_t maxFrames) {
+    out.clear();
+    if (!valid() || maxFrames == 0)
+        return 0;
+    // 重采样开始时需要积累一些输入，可能连续读取几块才有输出
+    while (out.empty() && !finished_) {
+        raw_.resize(maxFrames * channels_);
+        size_t count = sox_read(format_, raw_.data(), raw_.size()) / channels_;
+        if (count == 0) {
+            finished_ = true;
+            if (resample_) {
+                resampler_.finish();
+                resampled_.clear();
+                resampler_.pull(resampled_);
+                append(out, resampled_.data(), resampled_.size());
+            }
+            break;
+        }
+
+        mono_.resize(count);
+        float scale = kSampleScale / float(channels_);
+        for (size_t i = 0; i < count; i++) {
+            const sox_sample_t* frame = raw_.data() + i * channels_;
+            int64_t sum = 0;
+            for (int c = 0; c < channels_; c++)
+                sum += frame[c];
+            mono_[i] = float(sum) * scale;
+        }
+        if (!resample_) {
+            append(out, mono_.data(), count);
+            break;
+        }
+        resampler_.push(mono_.data(), count);
+        resampled_.clear();
+        resampler_.pull(resampled_);
+        append(out, resampled_.data(), resampled_.size());
+    }
+    return out.size();
+}
+
+}
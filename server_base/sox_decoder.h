@@ -0,0 +1,59 @@
+#ifndef SERVICE_BASE_SOX_DECODER_H_
+#define SERVICE_BASE_SOX_DECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "sox.h"
+#include "server_base/resampler.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 按块解码内存中的压缩音频(mp3、ogg、flac等)，输出16k单声道s16
+ *
+ * 每次read只解码需要的一块，解码结果不需要完整保存。多声道按照平均值混为单声道，
+ * 采样率不是16k时使用Resampler转换，比例超出Resampler的范围时valid()为false
+ */
+class SoxDecoder {
+public:
+    static const int kSampleRate = 16000;
+
+    /**
+     * @param data 压缩数据，解码期间需要保持有效
+     * @param filetype sox的文件类型，例如"mp3"
+     */
+    SoxDecoder(const void* data, size_t size, const char* filetype);
+    SoxDecoder(const SoxDecoder&) = delete;
+    SoxDecoder& operator=(const SoxDecoder&) = delete;
+    ~SoxDecoder();
+
+    bool valid() const { return format_ != nullptr && channels_ > 0 && ratio_ > 0.0; }
+
+    /**
+     * 解码下一块数据，结果覆盖out
+     *
+     * @param maxFrames 每次从文件中读取的采样数(每个声道)，重采样之后的输出长度和它成正比
+     * @return 输出的采样数，全部解码完之后返回0
+     */
+    size_t read(std::vector<int16_t>& out, size_t maxFrames = 4096);
+
+    // 按照文件头估计的输出采样数，未知时为0
+    uint64_t estimatedFrames() const;
+
+private:
+    void append(std::vector<int16_t>& out, const float* samples, size_t count);
+
+    sox_format_t* format_ = nullptr;
+    int channels_ = 0;
+    double ratio_ = 0.0;
+    bool resample_ = false;
+    bool finished_ = false;
+    Resampler resampler_;
+    std::vector<sox_sample_t> raw_;
+    std::vector<float> mono_;
+    std::vector<float> resampled_;
+};
+
+}
+#endif
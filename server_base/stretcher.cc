@@ -0,0 +1,143 @@
+#include "glog/logging.h"
+#include "server_base/stretcher.h"
+#include "server_base/audio_buffer.h"
+#include "server_base/phase_vocoder.h"
+#include "server_base/silence_stretch.h"
+#include "server_base/time_stretch.h"
+#include "server_base/wsola.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace WL::Service::Base {
+
+bool stretchBuffer(AudioStretcher& stretcher,
+                   const void* srcData,
+                   size_t srcSize,
+                   void** destData,
+                   size_t& destSize) {
+    if (!stretcher.valid())
+        return false;
+
+    // 按照tempo估计输出大小，估计不足时按照2倍增长，不会截断
+    AudioBuffer out(size_t(double(srcSize) / stretcher.tempo()) + 64);
+    if (!stretcher.push(srcData, srcSize) || !stretcher.finish())
+        return false;
+    stretcher.pull(out.sink());
+
+    void* tempDestData = out.release(destSize);
+    if (!tempDestData) {
+        LOG(ERROR) << "Error allocating buffer";
+        return false;
+    }
+    (*destData) = tempDestData;
+    return true;
+}
+
+// 慢于这个速度时atempo的效果较差，auto使用相位声码器
+static const float kAutoVocoderTempo = 0.75f;
+
+static std::mutex defaultEngineMutex;
+static std::string defaultEngine = "atempo";
+static std::atomic<bool> skipSilence(false);
+static std::atomic<bool> lowLatency(false);
+
+void setDefaultStretchEngine(const std::string& engine) {
+    std::lock_guard<std::mutex> lock(defaultEngineMutex);
+    defaultEngine = engine;
+}
+
+std::string defaultStretchEngine() {
+    std::lock_guard<std::mutex> lock(defaultEngineMutex);
+    return defaultEngine;
+}
+
+void setSilenceAwareStretch(bool enabled) {
+    skipSilence = enabled;
+}
+
+bool silenceAwareStretch() {
+    return skipSilence;
+}
+
+void setLowLatencyStretch(bool enabled) {
+    lowLatency = enabled;
+}
+
+bool lowLatencyStretch() {
+    return lowLatency;
+}
+
+std::string resolveStretchEngine(const std::string& engine, float minTempo) {
+    if (engine == "auto")
+        return minTempo < kAutoVocoderTempo ? "vocoder" : "atempo";
+    return engine;
+}
+
+std::unique_ptr<AudioStretcher> createStretcher(const std::string& name,
+                                                float tempo,
+                                                int64_t channelLayout,
+                                                int sampleRate,
+                                                AVSampleFormat sampleFormat) {
+    std::string engine = resolveStretchEngine(name, tempo);
+    std::unique_ptr<AudioStretcher> stretcher;
+    if (engine.empty() || engine == "atempo") {
+        auto timeStretcher = std::make_unique<TimeStretcher>(tempo, channelLayout, sampleRate, sampleFormat);
+        if (lowLatencyStretch())
+            timeStretcher->setFrameSize(int(timeStretcher->latency()));
+        stretcher = std::move(timeStretcher);
+    } else if (engine == "wsola") {
+        stretcher = std::make_unique<WsolaStretcher>(tempo, channelLayout, sampleRate, sampleFormat);
+    } else if (engine == "vocoder") {
+        stretcher = std::make_unique<VocoderStretcher>(tempo, channelLayout, sampleRate, sampleFormat);
+    }
+    if (!stretcher) {
+        LOG(ERROR) << "Unknown stretch engine " << engine;
+        return nullptr;
+    }
+    if (silenceAwareStretch() && !lowLatencyStretch())
+        return std::make_unique<SilenceAwareStretcher>(std::move(stretcher), channelLayout, sampleRate, sampleFormat);
+    return stretcher;
+}
+
+int64_t stretchLatency(const std::string& engine, int sampleRate) {
+    if (engine == "auto")
+        return std::max(stretchLatency("atempo", sampleRate), stretchLatency("vocoder", sampleRate));
+    if (engine.empty() || engine == "atempo")
+        return TimeStretcher::windowSize(sampleRate);
+    if (engine == "wsola")
+        return Wsola(1.0f, sampleRate).latency();
+    if (engine == "vocoder")
+        return PhaseVocoder(1.0f, sampleRate).latency();
+    return 0;
+}
+
+bool stretchTempoRange(const std::string& engine, float& minTempo, float& maxTempo) {
+    if (engine.empty() || engine == "atempo") {
+        minTempo = TimeStretcher::kMinTempo;
+        maxTempo = TimeStretcher::kMaxTempo;
+    } else if (engine == "wsola") {
+        minTempo = Wsola::kMinTempo;
+        maxTempo = Wsola::kMaxTempo;
+    } else if (engine == "vocoder") {
+        minTempo = PhaseVocoder::kMinTempo;
+        maxTempo = PhaseVocoder::kMaxTempo;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+time_stretch_t getTimeStretch(const std::string& name, float tempo) {
+    std::string engine = resolveStretchEngine(name, tempo);
+    if (engine.empty() || engine == "atempo")
+        return timeStretch;
+    if (engine == "wsola")
+        return wsolaTimeStretch;
+    if (engine == "vocoder")
+        return vocoderTimeStretch;
+    LOG(ERROR) << "Unknown stretch engine " << engine;
+    return nullptr;
+}
+
+}
@@ -0,0 +1,132 @@
+#ifndef SERVICE_BASE_STRETCHER_H_
+#define SERVICE_BASE_STRETCHER_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+namespace WL::Service::Base {
+
+// 接收变速输出的回调，data只在回调期间有效
+typedef std::function<void(const uint8_t* data, size_t size)> SampleSink;
+
+/**
+ * 流式变速器的公共接口，不同的变速引擎(atempo, wsola)都实现这个接口
+ * 数据都以byte为单位，格式由构造时的声道布局、采样率和采样格式决定
+ */
+class AudioStretcher {
+public:
+    virtual ~AudioStretcher() = default;
+
+    // 参数错误或者初始化失败时为false
+    virtual bool valid() const = 0;
+
+    virtual float tempo() const = 0;
+
+    // 修改之后送入数据的速度，已经送入的数据不受影响，tempo超出范围时返回false
+    virtual bool setTempo(float tempo) = 0;
+
+    // 送入数据，不足一个采样的部分会被忽略
+    virtual bool push(const void* data, size_t size) = 0;
+
+    // 取出目前可用的数据，直接交给sink，返回本次取出的大小
+    virtual size_t pull(const SampleSink& sink) = 0;
+
+    // 取出目前可用的数据，追加到out的末尾，返回本次取出的大小
+    size_t pull(std::vector<uint8_t>& out) {
+        return pull([&out](const uint8_t* data, size_t size) {
+            out.insert(out.end(), data, data + size);
+        });
+    }
+
+    // 冲刷缓存，使得目前送入的数据全部可以通过pull取出
+    virtual bool finish() = 0;
+
+    /**
+     * 算法延迟，以帧(每个声道一个采样)为单位，按照输入计算
+     * 不调用finish时，送入的数据中最后这么多帧对应的输出要等到之后的数据送入才能取出
+     */
+    virtual int64_t latency() const { return 0; }
+};
+
+// 整段变速函数的签名，和timeStretch相同
+typedef bool (*time_stretch_t)(const void* srcData,
+                               size_t srcSize,
+                               void** destData,
+                               size_t& destSize,
+                               float tempo,
+                               int64_t channelLayout,
+                               int sampleRate,
+                               AVSampleFormat sampleFormat);
+
+/**
+ * 使用变速器处理一整段数据
+ *
+ * @param destData [out] 目标数据，malloc分配，需要调用者释放
+ * @param destSize [out] 目标数据大小，byte为单位
+ */
+bool stretchBuffer(AudioStretcher& stretcher,
+                   const void* srcData,
+                   size_t srcSize,
+                   void** destData,
+                   size_t& destSize);
+
+/**
+ * 根据引擎名称创建流式变速器
+ *
+ * @param engine "atempo"使用FFmpeg的atempo滤镜，"wsola"使用内置的WSOLA实现，
+ *               "vocoder"使用相位声码器，"auto"在tempo小于0.75时使用vocoder，否则使用atempo
+ *               silenceAwareStretch()为true并且不是低延迟模式时，引擎外面包装SilenceAwareStretcher
+ * @return 未知的引擎返回nullptr
+ */
+std::unique_ptr<AudioStretcher> createStretcher(const std::string& engine,
+                                                float tempo,
+                                                int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                                                int sampleRate = 16000,
+                                                AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+/**
+ * 引擎的算法延迟(输入采样数)，和createStretcher创建的变速器的latency()相同，不需要先创建变速器
+ * auto可能使用atempo或者vocoder，取两者中较大的值。跳过静音时缓存的静音长度不确定，不包含在内
+ *
+ * @return 未知的引擎返回0
+ */
+int64_t stretchLatency(const std::string& engine, int sampleRate = 16000);
+
+/**
+ * 引擎支持的速度范围，和createStretcher使用相同的引擎名称
+ *
+ * @return 未知的引擎返回false
+ */
+bool stretchTempoRange(const std::string& engine, float& minTempo, float& maxTempo);
+
+// 没有指定引擎时使用的默认引擎，初始为"atempo"
+void setDefaultStretchEngine(const std::string& engine);
+std::string defaultStretchEngine();
+
+// createStretcher是否跳过静音，初始为false，见SilenceAwareStretcher
+void setSilenceAwareStretch(bool enabled);
+bool silenceAwareStretch();
+
+/**
+ * 低延迟模式，初始为false。打开之后createStretcher创建的变速器延迟有上限：
+ * 不跳过静音(静音需要缓存到结束才能处理)，atempo每次送入的帧不超过延迟窗口
+ */
+void setLowLatencyStretch(bool enabled);
+bool lowLatencyStretch();
+
+// 根据引擎名称和速度范围选出实际使用的引擎，auto在速度小于0.75时使用vocoder
+std::string resolveStretchEngine(const std::string& engine, float minTempo);
+
+// 根据引擎名称获取整段变速函数，auto需要根据tempo选择，未知的引擎返回nullptr
+time_stretch_t getTimeStretch(const std::string& engine, float tempo = 1.0f);
+
+}
+#endif
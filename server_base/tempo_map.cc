@@ -0,0 +1,287 @@
+#include "glog/logging.h"
+#include "server_base/tempo_map.h"
+#include "server_base/parallel_stretch.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace WL::Service::Base {
+
+TempoMap::TempoMap(int sampleRate)
+        : rampFrames_(std::max(sampleRate * kRampMs / 1000, kRampSteps)) {}
+
+void TempoMap::add(int64_t offset, float tempo) {
+    if (!points_.empty()) {
+        if (offset < points_.back().offset) {
+            LOG(ERROR) << "Tempo map offset must be increasing, offset " << offset;
+            return;
+        }
+        if (points_.back().tempo == tempo)
+            return;
+        // 同一位置的多个点只保留最后一个
+        if (points_.back().offset == offset) {
+            points_.back().tempo = tempo;
+            return;
+        }
+    }
+    points_.push_back({ offset, tempo });
+}
+
+float TempoMap::initialTempo() const {
+    return points_.empty() ? 1.0f : points_.front().tempo;
+}
+
+float TempoMap::minTempo() const {
+    float tempo = initialTempo();
+    for (const TempoPoint& point : points_) {
+        tempo = std::min(tempo, point.tempo);
+    }
+    return tempo;
+}
+
+float TempoMap::maxTempo() const {
+    float tempo = initialTempo();
+    for (const TempoPoint& point : points_) {
+        tempo = std::max(tempo, point.tempo);
+    }
+    return tempo;
+}
+
+std::vector<TempoPoint> TempoMap::expand(float fromTempo) const {
+    std::vector<TempoPoint> steps;
+    float prev = fromTempo;
+    for (size_t i = 0; i < points_.size(); i++) {
+        const TempoPoint& point = points_[i];
+        int64_t limit = i + 1 < points_.size() ? points_[i + 1].offset : INT64_MAX;
+        if (point.tempo == prev) {
+            steps.push_back(point);
+            continue;
+        }
+        // 下一段在过渡完成之前开始时，过渡被截断，下一段从截断时的速度开始过渡
+        for (int k = 0; k < kRampSteps; k++) {
+            int64_t offset = point.offset + int64_t(rampFrames_) * k / kRampSteps;
+            if (offset >= limit)
+                break;
+            float tempo = prev + (point.tempo - prev) * float(k + 1) / float(kRampSteps);
+            steps.push_back({ offset, tempo });
+        }
+        prev = steps.back().tempo;
+    }
+    return steps;
+}
+
+int64_t TempoMap::outputOffset(int64_t inputOffset) const {
+    double out = 0.0;
+    int64_t position = 0;
+    float tempo = initialTempo();
+    for (const TempoPoint& step : expand(tempo)) {
+        if (step.offset >= inputOffset)
+            break;
+        out += double(step.offset - position) / tempo;
+        position = step.offset;
+        tempo = step.tempo;
+    }
+    out += double(inputOffset - position) / tempo;
+    return std::llround(out);
+}
+
+TempoMapStretcher::TempoMapStretcher(std::unique_ptr<AudioStretcher> stretcher,
+                                     int64_t channelLayout,
+                                     AVSampleFormat sampleFormat)
+        : stretcher_(std::move(stretcher)),
+          bytesPerFrame_(av_get_bytes_per_sample(sampleFormat)
+                         * av_get_channel_layout_nb_channels(channelLayout)) {}
+
+void TempoMapStretcher::setTempoMap(const TempoMap& map) {
+    schedule_ = map.expand(tempo());
+    next_ = 0;
+    position_ = 0;
+    mapOutPosition_ = outPosition_;
+    mapTempo_ = tempo();
+}
+
+bool TempoMapStretcher::setTempo(float tempo) {
+    schedule_.clear();
+    next_ = 0;
+    position_ = 0;
+    mapOutPosition_ = outPosition_;
+    mapTempo_ = tempo;
+    return stretcher_ && stretcher_->setTempo(tempo);
+}
+
+int64_t TempoMapStretcher::outputPosition(int64_t offset) const {
+    double out = mapOutPosition_;
+    int64_t position = 0;
+    float tempo = mapTempo_;
+    for (const TempoPoint& step : schedule_) {
+        if (step.offset >= offset)
+            break;
+        out += double(step.offset - position) / tempo;
+        position = step.offset;
+        tempo = step.tempo;
+    }
+    out += double(offset - position) / tempo;
+    return std::llround(out);
+}
+
+bool TempoMapStretcher::push(const void* data, size_t size) {
+    if (!valid() || bytesPerFrame_ <= 0)
+        return false;
+    const auto* src = (const uint8_t*) data;
+    auto frames = int64_t(size / bytesPerFrame_);
+    while (frames > 0) {
+        // 速度表在创建时已经检查过范围，这里失败说明引擎出错，不能按照之前的速度继续
+        while (next_ < schedule_.size() && schedule_[next_].offset <= position_) {
+            if (!stretcher_->setTempo(schedule_[next_].tempo)) {
+                LOG(ERROR) << "Tempo map set tempo failed, tempo " << schedule_[next_].tempo;
+                return false;
+            }
+            next_++;
+        }
+        int64_t count = frames;
+        if (next_ < schedule_.size())
+            count = std::min(count, schedule_[next_].offset - position_);
+        if (!stretcher_->push(src, size_t(count) * bytesPerFrame_))
+            return false;
+        outPosition_ += double(count) / stretcher_->tempo();
+        src += count * bytesPerFrame_;
+        frames -= count;
+        position_ += count;
+    }
+    return true;
+}
+
+size_t TempoMapStretcher::pull(const SampleSink& sink) {
+    size_t size = stretcher_ ? stretcher_->pull(sink) : 0;
+    pulled_ += int64_t(size) / bytesPerFrame_;
+    return size;
+}
+
+bool TempoMapStretcher::finish() {
+    return valid() && stretcher_->finish();
+}
+
+std::unique_ptr<TempoMapStretcher> createTempoMapStretcher(const std::string& engine,
+                                                           const TempoMap& map,
+                                                           int64_t channelLayout,
+                                                           int sampleRate,
+                                                           AVSampleFormat sampleFormat) {
+    std::string resolved = resolveStretchEngine(engine, map.minTempo());
+    // 任何一段超出引擎的范围时都不使用这个引擎，调用者退回到sox的tempo
+    float minTempo = 0.0f;
+    float maxTempo = 0.0f;
+    if (!stretchTempoRange(resolved, minTempo, maxTempo)) {
+        LOG(ERROR) << "Unknown stretch engine " << resolved;
+        return nullptr;
+    }
+    for (const TempoPoint& point : map.points()) {
+        if (point.tempo < minTempo || point.tempo > maxTempo) {
+            LOG(WARNING) << "Tempo " << point.tempo << " is out of range for " << resolved;
+            return nullptr;
+        }
+    }
+    std::unique_ptr<AudioStretcher> stretcher = createStretcher(
+            resolved, map.initialTempo(), channelLayout, sampleRate, sampleFormat);
+    if (!stretcher)
+        return nullptr;
+    std::unique_ptr<TempoMapStretcher> mapStretcher(
+            new TempoMapStretcher(std::move(stretcher), channelLayout, sampleFormat));
+    mapStretcher->setTempoMap(map);
+    return mapStretcher;
+}
+
+bool extractTempoMap(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                     TempoMap& map,
+                     std::vector<std::string>& applied) {
+    applied.assign(soxlist.size(), std::string());
+    bool found = false;
+    float tempo = 1.0f;
+    int64_t start = 0;
+    for (size_t i = 0; i < soxlist.size(); i++) {
+        std::string& sox = std::get<0>(soxlist[i]);
+        if (sox.compare(0, 4, "pad=") != 0) {
+            // 效果之间使用'#'分隔，去掉tempo之后保留其他效果
+            float sectionTempo = 1.0f;
+            std::string others;
+            size_t begin = 0;
+            while (begin < sox.length()) {
+                size_t end = sox.find('#', begin);
+                if (end == std::string::npos)
+                    end = sox.length();
+                std::string effect = sox.substr(begin, end - begin);
+                float value = effect.compare(0, 6, "tempo=") == 0 ? float(atof(effect.c_str() + 6)) : 0.0f;
+                if (value > 0.0f) {
+                    sectionTempo = value;
+                    applied[i] = effect;
+                } else if (!effect.empty()) {
+                    others = others.empty() ? effect : others + "#" + effect;
+                }
+                begin = end + 1;
+            }
+            if (!applied[i].empty()) {
+                sox = others;
+                found = true;
+            }
+            tempo = sectionTempo;
+        }
+        map.add(start / 2, tempo);
+        start = std::get<1>(soxlist[i]) / 2 * 2;
+    }
+    return found;
+}
+
+void remapSoxList(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                  const TempoMap& map,
+                  size_t inSize,
+                  size_t outSize) {
+    for (auto& section : soxlist) {
+        auto end = size_t(std::get<1>(section) / 2 * 2);
+        size_t mapped = end >= inSize ? outSize : size_t(map.outputOffset(int64_t(end / 2)) * 2);
+        std::get<1>(section) = int(std::min(mapped, outSize));
+    }
+}
+
+void remapStreamSoxList(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                        const TempoMapStretcher& stretcher,
+                        int64_t pulledBefore,
+                        size_t outSize) {
+    for (size_t i = 0; i < soxlist.size(); i++) {
+        auto& section = soxlist[i];
+        int64_t end = std::get<1>(section) / 2;
+        int64_t mapped = (stretcher.outputPosition(end) - pulledBefore) * 2;
+        // 还留在变速器中的部分在之后的分片中输出，这里截断到本次的输出
+        mapped = std::max<int64_t>(0, std::min<int64_t>(mapped, int64_t(outSize)));
+        std::get<1>(section) = i + 1 == soxlist.size() ? int(outSize) : int(mapped);
+    }
+}
+
+bool stretchSoxTempoMap(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                        const void* data,
+                        size_t size,
+                        void** destData,
+                        size_t& destSize,
+                        std::vector<std::string>& applied) {
+    std::vector<std::tuple<std::string, int, int>> sections = soxlist;
+    TempoMap map;
+    if (!extractTempoMap(sections, map, applied))
+        return false;
+    bool ok;
+    if (map.minTempo() == map.maxTempo() && useParallelStretch(size)) {
+        // 整段速度相同的长文本拆分成多段并行变速
+        ok = parallelTimeStretch(defaultStretchEngine(), data, size, destData, destSize, map.initialTempo());
+    } else {
+        std::unique_ptr<TempoMapStretcher> stretcher = createTempoMapStretcher(defaultStretchEngine(), map);
+        ok = stretcher && stretchBuffer(*stretcher, data, size, destData, destSize);
+    }
+    if (!ok) {
+        LOG(WARNING) << "Tempo map stretch failed, fall back to sox tempo";
+        applied.clear();
+        return false;
+    }
+    remapSoxList(sections, map, size, destSize);
+    soxlist.swap(sections);
+    VLOG(1) << "Tempo map stretch, sections " << soxlist.size() << ", size " << size << " -> " << destSize;
+    return true;
+}
+
+}
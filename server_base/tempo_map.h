@@ -0,0 +1,183 @@
+#ifndef SERVICE_BASE_TEMPO_MAP_H_
+#define SERVICE_BASE_TEMPO_MAP_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "server_base/stretcher.h"
+
+namespace WL::Service::Base {
+
+// 变速点，从输入的第offset个采样(每个声道)开始使用tempo
+struct TempoPoint {
+    int64_t offset;
+    float tempo;
+};
+
+/**
+ * 分段变速的速度表，例如SSML中每一段prosody的rate
+ *
+ * 相邻两段的速度不同时，在新的一段开始之后的kRampMs内分kRampSteps步线性过渡，
+ * 避免速度突变带来的断点
+ */
+class TempoMap {
+public:
+    static const int kRampMs = 30;
+    static const int kRampSteps = 8;
+
+    explicit TempoMap(int sampleRate = 16000);
+
+    /**
+     * 从offset开始使用tempo，offset需要递增，和上一段速度相同时忽略
+     */
+    void add(int64_t offset, float tempo);
+
+    bool empty() const { return points_.empty(); }
+
+    const std::vector<TempoPoint>& points() const { return points_; }
+
+    // 第一段的速度，没有变速点时为1.0
+    float initialTempo() const;
+    float minTempo() const;
+    float maxTempo() const;
+
+    /**
+     * 展开过渡之后的变速点，相邻两个点之间速度不变
+     *
+     * @param fromTempo 第一个变速点之前的速度，和第一段不同时在开头过渡
+     */
+    std::vector<TempoPoint> expand(float fromTempo) const;
+
+    /**
+     * 输入位置对应的理想输出位置，用于换算soxlist中每一段的位置
+     */
+    int64_t outputOffset(int64_t inputOffset) const;
+
+private:
+    int rampFrames_;
+    std::vector<TempoPoint> points_;
+};
+
+/**
+ * 按照速度表变速的流式变速器，一个实例在一次处理中完成所有分段的变速
+ * push时在变速点处拆分数据，通过setTempo修改内部变速器的速度
+ */
+class TempoMapStretcher : public AudioStretcher {
+public:
+    TempoMapStretcher(std::unique_ptr<AudioStretcher> stretcher,
+                      int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                      AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+    /**
+     * 设置速度表，offset相对于下一次push的第一个采样
+     * 和当前速度不同时从当前速度过渡
+     */
+    void setTempoMap(const TempoMap& map);
+
+    bool valid() const override { return stretcher_ && stretcher_->valid(); }
+
+    float tempo() const override { return stretcher_ ? stretcher_->tempo() : 1.0f; }
+
+    // 清空速度表，之后全部使用tempo
+    bool setTempo(float tempo) override;
+
+    bool push(const void* data, size_t size) override;
+
+    using AudioStretcher::pull;
+
+    size_t pull(const SampleSink& sink) override;
+
+    bool finish() override;
+
+    int64_t latency() const override { return stretcher_ ? stretcher_->latency() : 0; }
+
+    /**
+     * 设置速度表之后第offset个输入采样对应的理想输出位置，从第一次push开始累计
+     * 流式处理时分片的输出包含上一个分片留在变速器中的数据，按照这个位置换算分段的位置
+     */
+    int64_t outputPosition(int64_t offset) const;
+
+    // 从第一次push开始累计取出的采样数(每个声道)
+    int64_t pulledFrames() const { return pulled_; }
+
+private:
+    std::unique_ptr<AudioStretcher> stretcher_;
+    int bytesPerFrame_;
+    std::vector<TempoPoint> schedule_;
+    size_t next_ = 0;
+    // 设置速度表之后送入的采样数
+    int64_t position_ = 0;
+    // 已经送入的数据对应的理想输出长度，以及设置速度表时的理想输出长度和速度
+    double outPosition_ = 0.0;
+    double mapOutPosition_ = 0.0;
+    float mapTempo_ = 1.0f;
+    int64_t pulled_ = 0;
+};
+
+/**
+ * 根据速度表创建变速器，auto按照速度表中最慢的速度选择引擎
+ *
+ * @return 未知的引擎，或者速度表中有超出引擎范围的速度时返回nullptr
+ */
+std::unique_ptr<TempoMapStretcher> createTempoMapStretcher(const std::string& engine,
+                                                           const TempoMap& map,
+                                                           int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                                                           int sampleRate = 16000,
+                                                           AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+/**
+ * 从soxlist中取出每一段的tempo效果组成速度表，并且从sox效果中去掉tempo
+ * soxlist中的位置为16k单声道s16数据的byte偏移，pad段沿用上一段的速度
+ *
+ * @param applied [out] 每一段去掉的tempo效果，没有时为空
+ * @return soxlist中没有tempo时返回false，soxlist不变
+ */
+bool extractTempoMap(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                     TempoMap& map,
+                     std::vector<std::string>& applied);
+
+/**
+ * 把soxlist中每一段的结束位置换算为变速之后的位置
+ *
+ * @param inSize 变速之前的数据大小，byte为单位，到达结尾的段换算为outSize
+ * @param outSize 变速之后的数据大小，byte为单位，所有的段都不会超过这个大小
+ */
+void remapSoxList(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                  const TempoMap& map,
+                  size_t inSize,
+                  size_t outSize);
+
+/**
+ * 流式变速时把soxlist中每一段的结束位置换算为本次取出的输出中的位置
+ * 本次的输出以上一个分片留在变速器中的数据开始，并且不包含仍然留在变速器中的数据，
+ * 因此按照变速器累计的理想输出位置和已经取出的位置换算，而不是按照本次的输入和输出大小
+ *
+ * @param pulledBefore 本次pull之前变速器已经取出的采样数，见TempoMapStretcher::pulledFrames
+ * @param outSize 本次取出的数据大小，byte为单位，最后一段换算为outSize
+ */
+void remapStreamSoxList(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                        const TempoMapStretcher& stretcher,
+                        int64_t pulledBefore,
+                        size_t outSize);
+
+/**
+ * 使用一个变速器一次完成soxlist中所有段的tempo，引擎为defaultStretchEngine()
+ * 成功时soxlist中去掉tempo效果，每一段的位置换算为变速之后的位置
+ * 所有段速度相同并且数据足够长时使用parallelTimeStretch多线程变速
+ *
+ * @param data 16k单声道s16裸数据
+ * @param destData [out] 变速之后的数据，malloc分配，需要调用者释放
+ * @param applied [out] 每一段去掉的tempo效果，没有时为空
+ * @return soxlist中没有tempo或者变速失败时返回false，soxlist不变
+ */
+bool stretchSoxTempoMap(std::vector<std::tuple<std::string, int, int>>& soxlist,
+                        const void* data,
+                        size_t size,
+                        void** destData,
+                        size_t& destSize,
+                        std::vector<std::string>& applied);
+
+}
+#endif
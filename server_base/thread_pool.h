@@ -0,0 +1,56 @@
+#ifndef SERVICE_BASE_THREAD_POOL_H_
+#define SERVICE_BASE_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace WL::Service::Base {
+
+/**
+ * 固定数量工作线程的线程池，任务按照提交顺序执行
+ * 析构时等待已经提交的任务全部完成
+ */
+class ThreadPool {
+public:
+    // threads小于等于0时使用硬件线程数
+    explicit ThreadPool(int threads = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t size() const { return workers_.size(); }
+
+    /**
+     * 提交任务，通过返回的future等待结果
+     */
+    template<typename F>
+    auto submit(F&& func) -> std::future<decltype(func())> {
+        using Result = decltype(func());
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        std::future<Result> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace([task]() { (*task)(); });
+        }
+        cond_.notify_one();
+        return result;
+    }
+
+private:
+    void run();
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_ = false;
+};
+
+}
+#endif
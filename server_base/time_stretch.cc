@@ -0,0 +1,491 @@
+#include "glog/logging.h"
+#include "server_base/time_stretch.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <string>
+
+extern "C" {
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+}
+
+namespace WL::Service::Base {
+
+FilterGraphKey FilterGraphKey::make(float tempo,
+                                    int64_t channelLayout,
+                                    int sampleRate,
+                                    AVSampleFormat sampleFormat) {
+    FilterGraphKey key;
+    key.tempo = std::round(tempo * 1000.0f) / 1000.0f;
+    key.channelLayout = channelLayout;
+    key.sampleRate = sampleRate;
+    key.sampleFormat = sampleFormat;
+    return key;
+}
+
+bool FilterGraphKey::operator==(const FilterGraphKey& other) const {
+    return tempo == other.tempo
+           && channelLayout == other.channelLayout
+           && sampleRate == other.sampleRate
+           && sampleFormat == other.sampleFormat;
+}
+
+size_t FilterGraphKeyHash::operator()(const FilterGraphKey& key) const {
+    size_t h = std::hash<float>()(key.tempo);
+    h = h * 31 + std::hash<int64_t>()(key.channelLayout);
+    h = h * 31 + std::hash<int>()(key.sampleRate);
+    h = h * 31 + std::hash<int>()(key.sampleFormat);
+    return h;
+}
+
+FilterGraph::~FilterGraph() {
+    // avfilter_graph_free会释放图中所有的滤镜
+    if (graph)
+        avfilter_graph_free(&graph);
+}
+
+FilterGraphPool::FilterGraphPool(size_t maxIdlePerKey, size_t maxIdle)
+        : maxIdlePerKey_(maxIdlePerKey), maxIdle_(maxIdle) {}
+
+FilterGraphPool& FilterGraphPool::instance() {
+    static FilterGraphPool pool;
+    return pool;
+}
+
+std::unique_ptr<FilterGraph> FilterGraphPool::acquire(const FilterGraphKey& key) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = idle_.find(key);
+        if (it != idle_.end()) {
+            IdleList::iterator pos = it->second.back();
+            std::unique_ptr<FilterGraph> filterGraph = std::move(*pos);
+            lru_.erase(pos);
+            it->second.pop_back();
+            if (it->second.empty())
+                idle_.erase(it);
+            return filterGraph;
+        }
+    }
+    // 创建滤镜图比较耗时，不需要持有锁
+    return create(key);
+}
+
+void FilterGraphPool::release(std::unique_ptr<FilterGraph> filterGraph) {
+    if (!filterGraph || maxIdlePerKey_ == 0 || maxIdle_ == 0)
+        return;
+    // 被淘汰的滤镜图在锁外释放
+    std::unique_ptr<FilterGraph> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& graphs = idle_[filterGraph->key];
+        if (graphs.size() >= maxIdlePerKey_) {
+            evicted = std::move(filterGraph);
+        } else {
+            lru_.push_front(std::move(filterGraph));
+            graphs.push_back(lru_.begin());
+        }
+        if (lru_.size() > maxIdle_) {
+            // 最久没有使用的滤镜图一定是它所在的键中最早归还的
+            IdleList::iterator oldest = std::prev(lru_.end());
+            auto it = idle_.find((*oldest)->key);
+            it->second.erase(it->second.begin());
+            if (it->second.empty())
+                idle_.erase(it);
+            evicted = std::move(*oldest);
+            lru_.erase(oldest);
+        }
+    }
+}
+
+std::unique_ptr<FilterGraph> FilterGraphPool::create(const FilterGraphKey& key) {
+    // Set up the filter graph.
+    // The filter chain it uses is:
+    // (input) -> abuffer -> atempo -> aformat -> abuffersink -> (output)
+    // abuffer: This provides the endpoint where you can feed the decoded samples.
+    // atempo: The filter accepts exactly one parameter, the audio tempo.
+    // If not specified then the filter will assume nominal 1.0 tempo.
+    // Tempo must be in the [0.5, 100.0] range.
+    // aformat: This converts the samples to the sample freq, channel layout,
+    // and sample format required by the audio device.
+    // abuffersink: This provides the endpoint where you can read the samples after
+    // they have passed through the filter chain.
+    std::unique_ptr<FilterGraph> filterGraph(new FilterGraph);
+    filterGraph->key = key;
+
+    // Create a new filter graph, which will contain all the filters.
+    filterGraph->graph = avfilter_graph_alloc();
+    if (!filterGraph->graph) {
+        LOG(ERROR) << "Unable to create filter graph";
+        return nullptr;
+    }
+
+    // Create the abuffer filter;
+    // it will be used for feeding the data into the graph.
+    const AVFilter* abuffer = avfilter_get_by_name("abuffer");
+    if (!abuffer) {
+        LOG(ERROR) << "Could not find the abuffer filter";
+        return nullptr;
+    }
+    AVFilterContext* abufferCtx = avfilter_graph_alloc_filter(filterGraph->graph, abuffer, "src");
+    if (!abufferCtx) {
+        LOG(ERROR) << "Could not allocate the abuffer instance";
+        return nullptr;
+    }
+    // Set the filter options through the AVOptions API.
+    char chLayoutStr[64];
+    av_get_channel_layout_string(chLayoutStr,
+                                 sizeof(chLayoutStr),
+                                 av_get_channel_layout_nb_channels(key.channelLayout),
+                                 key.channelLayout);
+    av_opt_set(abufferCtx, "channel_layout", chLayoutStr, AV_OPT_SEARCH_CHILDREN);
+    av_opt_set(abufferCtx,
+               "sample_fmt",
+               av_get_sample_fmt_name(key.sampleFormat),
+               AV_OPT_SEARCH_CHILDREN);
+    av_opt_set_q(abufferCtx,
+                 "time_base",
+                 (AVRational) {1, key.sampleRate},
+                 AV_OPT_SEARCH_CHILDREN);
+    av_opt_set_int(abufferCtx, "sample_rate", key.sampleRate, AV_OPT_SEARCH_CHILDREN);
+    // Now initialize the filter; we pass NULL options, since we have already
+    // set all the options above.
+    int err = avfilter_init_str(abufferCtx, nullptr);
+    if (err < 0) {
+        LOG(ERROR) << "Could not initialize the abuffer filter";
+        return nullptr;
+    }
+
+    // Create atempo filter
+    const AVFilter* atempo = avfilter_get_by_name("atempo");
+    if (!atempo) {
+        LOG(ERROR) << "Could not find the atempo filter";
+        return nullptr;
+    }
+    AVFilterContext* atempoCtx = avfilter_graph_alloc_filter(filterGraph->graph, atempo, "atempo");
+    if (!atempoCtx) {
+        LOG(ERROR) << "Could not allocate the atempo instance";
+        return nullptr;
+    }
+    // A different way of passing the options is as key/value pairs in a dictionary.
+    AVDictionary* optionsDict = nullptr;
+    av_dict_set(&optionsDict, "tempo", std::to_string(key.tempo).c_str(), 0);
+    err = avfilter_init_dict(atempoCtx, &optionsDict);
+    av_dict_free(&optionsDict);
+    if (err < 0) {
+        LOG(ERROR) << "Could not initialize the atempo filter";
+        return nullptr;
+    }
+
+    // Create the aformat filter.
+    // It ensures that the output is of the format we want.
+    const AVFilter* aformat = avfilter_get_by_name("aformat");
+    if (!aformat) {
+        LOG(ERROR) << "Could not find the aformat filter";
+        return nullptr;
+    }
+    AVFilterContext* aformatCtx = avfilter_graph_alloc_filter(filterGraph->graph, aformat, "aformat");
+    if (!aformatCtx) {
+        LOG(ERROR) << "Could not allocate the aformat instance";
+        return nullptr;
+    }
+    // A third way of passing the options is in a string of the form
+    // key1=value1:key2=value2...
+    uint8_t optionsStr[1024];
+    // 输出和输入的格式保持一致
+    snprintf((char*) optionsStr, sizeof(optionsStr),
+             "sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
+             av_get_sample_fmt_name(key.sampleFormat), key.sampleRate, chLayoutStr);
+    err = avfilter_init_str(aformatCtx, (char*) optionsStr);
+    if (err < 0) {
+        LOG(ERROR) << "Could not initialize the aformat filter";
+        return nullptr;
+    }
+
+    // Finally, create the abuffersink filter;
+    // it will be used to get the filtered data out of the graph.
+    const AVFilter* abuffersink = avfilter_get_by_name("abuffersink");
+    if (!abuffersink) {
+        LOG(ERROR) << "Could not find the abuffersink filter";
+        return nullptr;
+    }
+    AVFilterContext* abuffersinkCtx = avfilter_graph_alloc_filter(filterGraph->graph, abuffersink, "sink");
+    if (!abuffersinkCtx) {
+        LOG(ERROR) << "Could not allocate the abuffersink instance";
+        return nullptr;
+    }
+    // This filter takes no options.
+    err = avfilter_init_str(abuffersinkCtx, nullptr);
+    if (err < 0) {
+        LOG(ERROR) << "Could not initialize the abuffersink instance";
+        return nullptr;
+    }
+
+    // Connect the filters;
+    // in this simple case the filters just form a linear chain.
+    err = avfilter_link(abufferCtx, 0, atempoCtx, 0);
+    if (err >= 0)
+        err = avfilter_link(atempoCtx, 0, aformatCtx, 0);
+    if (err >= 0)
+        err = avfilter_link(aformatCtx, 0, abuffersinkCtx, 0);
+    if (err < 0) {
+        LOG(ERROR) << "Error connecting filters";
+        return nullptr;
+    }
+
+    // Configure the graph.
+    err = avfilter_graph_config(filterGraph->graph, nullptr);
+    if (err < 0) {
+        LOG(ERROR) << "Error configuring the filter graph";
+        return nullptr;
+    }
+
+    filterGraph->srcCtx = abufferCtx;
+    filterGraph->sinkCtx = abuffersinkCtx;
+    VLOG(1) << "Create filter graph, tempo " << key.tempo
+            << ", sampleRate " << key.sampleRate;
+    return filterGraph;
+}
+
+TimeStretcher::TimeStretcher(float tempo,
+                             int64_t channelLayout,
+                             int sampleRate,
+                             AVSampleFormat sampleFormat)
+        : tempo_(tempo),
+          channelLayout_(channelLayout),
+          sampleRate_(sampleRate),
+          sampleFormat_(av_get_packed_sample_fmt(sampleFormat)),
+          channels_(av_get_channel_layout_nb_channels(channelLayout)),
+          bytesPerFrame_(av_get_bytes_per_sample(sampleFormat) * channels_) {
+    if (tempo < kMinTempo || tempo > kMaxTempo) {
+        LOG(ERROR) << "Invalid tempo param, tempo " << tempo;
+        return;
+    }
+    if (channels_ <= 0 || bytesPerFrame_ <= 0) {
+        LOG(ERROR) << "Invalid audio format, channelLayout " << channelLayout
+                   << ", sampleFormat " << sampleFormat;
+        return;
+    }
+    // Allocate the frame we will be using to store the data.
+    frame_ = av_frame_alloc();
+    if (!frame_) {
+        LOG(ERROR) << "Error allocating the frame";
+        return;
+    }
+    FilterGraphKey key = FilterGraphKey::make(tempo, channelLayout, sampleRate, sampleFormat_);
+    filterGraph_ = FilterGraphPool::instance().acquire(key);
+    if (!filterGraph_)
+        return;
+    // 池中取出的滤镜图可能残留上一次使用的输出，从当前位置开始计算
+    tempo_ = key.tempo;
+    outBegin_ = std::llround(filterGraph_->outPosition);
+}
+
+TimeStretcher::~TimeStretcher() {
+    if (frame_)
+        av_frame_free(&frame_);
+    // 没有finish的滤镜图(请求取消或者中途出错)仍然缓存着这个请求的数据，直接释放
+    if (filterGraph_ && flushed_ && !tempoChanged_)
+        FilterGraphPool::instance().release(std::move(filterGraph_));
+}
+
+// 输入数据的内存属于调用者，滤镜图释放引用时不需要做任何事
+static void keepCallerBuffer(void* /*opaque*/, uint8_t* /*data*/) {
+}
+
+void TimeStretcher::setFrameSize(int nbSamples) {
+    if (nbSamples <= 0) {
+        LOG(ERROR) << "Invalid frame size " << nbSamples;
+        return;
+    }
+    frameSize_ = nbSamples;
+    silence_.clear();
+}
+
+bool TimeStretcher::sendFrame(const uint8_t* data, int nbSamples) {
+    frame_->sample_rate = sampleRate_;
+    frame_->format = sampleFormat_;
+    frame_->channel_layout = channelLayout_;
+    frame_->channels = channels_;
+    frame_->nb_samples = nbSamples;
+    frame_->pts = filterGraph_->samplesIn;
+    int size = nbSamples * bytesPerFrame_;
+    // data为空时送入静音
+    if (!data) {
+        if (silence_.size() < size_t(size)) {
+            silence_.resize(size);
+            uint8_t* planes[1] = { silence_.data() };
+            av_samples_set_silence(planes, 0, int(silence_.size()) / bytesPerFrame_,
+                                   channels_, sampleFormat_);
+        }
+        data = silence_.data();
+    }
+    // frame直接引用数据，不分配也不复制
+    frame_->buf[0] = av_buffer_create((uint8_t*) data, size, keepCallerBuffer,
+                                      nullptr, AV_BUFFER_FLAG_READONLY);
+    AVBufferRef* input = frame_->buf[0] ? av_buffer_ref(frame_->buf[0]) : nullptr;
+    if (!input) {
+        av_frame_unref(frame_);
+        LOG(ERROR) << "Error creating the frame buffer";
+        return false;
+    }
+    frame_->data[0] = (uint8_t*) data;
+    frame_->extended_data = frame_->data;
+    frame_->linesize[0] = size;
+    filterGraph_->samplesIn += nbSamples;
+    filterGraph_->outPosition += double(nbSamples) / tempo_;
+
+    // Send the frame to the input of the filter graph.
+    // PUSH使得滤镜图在返回之前运行到没有可以处理的数据为止。atempo的filter_frame把采样复制到自己的环形缓存后
+    // 立即释放输入帧，aformat和abuffersink不会阻塞，因此返回时滤镜图不再引用调用者的内存。
+    // 如果仍然被引用，说明滤镜图的结构和上面的假设不同，这个滤镜图不能再使用，
+    // 调用者(push/finish)会在返回之前释放它，保证调用者的内存被释放之后不会再被读取
+    int err = av_buffersrc_add_frame_flags(filterGraph_->srcCtx, frame_, AV_BUFFERSRC_FLAG_PUSH);
+    bool retained = err >= 0 && av_buffer_get_ref_count(input) > 1;
+    av_buffer_unref(&input);
+    if (err < 0) {
+        av_frame_unref(frame_);
+        LOG(ERROR) << "Error submitting the frame to the filter graph";
+        return false;
+    }
+    if (retained) {
+        LOG(ERROR) << "Filter graph keeps the input frame, drop the filter graph";
+        return false;
+    }
+    return true;
+}
+
+void TimeStretcher::drain(const SampleSink& sink) {
+    while (av_buffersink_get_frame(filterGraph_->sinkCtx, frame_) >= 0) {
+        int64_t frameBegin = filterGraph_->samplesOut;
+        int64_t frameEnd = frameBegin + frame_->nb_samples;
+        filterGraph_->samplesOut = frameEnd;
+        // 裁掉不属于当前这一段音频的部分
+        int64_t begin = std::max(frameBegin, outBegin_);
+        int64_t end = std::min(frameEnd, outEnd_);
+        if (begin < end) {
+            // 输出为交错格式，所有声道都在extended_data[0]中
+            const uint8_t* src = frame_->extended_data[0] + (begin - frameBegin) * bytesPerFrame_;
+            sink(src, size_t(end - begin) * bytesPerFrame_);
+        }
+        av_frame_unref(frame_);
+    }
+}
+
+bool TimeStretcher::setTempo(float tempo) {
+    if (!valid())
+        return false;
+    if (tempo < kMinTempo || tempo > kMaxTempo) {
+        LOG(ERROR) << "Invalid tempo param, tempo " << tempo;
+        return false;
+    }
+    if (tempo == tempo_)
+        return true;
+    int err = avfilter_graph_send_command(filterGraph_->graph, "atempo", "tempo",
+                                          std::to_string(tempo).c_str(), nullptr, 0, 0);
+    if (err < 0) {
+        LOG(ERROR) << "Error sending tempo command, tempo " << tempo;
+        return false;
+    }
+    tempo_ = tempo;
+    tempoChanged_ = true;
+    return true;
+}
+
+bool TimeStretcher::push(const void* data, size_t size) {
+    if (!valid())
+        return false;
+    // 上一段已经冲刷，开始新的一段
+    if (outEnd_ != INT64_MAX) {
+        outBegin_ = std::llround(filterGraph_->outPosition);
+        outEnd_ = INT64_MAX;
+    }
+    flushed_ = false;
+    size_t srcIndex = 0; // 记录目前处理过的原始数据下标，以byte为单位
+    while (srcIndex + bytesPerFrame_ <= size) {
+        int nbSamples = frameSize_;
+        // 存在size - srcIndex < nbSamples * bytesPerSamples的情况
+        if (size - srcIndex < size_t(nbSamples * bytesPerFrame_)) {
+            nbSamples = int(size - srcIndex) / bytesPerFrame_;
+        }
+        if (!sendFrame(((const uint8_t*) data) + srcIndex, nbSamples)) {
+            // 滤镜图的状态不确定，不再放回池中
+            filterGraph_.reset();
+            return false;
+        }
+        srcIndex += nbSamples * bytesPerFrame_;
+    }
+    return true;
+}
+
+size_t TimeStretcher::pull(const SampleSink& sink) {
+    size_t count = 0;
+    if (!pending_.empty()) {
+        sink(pending_.data(), pending_.size());
+        count = pending_.size();
+        pending_.clear();
+    }
+    // Get all the filtered output that is available.
+    if (valid()) {
+        drain([&sink, &count](const uint8_t* data, size_t size) {
+            sink(data, size);
+            count += size;
+        });
+    }
+    return count;
+}
+
+int64_t TimeStretcher::windowSize(int sampleRate) {
+    int64_t window = 1;
+    while (window < sampleRate / 24)
+        window <<= 1;
+    return window;
+}
+
+bool TimeStretcher::finish() {
+    if (!valid())
+        return false;
+    if (outEnd_ != INT64_MAX)
+        return true;
+    // 不发送EOF，送入静音把atempo缓存的数据推出来，滤镜图就可以继续使用
+    outEnd_ = std::llround(filterGraph_->outPosition);
+    int64_t flushLimit = filterGraph_->samplesIn + sampleRate_;
+    // 冲刷出来的数据只有atempo缓存的一小段，先暂存等待pull
+    SampleSink keep = [this](const uint8_t* data, size_t size) {
+        pending_.insert(pending_.end(), data, data + size);
+    };
+    drain(keep);
+    while (filterGraph_->samplesOut < outEnd_) {
+        if (filterGraph_->samplesIn >= flushLimit) {
+            // 滤镜图已经释放，之后的push都会失败，需要让调用者知道
+            LOG(ERROR) << "Flush filter graph timeout, tempo " << tempo_;
+            filterGraph_.reset();
+            return false;
+        }
+        if (!sendFrame(nullptr, std::min(frameSize_, 1024))) {
+            filterGraph_.reset();
+            return false;
+        }
+        drain(keep);
+    }
+    flushed_ = true;
+    return true;
+}
+
+bool timeStretch(const void* srcData,
+                 size_t srcSize,
+                 void** destData,
+                 size_t& destSize,
+                 float tempo,
+                 int64_t channelLayout,
+                 int sampleRate,
+                 AVSampleFormat sampleFormat) {
+    TimeStretcher stretcher(tempo, channelLayout, sampleRate, sampleFormat);
+    return stretchBuffer(stretcher, srcData, srcSize, destData, destSize);
+}
+
+}
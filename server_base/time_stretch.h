@@ -0,0 +1,246 @@
+#ifndef SERVICE_BASE_TIME_STRETCH_H_
+#define SERVICE_BASE_TIME_STRETCH_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "server_base/stretcher.h"
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+namespace WL::Service::Base {
+
+/**
+ * 滤镜图的缓存键，参数完全相同的滤镜图可以直接复用
+ * tempo按照0.001的精度取整，避免浮点误差导致缓存无法命中
+ */
+struct FilterGraphKey {
+    float tempo;
+    int64_t channelLayout;
+    int sampleRate;
+    AVSampleFormat sampleFormat;
+
+    static FilterGraphKey make(float tempo,
+                               int64_t channelLayout,
+                               int sampleRate,
+                               AVSampleFormat sampleFormat);
+
+    bool operator==(const FilterGraphKey& other) const;
+};
+
+struct FilterGraphKeyHash {
+    size_t operator()(const FilterGraphKey& key) const;
+};
+
+/**
+ * 已经配置完成的滤镜图
+ * (input) -> abuffer -> atempo -> aformat -> abuffersink -> (output)
+ *
+ * 滤镜图从来不发送EOF，每次使用结束时送入静音把atempo中缓存的数据推出来，
+ * 因此可以一直复用。samplesIn和samplesOut记录整个生命周期中累计送入和取出的采样数，
+ * outPosition记录已经送入的数据对应的理想输出位置(每一帧的采样数 / 当时的tempo之和)，
+ * 据此可以裁掉上一次使用残留的静音输出。
+ */
+struct FilterGraph {
+    FilterGraphKey key;
+    AVFilterGraph* graph = nullptr;
+    AVFilterContext* srcCtx = nullptr;
+    AVFilterContext* sinkCtx = nullptr;
+    int64_t samplesIn = 0;
+    int64_t samplesOut = 0;
+    double outPosition = 0.0;
+
+    FilterGraph() = default;
+    FilterGraph(const FilterGraph&) = delete;
+    FilterGraph& operator=(const FilterGraph&) = delete;
+    ~FilterGraph();
+};
+
+/**
+ * 滤镜图池，按照(tempo, 声道布局, 采样率, 采样格式)缓存配置好的滤镜图
+ * 大部分请求只使用少数几个tempo，复用之后可以省掉每个分片的
+ * avfilter_get_by_name、创建、连接以及avfilter_graph_config的开销
+ *
+ * tempo由客户端指定，键的数量没有上限，因此空闲的滤镜图总数也有上限，
+ * 超出时释放所有键中最久没有使用的滤镜图
+ */
+class FilterGraphPool {
+public:
+    explicit FilterGraphPool(size_t maxIdlePerKey = 8, size_t maxIdle = 64);
+
+    // 进程内共享的滤镜图池
+    static FilterGraphPool& instance();
+
+    /**
+     * 取出一个配置好的滤镜图，池中没有时新建
+     *
+     * @return 失败返回nullptr
+     */
+    std::unique_ptr<FilterGraph> acquire(const FilterGraphKey& key);
+
+    /**
+     * 归还滤镜图，调用者需要保证滤镜图已经冲刷完成
+     * 出错的滤镜图不应该归还，直接释放即可
+     */
+    void release(std::unique_ptr<FilterGraph> filterGraph);
+
+private:
+    static std::unique_ptr<FilterGraph> create(const FilterGraphKey& key);
+
+    using IdleList = std::list<std::unique_ptr<FilterGraph>>;
+
+    std::mutex mutex_;
+    size_t maxIdlePerKey_;
+    size_t maxIdle_;
+    // 所有空闲的滤镜图，最近归还的在前面
+    IdleList lru_;
+    // 每个键对应的空闲滤镜图在lru_中的位置，按照归还的先后顺序排列
+    std::unordered_map<FilterGraphKey,
+            std::vector<IdleList::iterator>,
+            FilterGraphKeyHash> idle_;
+};
+
+/**
+ * 有状态的流式变速器，整个流的生命周期中持有同一个滤镜图
+ * 每个分片只需要push之后pull，不需要重建和冲刷滤镜图，分片之间也不会出现断点
+ *
+ * 用法:
+ *   TimeStretcher stretcher(0.8);
+ *   stretcher.push(chunk, chunkSize);
+ *   stretcher.pull(out);      // 取出目前可用的数据
+ *   ...
+ *   stretcher.finish();       // 最后一个分片之后冲刷
+ *   stretcher.pull(out);
+ *
+ * finish之后可以继续push新的一段音频，新的一段和之前的输出互不影响
+ * 不是线程安全的，一个流使用一个实例
+ *
+ * 数据为交错格式，支持任意声道数，声道数由channelLayout决定。
+ * 指定planar采样格式时按照对应的交错格式处理(例如s16p按照s16)，不需要调用者拆分声道。
+ *
+ * 送入的数据不会被复制，frame直接引用调用者的内存，并且以AV_BUFFERSRC_FLAG_PUSH立即驱动滤镜图，
+ * push返回时atempo已经把数据读入自己的缓存。输出的frame直接交给pull的sink，不经过中间缓存
+ */
+class TimeStretcher : public AudioStretcher {
+public:
+    explicit TimeStretcher(float tempo,
+                           int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                           int sampleRate = 16000,
+                           AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+    TimeStretcher(const TimeStretcher&) = delete;
+    TimeStretcher& operator=(const TimeStretcher&) = delete;
+    ~TimeStretcher() override;
+
+    // atempo支持的速度范围
+    static constexpr float kMinTempo = 0.5f;
+    static constexpr float kMaxTempo = 100.0f;
+
+    // 默认每一帧送入的采样数
+    static const int kDefaultFrameSize = 4096;
+
+    // 设置每一帧送入的采样数，帧越大调用滤镜图的次数越少
+    void setFrameSize(int nbSamples);
+
+    int frameSize() const { return frameSize_; }
+
+    // 参数错误或者滤镜图创建失败时为false
+    bool valid() const override { return filterGraph_ != nullptr; }
+
+    float tempo() const override { return tempo_; }
+
+    /**
+     * 通过atempo的tempo命令修改速度，不需要重建滤镜图
+     * 修改过速度的滤镜图输出位置可能和理想位置有少量偏差，不再放回池中
+     *
+     * @param tempo 范围为[0.5, 100.0]
+     */
+    bool setTempo(float tempo) override;
+
+    /**
+     * 送入数据
+     *
+     * @param data 原始数据
+     * @param size 数据大小，byte为单位，不足一个采样的部分会被忽略
+     * @return 是否成功
+     */
+    bool push(const void* data, size_t size) override;
+
+    using AudioStretcher::pull;
+
+    /**
+     * 取出目前可用的数据，直接交给sink
+     *
+     * @return 本次取出的数据大小，byte为单位
+     */
+    size_t pull(const SampleSink& sink) override;
+
+    /**
+     * 冲刷滤镜图，使得目前送入的数据全部可以通过pull取出
+     */
+    bool finish() override;
+
+    // atempo的窗口长度，采样率 / 24向上取整到2的幂，约40ms到80ms
+    int64_t latency() const override { return windowSize(sampleRate_); }
+
+    // 和latency()相同，不需要创建实例
+    static int64_t windowSize(int sampleRate);
+
+private:
+    bool sendFrame(const uint8_t* data, int nbSamples);
+    void drain(const SampleSink& sink);
+
+    float tempo_;
+    int64_t channelLayout_;
+    int sampleRate_;
+    // 滤镜图使用交错格式，planar格式转换为对应的交错格式
+    AVSampleFormat sampleFormat_;
+    int channels_;
+    // 一帧(所有声道各一个采样)的大小
+    int bytesPerFrame_;
+    int frameSize_ = kDefaultFrameSize;
+    bool tempoChanged_ = false;
+    // 滤镜图中没有残留的输入，新取出的滤镜图以及finish完成之后为true
+    // 只有这样的滤镜图才能放回池中，否则atempo缓存的数据会出现在下一个请求的输出中
+    bool flushed_ = true;
+    // 冲刷使用的静音，一帧大小
+    std::vector<uint8_t> silence_;
+    std::unique_ptr<FilterGraph> filterGraph_;
+    AVFrame* frame_ = nullptr;
+    // 当前这一段音频对应的输出采样区间为[outBegin_, outEnd_)
+    int64_t outBegin_ = 0;
+    int64_t outEnd_ = INT64_MAX;
+    // finish过程中取出的数据，等待pull
+    std::vector<uint8_t> pending_;
+};
+
+/**
+ * 对音频进行变速处理
+ *
+ * @param srcData 原始数据
+ * @param srcSize 原始数据大小，byte为单位
+ * @param destData [out] 目标数据，需要调用者管理分配的内存
+ * @param destSize [out] 目标数据大小，byte为单位
+ * @param tempo 变速大小，范围为[0.5, 100.0]
+ * @param channelLayout 原始数据声道布局，多声道数据为交错格式
+ * @param sampleRate 原始数据采样率
+ * @param sampleFormat 原始数据采样格式
+ * @return 是否变速成功
+ */
+bool timeStretch(const void* srcData,
+                 size_t srcSize,
+                 void** destData,
+                 size_t& destSize,
+                 float tempo = 1.0,
+                 int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                 int sampleRate = 16000,
+                 AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+}
+#endif
@@ -0,0 +1,110 @@
+#include "glog/logging.h"
+#include "server_base/worker_context.h"
+#include <atomic>
+#include <cstring>
+
+namespace WL::Service::Base {
+
+static std::once_flag soxInitFlag;
+static bool soxInitialized = false;
+static std::mutex soxFormatMutex;
+// libsox以OpenMP编译时共享的FFT缓存带有读写锁
+static bool soxThreadSafeDsp = false;
+static std::mutex soxDspMutex;
+static std::atomic<int> nextWorkerId(0);
+
+// 使用lsx_safe_rdft(共享的FFT缓存)的效果
+static const char* const kSharedDspEffects[] = {
+    "rate", "speed", "pitch", "sinc", "fir", "firfit", "loudness", "noisered", "spectrogram",
+};
+
+bool initSox() {
+    std::call_once(soxInitFlag, [] {
+        soxInitialized = sox_init() == SOX_SUCCESS;
+        if (!soxInitialized) {
+            LOG(ERROR) << "sox_init failed";
+            return;
+        }
+        soxThreadSafeDsp = (sox_version_info()->flags & sox_version_have_threads) != 0;
+        if (!soxThreadSafeDsp)
+            LOG(WARNING) << "libsox is built without OpenMP, effect chains using rate/sinc/fir are serialized";
+    });
+    return soxInitialized;
+}
+
+void shutdownSox() {
+    std::lock_guard<std::mutex> lock(soxFormatMutex);
+    if (soxInitialized)
+        sox_quit();
+    soxInitialized = false;
+}
+
+SoxFormatLock::SoxFormatLock() : lock_(soxFormatMutex) {}
+
+sox_format_t* soxOpenMemRead(const void* buffer, size_t size, const char* filetype) {
+    SoxFormatLock lock;
+    return sox_open_mem_read((void*) buffer, size, nullptr, nullptr, filetype);
+}
+
+sox_format_t* soxOpenMemWrite(void* buffer, size_t size, const sox_signalinfo_t* signal,
+                              const sox_encodinginfo_t* encoding, const char* filetype) {
+    SoxFormatLock lock;
+    return sox_open_mem_write(buffer, size, signal, encoding, filetype, nullptr);
+}
+
+sox_format_t* soxOpenMemstreamWrite(char** buffer, size_t* size, const sox_signalinfo_t* signal,
+                                    const sox_encodinginfo_t* encoding, const char* filetype) {
+    SoxFormatLock lock;
+    return sox_open_memstream_write(buffer, size, signal, encoding, filetype, nullptr);
+}
+
+int soxClose(sox_format_t* format) {
+    SoxFormatLock lock;
+    return sox_close(format);
+}
+
+static bool usesSharedDsp(const sox_effects_chain_t* chain) {
+    for (size_t i = 0; i < chain->length; i++) {
+        const char* name = chain->effects[i][0].handler.name;
+        for (const char* shared : kSharedDspEffects) {
+            if (strcmp(name, shared) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+int soxFlowEffects(sox_effects_chain_t* chain) {
+    if (soxThreadSafeDsp || !usesSharedDsp(chain))
+        return sox_flow_effects(chain, nullptr, nullptr);
+    std::lock_guard<std::mutex> lock(soxDspMutex);
+    return sox_flow_effects(chain, nullptr, nullptr);
+}
+
+WorkerContext& WorkerContext::current() {
+    static thread_local WorkerContext context;
+    return context;
+}
+
+WorkerContext::WorkerContext() : id_(nextWorkerId++) {
+    initSox();
+    VLOG(1) << "WorkerContext " << id_ << " created";
+}
+
+std::shared_ptr<const EffectChain> WorkerContext::effectChain(const std::string& sox) {
+    auto found = effectIndex_.find(sox);
+    if (found != effectIndex_.end()) {
+        effectList_.splice(effectList_.begin(), effectList_, found->second);
+        return found->second->second;
+    }
+    std::shared_ptr<const EffectChain> chain = compileEffectChain(sox);
+    effectList_.emplace_front(sox, chain);
+    effectIndex_[sox] = effectList_.begin();
+    if (effectList_.size() > kEffectCacheSize) {
+        effectIndex_.erase(effectList_.back().first);
+        effectList_.pop_back();
+    }
+    return chain;
+}
+
+}
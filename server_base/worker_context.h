@@ -0,0 +1,97 @@
+#ifndef SERVICE_BASE_WORKER_CONTEXT_H_
+#define SERVICE_BASE_WORKER_CONTEXT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "sox.h"
+#include "server_base/audio_encoder.h"
+#include "server_base/effect_chain.h"
+#include "server_base/section_processor.h"
+
+namespace WL::Service::Base {
+
+/**
+ * 进程内只初始化一次sox，多次调用和多个线程同时调用都是安全的
+ * sox_init和sox_quit成对重复调用之后，再次打开mp3的memstream会崩溃，所以只在退出时调用shutdownSox
+ *
+ * @return sox_init是否成功
+ */
+bool initSox();
+void shutdownSox();
+
+/**
+ * sox的格式打开和关闭不是线程安全的：格式查找使用全局表，mp3等格式在打开时加载和初始化lame、mad的全局数据。
+ * 持有SoxFormatLock期间调用sox_open_*和sox_close，效果链的处理通过soxFlowEffects调用
+ */
+class SoxFormatLock {
+public:
+    SoxFormatLock();
+    SoxFormatLock(const SoxFormatLock&) = delete;
+    SoxFormatLock& operator=(const SoxFormatLock&) = delete;
+
+private:
+    std::lock_guard<std::mutex> lock_;
+};
+
+// 在SoxFormatLock中打开和关闭格式，参数和sox相同
+sox_format_t* soxOpenMemRead(const void* buffer, size_t size, const char* filetype);
+sox_format_t* soxOpenMemWrite(void* buffer, size_t size, const sox_signalinfo_t* signal,
+                              const sox_encodinginfo_t* encoding, const char* filetype);
+sox_format_t* soxOpenMemstreamWrite(char** buffer, size_t* size, const sox_signalinfo_t* signal,
+                                    const sox_encodinginfo_t* encoding, const char* filetype);
+int soxClose(sox_format_t* format);
+
+/**
+ * 代替sox_flow_effects
+ * rate、sinc等效果使用effects_i_dsp.c中进程共享的FFT缓存，libsox没有以OpenMP编译时缓存的重新分配不加锁，
+ * 这时包含这些效果的效果链在同一个锁中处理，其他效果链仍然并行处理。
+ * lsx_warn等日志函数会写sox_globals.subsystem，只影响日志中的文件名，不加锁
+ */
+int soxFlowEffects(sox_effects_chain_t* chain);
+
+/**
+ * 每个处理线程(gRPC的handler线程)独立的后处理上下文，通过current()取得，不在线程之间共用
+ *
+ * 每个线程第一次调用current()时创建，同时初始化sox。效果链先在线程内的缓存中查找，命中时不需要竞争全局缓存的锁；
+ * SectionProcessor在同一个线程的请求之间复用，保留已经分配的缓存；
+ * 编码器池保存reset之后的mp3、flac、amr-nb编码器，请求中不需要重新创建编码器
+ */
+class WorkerContext {
+public:
+    static const size_t kEffectCacheSize = 32;
+
+    // 当前线程的上下文
+    static WorkerContext& current();
+
+    WorkerContext(const WorkerContext&) = delete;
+    WorkerContext& operator=(const WorkerContext&) = delete;
+
+    // 线程的编号，用于日志
+    int id() const { return id_; }
+
+    // 和compileEffectChain相同，结果缓存在当前线程中
+    std::shared_ptr<const EffectChain> effectChain(const std::string& sox);
+
+    SectionProcessor& sectionProcessor() { return sectionProcessor_; }
+
+    EncoderPool& encoderPool() { return encoderPool_; }
+
+private:
+    WorkerContext();
+
+    int id_;
+    SectionProcessor sectionProcessor_;
+    EncoderPool encoderPool_;
+    // 最近使用的在前面
+    std::list<std::pair<std::string, std::shared_ptr<const EffectChain>>> effectList_;
+    std::unordered_map<std::string, decltype(effectList_)::iterator> effectIndex_;
+};
+
+}
+#endif
@@ -0,0 +1,206 @@
+#include "glog/logging.h"
+#include "server_base/wsola.h"
+#include "server_base/sample_utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace WL::Service::Base {
+
+Wsola::Wsola(float tempo, int sampleRate, int channels)
+        : tempo_(tempo),
+          channels_(channels) {
+    // 帧长20ms，搜索范围前后6ms，覆盖80Hz以上的基音周期
+    frameLen_ = std::max(sampleRate / 50 / 2 * 2, 32);
+    hop_ = frameLen_ / 2;
+    tolerance_ = std::max(sampleRate * 6 / 1000, 1);
+    // 周期Hann窗，50%重叠时相加恒为1
+    window_.resize(frameLen_);
+    for (int i = 0; i < frameLen_; i++) {
+        window_[i] = float(0.5 - 0.5 * std::cos(2.0 * M_PI * i / frameLen_));
+    }
+    planes_.resize(channels_);
+    reset();
+}
+
+void Wsola::reset() {
+    in_.assign(channels_, std::vector<float>());
+    mix_.clear();
+    inOffset_ = 0;
+    inTotal_ = 0;
+    acc_.assign(channels_, std::vector<float>(frameLen_, 0.0f));
+    out_.clear();
+    frameIndex_ = 0;
+    prevFrame_ = 0;
+    outTotal_ = 0;
+    outLimit_ = INT64_MAX;
+    anchorIn_ = 0.0;
+    anchorFrame_ = 0;
+    outPosition_ = 0.0;
+}
+
+void Wsola::setTempo(float tempo) {
+    // 从下一帧开始按照新的速度推进
+    anchorIn_ += double(frameIndex_ - anchorFrame_) * hop_ * tempo_;
+    anchorFrame_ = frameIndex_;
+    tempo_ = tempo;
+}
+
+int64_t Wsola::frameCenter(int64_t frameIndex) const {
+    return std::llround(anchorIn_ + double(frameIndex - anchorFrame_) * hop_ * tempo_);
+}
+
+float* const* Wsola::appendInput(size_t nbFrames) {
+    size_t oldSize = in_[0].size();
+    for (int c = 0; c < channels_; c++) {
+        in_[c].resize(oldSize + nbFrames, 0.0f);
+        planes_[c] = in_[c].data() + oldSize;
+    }
+    inTotal_ += int64_t(nbFrames);
+    return planes_.data();
+}
+
+void Wsola::push(const float* samples, size_t nbFrames) {
+    size_t oldSize = in_[0].size();
+    deinterleave(samples, appendInput(nbFrames), channels_, nbFrames);
+    outPosition_ += double(nbFrames) / tempo_;
+    if (channels_ > 1) {
+        mix_.resize(oldSize + nbFrames);
+        std::copy(in_[0].begin() + oldSize, in_[0].end(), mix_.begin() + oldSize);
+        for (int c = 1; c < channels_; c++) {
+            for (size_t i = oldSize; i < oldSize + nbFrames; i++) {
+                mix_[i] += in_[c][i];
+            }
+        }
+    }
+    process();
+}
+
+size_t Wsola::pull(std::vector<float>& out) {
+    size_t count = out_.size() / channels_;
+    out.insert(out.end(), out_.begin(), out_.end());
+    out_.clear();
+    return count;
+}
+
+void Wsola::finish() {
+    if (outLimit_ != INT64_MAX)
+        return;
+    outLimit_ = std::llround(outPosition_);
+    // 补零把最后几帧推出来
+    auto silence = size_t(frameLen_ + size_t(hop_ * tempo_));
+    while (outTotal_ < outLimit_) {
+        appendInput(silence);
+        if (channels_ > 1)
+            mix_.resize(in_[0].size(), 0.0f);
+        process();
+    }
+}
+
+int64_t Wsola::searchBest(int64_t searchBegin, int64_t searchEnd) const {
+    // 上一帧的自然延续作为参考
+    const int overlap = frameLen_ - hop_;
+    const float* search = channels_ > 1 ? mix_.data() : in_[0].data();
+    const float* ref = search + (prevFrame_ + hop_ - inOffset_);
+    const float* cand = search + (searchBegin - inOffset_);
+    int64_t count = searchEnd - searchBegin + 1;
+
+    float energy = dotProduct(cand, cand, overlap);
+    float bestScore = -INFINITY;
+    int64_t best = 0;
+    for (int64_t d = 0; d < count; d++) {
+        float corr = dotProduct(ref, cand + d, overlap);
+        float score = corr / std::sqrt(std::max(energy, 0.0f) + 1e-9f);
+        if (score > bestScore) {
+            bestScore = score;
+            best = d;
+        }
+        // 滑动更新候选帧的能量
+        energy += cand[d + overlap] * cand[d + overlap] - cand[d] * cand[d];
+    }
+    return searchBegin + best;
+}
+
+void Wsola::overlapAdd(int64_t frameBegin) {
+    for (int c = 0; c < channels_; c++) {
+        const float* frame = in_[c].data() + (frameBegin - inOffset_);
+        float* acc = acc_[c].data();
+        int i = 0;
+        if (frameIndex_ == 0) {
+            // 第一帧前面没有可以重叠的数据，前半部分直接复制
+            for (; i < hop_; i++) {
+                acc[i] += frame[i];
+            }
+        }
+        for (; i < frameLen_; i++) {
+            acc[i] += frame[i] * window_[i];
+        }
+    }
+}
+
+void Wsola::emit(size_t nbFrames) {
+    if (outTotal_ >= outLimit_)
+        return;
+    auto count = size_t(std::min<int64_t>(int64_t(nbFrames), outLimit_ - outTotal_));
+    for (int c = 0; c < channels_; c++) {
+        planes_[c] = acc_[c].data();
+    }
+    size_t oldSize = out_.size();
+    out_.resize(oldSize + count * channels_);
+    interleave(planes_.data(), out_.data() + oldSize, channels_, count);
+    outTotal_ += int64_t(count);
+}
+
+void Wsola::process() {
+    while (true) {
+        auto center = frameCenter(frameIndex_);
+        int64_t searchBegin = center;
+        int64_t searchEnd = center;
+        if (frameIndex_ > 0) {
+            searchBegin = std::max(center - tolerance_, inOffset_);
+            searchEnd = center + tolerance_;
+        }
+        // 搜索范围内的所有候选帧都需要完整的数据
+        if (searchEnd + frameLen_ > inTotal_)
+            break;
+
+        int64_t frameBegin = frameIndex_ > 0 ? searchBest(searchBegin, searchEnd) : center;
+        overlapAdd(frameBegin);
+
+        // 前hop_个采样已经不会再有其他帧叠加
+        emit(hop_);
+        for (auto& acc : acc_) {
+            std::memmove(acc.data(), acc.data() + hop_, (frameLen_ - hop_) * sizeof(float));
+            std::fill(acc.begin() + (frameLen_ - hop_), acc.end(), 0.0f);
+        }
+
+        prevFrame_ = frameBegin;
+        frameIndex_++;
+
+        // 丢掉之后不会再访问的输入
+        auto nextCenter = frameCenter(frameIndex_);
+        int64_t keep = std::min(prevFrame_ + hop_, nextCenter - tolerance_);
+        if (keep - inOffset_ > 4096) {
+            for (auto& in : in_) {
+                in.erase(in.begin(), in.begin() + (keep - inOffset_));
+            }
+            if (channels_ > 1)
+                mix_.erase(mix_.begin(), mix_.begin() + (keep - inOffset_));
+            inOffset_ = keep;
+        }
+    }
+}
+
+bool wsolaTimeStretch(const void* srcData,
+                      size_t srcSize,
+                      void** destData,
+                      size_t& destSize,
+                      float tempo,
+                      int64_t channelLayout,
+                      int sampleRate,
+                      AVSampleFormat sampleFormat) {
+    WsolaStretcher stretcher(tempo, channelLayout, sampleRate, sampleFormat);
+    return stretchBuffer(stretcher, srcData, srcSize, destData, destSize);
+}
+
+}
@@ -0,0 +1,103 @@
+#ifndef SERVICE_BASE_WSOLA_H_
+#define SERVICE_BASE_WSOLA_H_
+
+#include <cstdint>
+#include <vector>
+#include "server_base/float_stretcher.h"
+
+namespace WL::Service::Base {
+
+/**
+ * WSOLA(waveform-similarity overlap-add)变速，针对语音
+ *
+ * 每一帧长度为20ms，使用Hann窗50%重叠相加。第k帧在输入中的理想位置为k * hop * tempo，
+ * 在理想位置前后tolerance范围内搜索和上一帧自然延续最相似的位置，
+ * 相似度为归一化的互相关，互相关在支持AVX2的CPU上使用向量化实现。
+ *
+ * 多声道数据使用所有声道之和搜索，所有声道使用相同的帧位置，声道之间不会错位。
+ * 只处理float数据，整个过程不依赖libavfilter
+ */
+class Wsola {
+public:
+    static constexpr float kMinTempo = 0.5f;
+    static constexpr float kMaxTempo = 100.0f;
+
+    Wsola(float tempo, int sampleRate = 16000, int channels = 1);
+
+    float tempo() const { return tempo_; }
+
+    // 修改之后送入数据的速度，之后的帧从当前位置开始按照新的速度推进
+    void setTempo(float tempo);
+
+    // 送入交错的数据，nbFrames为每个声道的采样数
+    void push(const float* samples, size_t nbFrames);
+
+    // 取出目前可用的交错数据，追加到out的末尾，返回每个声道的采样数
+    size_t pull(std::vector<float>& out);
+
+    // 冲刷缓存，输出总长度为输入总长度 / tempo
+    void finish();
+
+    // 一帧加上搜索范围
+    int64_t latency() const { return frameLen_ + tolerance_; }
+
+    // 回到初始状态，可以处理新的一段音频
+    void reset();
+
+private:
+    // 每个声道的输入缓存末尾增加nbFrames个采样，返回新增部分的地址
+    float* const* appendInput(size_t nbFrames);
+    // 第frameIndex帧在输入中的理想位置
+    int64_t frameCenter(int64_t frameIndex) const;
+    void process();
+    int64_t searchBest(int64_t searchBegin, int64_t searchEnd) const;
+    void overlapAdd(int64_t frameBegin);
+    void emit(size_t nbFrames);
+
+    float tempo_;
+    int channels_;
+    int frameLen_;
+    int hop_;
+    int tolerance_;
+    // 预先计算的Hann窗
+    std::vector<float> window_;
+    // 每个声道的输入缓存，in_[c][0]对应输入的第inOffset_个采样
+    std::vector<std::vector<float>> in_;
+    // 多声道时所有声道之和，用于搜索
+    std::vector<float> mix_;
+    int64_t inOffset_ = 0;
+    int64_t inTotal_ = 0;
+    // 每个声道的重叠相加缓存，长度为frameLen_
+    std::vector<std::vector<float>> acc_;
+    // 交错的输出
+    std::vector<float> out_;
+    std::vector<float*> planes_;
+    int64_t frameIndex_ = 0;
+    int64_t prevFrame_ = 0;
+    // 第anchorFrame_帧在输入中的理想位置为anchorIn_，之后每帧前进hop_ * tempo_
+    double anchorIn_ = 0.0;
+    int64_t anchorFrame_ = 0;
+    // 已经送入的数据对应的理想输出长度
+    double outPosition_ = 0.0;
+    int64_t outTotal_ = 0;
+    int64_t outLimit_ = INT64_MAX;
+};
+
+// WSOLA变速器，支持s16和flt格式的交错数据
+using WsolaStretcher = FloatStretcher<Wsola>;
+
+/**
+ * 使用WSOLA对音频进行变速处理，参数和timeStretch相同
+ * 采样格式为AV_SAMPLE_FMT_S16或者AV_SAMPLE_FMT_FLT
+ */
+bool wsolaTimeStretch(const void* srcData,
+                      size_t srcSize,
+                      void** destData,
+                      size_t& destSize,
+                      float tempo = 1.0,
+                      int64_t channelLayout = AV_CH_LAYOUT_MONO,
+                      int sampleRate = 16000,
+                      AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16);
+
+}
+#endif
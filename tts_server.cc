@@ -5,16 +5,8 @@
 #include <iostream>
 #include <memory>
 #include <cstdlib>
-
-extern "C" {
-#include <libavformat/avformat.h>
-#include <libavfilter/avfilter.h>
-#include <libavfilter/buffersink.h>
-#include <libavfilter/buffersrc.h>
-#include <libavutil/channel_layout.h>
-#include <libavutil/samplefmt.h>
-#include <libavutil/opt.h>
-}
+#include <strings.h>
+#include <vector>
 
 #include <sox.h>
 #include "glog/logging.h"
@@ -26,9 +18,19 @@ extern "C" {
 #include "tts/synth/synth.h"
 #include "tts/synth/synth_types.pb.h"
 #include "tts/base/audio_utils.h"
+#include "tts/base/audio_buffer.h"
+#include "tts/base/audio_encoder.h"
 #include "tts/base/align_utils.h"
+#include "tts/base/parallel_stretch.h"
+#include "tts/base/stretcher.h"
+#include "tts/base/tempo_map.h"
+#include "tts/base/worker_context.h"
 
 DEFINE_string(address, "0.0.0.0:8080", "service address");
+DEFINE_string(stretch_engine, "atempo", "time stretch engine, atempo, wsola, vocoder or auto");
+DEFINE_bool(stretch_skip_silence, false, "resize silent runs directly instead of passing them through the stretch engine");
+DEFINE_int32(stretch_threads, 0, "threads for stretching long audio in parallel, 0 for hardware concurrency, 1 to disable");
+DEFINE_bool(stretch_low_latency, false, "bound the stretch lookahead window and skip silence buffering for conversational streaming");
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -38,309 +40,14 @@ using grpc::Status;
 using synth::Synth;
 using synth::TTSOption;
 
-/**
- * 对音频进行变速处理
- *
- * @param srcData 原始数据
- * @param srcSize 原始数据大小，byte为单位
- * @param destData [out] 目标数据，需要调用者管理分配的内存
- * @param destSize [out] 目标数据大小，byte为单位
- * @param tempo 变速大小，范围为[0.5, 100.0]
- * @param channelCount 原始数据声道数
- * @param sampleRate 原始数据采样率
- * @param sampleFormat 原始数据采样率
- * @return 是否变速成功
- */
-bool timeStretch(const void* srcData,
-                 size_t srcSize,
-                 void** destData,
-                 size_t& destSize,
-                 float tempo = 1.0,
-                 int64_t channelLayout = AV_CH_LAYOUT_MONO,
-                 int sampleRate = 16000,
-                 AVSampleFormat sampleFormat = AV_SAMPLE_FMT_S16) {
-    // Set up the filter graph.
-    // The filter chain it uses is:
-    // (input) -> abuffer -> atempo -> aformat -> abuffersink -> (output)
-    // abuffer: This provides the endpoint where you can feed the decoded samples.
-    // atempo: The filter accepts exactly one parameter, the audio tempo.
-    // If not specified then the filter will assume nominal 1.0 tempo.
-    // Tempo must be in the [0.5, 100.0] range.
-    // aformat: This converts the samples to the sample freq, channel layout,
-    // and sample format required by the audio device.
-    // abuffersink: This provides the endpoint where you can read the samples after
-    // they have passed through the filter chain.
-    if (tempo < 0.5 || tempo > 100) {
-        LOG(ERROR) << "Invalid tempo param, tempo " << tempo;
-        return false;
-    }
-    AVFilterGraph* filterGraph = nullptr;
-    const AVFilter* abuffer;
-    AVFilterContext* abufferCtx = nullptr;
-    const AVFilter* atempo;
-    AVFilterContext* atempoCtx = nullptr;
-    const AVFilter* aformat;
-    AVFilterContext* aformatCtx = nullptr;
-    const AVFilter* abuffersink;
-    AVFilterContext* abuffersinkCtx = nullptr;
-
-    auto clearFFmpegFilters = [&abufferCtx, &atempoCtx,
-            &aformatCtx, &abuffersinkCtx, &filterGraph]() ->void {
-        if (abufferCtx)
-            avfilter_free(abufferCtx);
-        if (atempoCtx)
-            avfilter_free(atempoCtx);
-        if (aformatCtx)
-            avfilter_free(aformatCtx);
-        if (abuffersinkCtx)
-            avfilter_free(abuffersinkCtx);
-        if (filterGraph) {
-            avfilter_graph_free(&filterGraph);
-        }
-    };
-
-    // Create a new filter graph, which will contain all the filters.
-    filterGraph = avfilter_graph_alloc();
-    if (!filterGraph) {
-        LOG(ERROR) << "Unable to create filter graph";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Create the abuffer filter;
-    // it will be used for feeding the data into the graph.
-    abuffer = avfilter_get_by_name("abuffer");
-    if (!abuffer) {
-        LOG(ERROR) << "Could not find the abuffer filter";
-        clearFFmpegFilters();
-        return false;
-    }
-    abufferCtx = avfilter_graph_alloc_filter(filterGraph, abuffer, "src");
-    if (!abufferCtx) {
-        LOG(ERROR) << "Could not allocate the abuffer instance";
-        clearFFmpegFilters();
-        return false;
-    }
-    // Set the filter options through the AVOptions API.
-    char chLayoutStr[64];
-    av_get_channel_layout_string(chLayoutStr,
-                                 sizeof(chLayoutStr),
-                                 av_get_channel_layout_nb_channels(channelLayout),
-                                 channelLayout);
-    av_opt_set(abufferCtx, "channel_layout", chLayoutStr, AV_OPT_SEARCH_CHILDREN);
-    av_opt_set(abufferCtx,
-               "sample_fmt",
-               av_get_sample_fmt_name(sampleFormat),
-               AV_OPT_SEARCH_CHILDREN);
-    av_opt_set_q(abufferCtx,
-                 "time_base",
-                 (AVRational) {1, sampleRate},
-                 AV_OPT_SEARCH_CHILDREN);
-    av_opt_set_int(abufferCtx, "sample_rate", sampleRate, AV_OPT_SEARCH_CHILDREN);
-    // Now initialize the filter; we pass NULL options, since we have already
-    // set all the options above.
-    int err = avfilter_init_str(abufferCtx, nullptr);
-    if (err < 0) {
-        LOG(ERROR) << "Could not initialize the abuffer filter";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Create atempo filter
-    atempo = avfilter_get_by_name("atempo");
-    if (!atempo) {
-        LOG(ERROR) << "Could not find the atempo filter";
-        clearFFmpegFilters();
-        return false;
-    }
-    atempoCtx = avfilter_graph_alloc_filter(filterGraph, atempo, "atempo");
-    if (!atempoCtx) {
-        LOG(ERROR) << "Could not allocate the atempo instance";
-        clearFFmpegFilters();
-        return false;
-    }
-    // A different way of passing the options is as key/value pairs in a dictionary.
-    AVDictionary* optionsDict = nullptr;
-    av_dict_set(&optionsDict, "tempo", std::to_string(tempo).c_str(), 0);
-    err = avfilter_init_dict(atempoCtx, &optionsDict);
-    av_dict_free(&optionsDict);
-    if (err < 0) {
-        LOG(ERROR) << "Could not initialize the atempo filter";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Create the aformat filter.
-    // It ensures that the output is of the format we want.
-    aformat = avfilter_get_by_name("aformat");
-    if (!aformat) {
-        LOG(ERROR) << "Could not find the aformat filter";
-        clearFFmpegFilters();
-        return false;
-    }
-    aformatCtx = avfilter_graph_alloc_filter(filterGraph, aformat, "aformat");
-    if (!aformatCtx) {
-        LOG(ERROR) << "Could not allocate the aformat instance";
-        clearFFmpegFilters();
-        return false;
-    }
-    // A third way of passing the options is in a string of the form
-    // key1=value1:key2=value2...
-    uint8_t optionsStr[1024];
-    // 指定输出为单声道
-    snprintf((char*) optionsStr, sizeof(optionsStr),
-             "sample_fmts=%s:sample_rates=%d:channel_layouts=mono",
-             av_get_sample_fmt_name(sampleFormat), sampleRate);
-    err = avfilter_init_str(aformatCtx, (char*) optionsStr);
-    if (err < 0) {
-        LOG(ERROR) << "Could not initialize the aformat filter";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Finally, create the abuffersink filter;
-    // it will be used to get the filtered data out of the graph.
-    abuffersink = avfilter_get_by_name("abuffersink");
-    if (!abuffersink) {
-        LOG(ERROR) << "Could not find the abuffersink filter";
-        clearFFmpegFilters();
-        return false;
-    }
-    abuffersinkCtx = avfilter_graph_alloc_filter(filterGraph, abuffersink, "sink");
-    if (!abuffersinkCtx) {
-        LOG(ERROR) << "Could not allocate the abuffersink instance";
-        clearFFmpegFilters();
-        return false;
-    }
-    // This filter takes no options.
-    err = avfilter_init_str(abuffersinkCtx, nullptr);
-    if (err < 0) {
-        LOG(ERROR) << "Could not initialize the abuffersink instance";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Connect the filters;
-    // in this simple case the filters just form a linear chain.
-    err = avfilter_link(abufferCtx, 0, atempoCtx, 0);
-    if (err >= 0)
-        err = avfilter_link(atempoCtx, 0, aformatCtx, 0);
-    else {
-        LOG(ERROR) << "Error connecting filters";
-        clearFFmpegFilters();
-        return false;
-    }
-    if (err >= 0)
-        err = avfilter_link(aformatCtx, 0, abuffersinkCtx, 0);
-    if (err < 0) {
-        LOG(ERROR) << "Error connecting filters";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Configure the graph.
-    err = avfilter_graph_config(filterGraph, nullptr);
-    if (err < 0) {
-        LOG(ERROR) << "Error configuring the filter graph";
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // 分配内存存储生成的数据，比实际需要的要大
-    // 没有使用vector的目的是避免频繁分配
-    auto tempDestSize = int(float(srcSize) / tempo + 8192);
-    void* tempDestData = calloc(tempDestSize, sizeof(uint8_t));
-    if (!tempDestData) {
-        LOG(ERROR) << "Error allocating buffer";
-        // 释放结构体
-        clearFFmpegFilters();
-        return false;
-    }
-
-    // Allocate the frame we will be using to store the data.
-    AVFrame* frame = av_frame_alloc();
-    if (!frame) {
-        LOG(ERROR) << "Error allocating the frame";
-        free(tempDestData);
-        clearFFmpegFilters();
-        return false;
-    }
-
-    int srcIndex = 0; // 记录目前处理过的原始数据下标，以byte为单位
-    int destIndex = 0; // 记录目前生成的目标数据下标，以byte为单位
-    int bytesPerSample = av_get_bytes_per_sample(sampleFormat);
-
-    // 避免代码重复
-    auto consumeFrame = [&abuffersinkCtx, &frame,
-            &destIndex, &tempDestSize, &tempDestData, &bytesPerSample]() ->void {
-        while (av_buffersink_get_frame(abuffersinkCtx, frame) >= 0) {
-            int frameSize = frame->nb_samples * bytesPerSample;
-            // 只处理第0声道的数据
-            if (destIndex + frameSize > tempDestSize) {
-                // 说明内存分配够不大，或者是哪里有问题
-                LOG(WARNING) << "Malloc buffer small";
-                av_frame_unref(frame);
-                break;
-            }
-            memcpy(((char*)tempDestData) + destIndex, frame->extended_data[0], frameSize);
-            destIndex += frameSize;
-            av_frame_unref(frame);
-        }
-    };
-
-    bool flushed = false;
-    while (srcIndex < srcSize && !flushed) {
-        frame->sample_rate = sampleRate;
-        frame->format = sampleFormat;
-        frame->channel_layout = channelLayout;
-        frame->channels = 1;
-        frame->nb_samples = 1024;
-        // 存在srcSize - srcIndex < frame->nb_samples * bytesPerSamples的情况
-        if (srcSize - srcIndex < frame->nb_samples * bytesPerSample) {
-            flushed = true;
-            int samplesLeft = int(srcSize - srcIndex) / bytesPerSample;
-            frame->nb_samples = samplesLeft;
-        }
-        err = av_frame_get_buffer(frame, 0);
-        if (err < 0) {
-            LOG(ERROR) << "Error frame get buffer";
-            free(tempDestData);
-            av_frame_free(&frame);
-            clearFFmpegFilters();
-            return false;
-        }
-
-        // 将数据复制进入frame中
-        memcpy(frame->extended_data[0],
-               ((char*)srcData) + srcIndex,
-               frame->nb_samples * bytesPerSample);
-        srcIndex += frame->nb_samples * bytesPerSample;
-
-        // Send the frame to the input of the filter graph.
-        err = av_buffersrc_add_frame(abufferCtx, frame);
-        if (err < 0) {
-            av_frame_unref(frame);
-            LOG(ERROR) << "Error submitting the frame to the filter graph";
-            continue;
-        }
-
-        // Get all the filtered output that is available.
-        consumeFrame();
-    }
-
-    // flush
-    err = av_buffersrc_add_frame(abufferCtx, nullptr);
-    if (err >= 0) {
-        consumeFrame();
-    }
-
-    (*destData) = tempDestData;
-    destSize = destIndex;
-
-    clearFFmpegFilters();
-    av_frame_free(&frame);
-    return true;
-}
+using WL::Service::Base::AudioBuffer;
+using WL::Service::Base::AudioEncoder;
+using WL::Service::Base::TempoMap;
+using WL::Service::Base::TempoMapStretcher;
+using WL::Service::Base::createTempoMapStretcher;
+using WL::Service::Base::extractTempoMap;
+using WL::Service::Base::remapStreamSoxList;
+using WL::Service::Base::WorkerContext;
 
 void fill_response(server::TTSResponse *response, snd_file &out_snd, std::string speaker, std::string phones, std::string text, std::string filetype, std::string lipsync, std::string cachetype, const void* meldata=NULL, size_t melsize=0)
 {
@@ -387,10 +94,71 @@ void fill_response(server::TTSResponse *response, snd_file &out_snd, std::string
     response->set_cachetype(cachetype);
 }
 
+// 流式请求的上下文，整个流的生命周期中保持变速状态
+struct StreamContext
+{
+    ::grpc::ServerWriter<::server::TTSResponse>* writer;
+    ServerContext *server;
+    std::unique_ptr<TempoMapStretcher> stretcher;
+    // 第一个应答之前通过initial metadata告诉客户端变速的算法延迟
+    bool started = false;
+    // mp3和flac在整个流中使用同一个编码器，分片之间连续编码，文件头和编码器的起始延迟只有一次
+    std::unique_ptr<AudioEncoder> encoder;
+    // 编码器或者wav的文件头已经输出
+    bool headerWritten = false;
+    // 编码失败之后已经发出的数据无法继续，之后的分片都不再处理，请求返回错误
+    bool failed = false;
+};
+
+// 分片的16k裸数据交给流的编码器，out_snd换成编码器目前输出的完整帧
+static bool encode_stream_chunk(StreamContext *stream, snd_file &out_snd, const void *pcm, bool islast)
+{
+    AudioBuffer encoded(out_snd.size / 4 + 4096);
+    bool ok = true;
+    if (!stream->headerWritten)
+    {
+        ok = stream->encoder->begin(encoded);
+        stream->headerWritten = true;
+    }
+    const char *raw = (const char *)out_snd.buffer + out_snd.offset;
+    ok = ok && stream->encoder->encode((const int16_t *)raw, out_snd.size / 2, encoded);
+    if (ok && islast)
+    {
+        ok = stream->encoder->finish(encoded);
+    }
+    if (out_snd.buffer != pcm && out_snd.size > 0)
+    {
+        free(out_snd.buffer);
+    }
+    out_snd.buffer = NULL;
+    out_snd.offset = 0;
+    out_snd.size = 0;
+    if (!ok || encoded.failed())
+    {
+        LOG(ERROR) << "stream encode " << stream->encoder->filetype() << " failed";
+        stream->encoder.reset();
+        stream->failed = true;
+        return false;
+    }
+    size_t size = 0;
+    out_snd.buffer = encoded.empty() ? (void*)"" : encoded.release(size);
+    out_snd.size = size;
+    if (islast)
+    {
+        WorkerContext::current().encoderPool().release(std::move(stream->encoder));
+    }
+    return out_snd.buffer != NULL;
+}
+
 size_t gRPCServerWriter_Callback(const void *data, size_t size, void *context, std::string speaker, std::string phones, std::string text, std::string filetype, std::vector<std::tuple<std::string, int, int>> sox, std::string lipsync, bool islast, std::string cachetype, const void* meldata, size_t melsize)
 {
-    if (data == NULL || size==0 || context == NULL)
+    if (context == NULL || ((StreamContext *)context)->failed)
+        return 0;
+    // 最后一个分片即使没有数据也要冲刷变速器和编码器，输出缓存的尾部和编码器的结尾
+    if ((data == NULL || size==0) && !islast)
         return 0;
+    if (data == NULL)
+        size = 0;
     server::TTSResponse response;
     /*
     if (sox.size() > 0) 
@@ -425,50 +193,134 @@ size_t gRPCServerWriter_Callback(const void *data, size_t size, void *context, s
     free(buffer);
     */
 
-    void* destData = nullptr;
-    size_t destSize = 0;
-    // 只处理存在一个atempo的情况
-    bool success = false;
-    for (int i = 0; i < sox.size(); i++) {
-        std::string effect = std::get<0>(sox[i]);
-        if (effect.find("tempo") != std::string::npos) {
-            size_t equal_pos = effect.find('=');
-            if (equal_pos != std::string::npos) {
-                std::string param = effect.substr(equal_pos + 1);   // 跳过等号
-                float tempo = std::stof(param);
-                // 进行变速处理
-                if (timeStretch(data, size, &destData, destSize, tempo)) {
-                    success = true;
-                    sox.erase(sox.begin() + i);
+    StreamContext *stream = (StreamContext *)context;
+    if (!stream->started && !stream->encoder && AudioEncoder::supports(filetype))
+    {
+        stream->encoder = WorkerContext::current().encoderPool().acquire(filetype);
+        if (stream->encoder && stream->encoder->sampleRate() != 16000)
+        {
+            WorkerContext::current().encoderPool().release(std::move(stream->encoder));
+        }
+    }
+    // 使用流的编码器时分片先处理为裸数据；wav只在第一个应答中输出一次文件头，之后都是裸数据
+    bool wavstream = filetype.empty() || strcasecmp(filetype.c_str(), "wav") == 0;
+    std::string outtype = (stream->encoder || wavstream) ? "raw" : filetype;
+    // tempo=1.0这样不起作用的效果不需要建立变速器和效果链
+    WL::Service::Base::normalize_sox_list(sox);
+    // 每一段的tempo组成速度表，整个流共用一个变速器，段之间和分片之间都不需要重建和冲刷
+    std::vector<uint8_t> stretched;
+    const void* pcm = data;
+    size_t pcmsize = size;
+    std::vector<std::tuple<std::string, int, int>> sections = sox;
+    TempoMap map;
+    std::vector<std::string> applied;
+    bool hastempo = extractTempoMap(sections, map, applied);
+    snd_file out_snd = { NULL, 0 };
+    bool fused = false;
+    if (hastempo || stream->stretcher) {
+        // 开始变速之后的分片即使没有tempo也继续经过变速器，速度平滑地回到1.0
+        if (!hastempo)
+            map.add(0, 1.0f);
+        if (!stream->stretcher)
+            stream->stretcher = createTempoMapStretcher(FLAGS_stretch_engine, map);
+        else if (size > 0)
+            stream->stretcher->setTempoMap(map);
+        // 单段时变速器直接作为sox效果链的输入，变速结果不经过中间缓存
+        if (stream->stretcher && sections.size() <= 1
+            && (sections.empty() || std::get<0>(sections[0]).compare(0, 4, "pad=") != 0)) {
+            // 低延迟模式下第一个分片先只送入两个窗口的数据，窗口填满有了输出就立即发出，
+            // 不需要等整个分片处理完，文本等信息和剩下的数据一起在之后的应答中返回
+            size_t head = size_t(stream->stretcher->latency()) * 2 * sizeof(int16_t);
+            if (FLAGS_stretch_low_latency && !stream->started && head > 0 && size > head) {
+                // 分段的位置是相对于分片开头的byte偏移，两次调用分别换算到自己的数据中
+                std::vector<std::tuple<std::string, int, int>> headsox = sox;
+                std::vector<std::tuple<std::string, int, int>> restsox = sox;
+                for (size_t i = 0; i < sox.size(); i++)
+                {
+                    std::get<1>(headsox[i]) = std::min(std::get<1>(sox[i]), int(head));
+                    std::get<1>(restsox[i]) = std::max(std::get<1>(sox[i]) - int(head), 0);
                 }
+                gRPCServerWriter_Callback(data, head, context, speaker, "", "", filetype, headsox, "", false, cachetype, NULL, 0);
+                if (stream->failed)
+                    return 0;
+                size_t rest = gRPCServerWriter_Callback((const char *)data + head, size - head, context, speaker, phones, text,
+                                                        filetype, restsox, lipsync, islast, cachetype, meldata, melsize);
+                return rest > 0 ? size : 0;
             }
-            break;
+            out_snd = process_sox_stream(stream->stretcher.get(), sections.empty() ? "" : std::get<0>(sections[0]),
+                                         data, size, outtype.c_str(), islast);
+            fused = true;
+            pcmsize = out_snd.size;
+        }
+        else if (stream->stretcher && stream->stretcher->push(data, size)) {
+            if (islast)
+                stream->stretcher->finish();
+            // 本次的输出包含上一个分片留在变速器中的数据，缺少仍然留在变速器中的数据，按照累计的位置换算分段
+            int64_t pulledBefore = stream->stretcher->pulledFrames();
+            stream->stretcher->pull(stretched);
+            remapStreamSoxList(sections, *stream->stretcher, pulledBefore, stretched.size());
+            sox.swap(sections);
+            pcm = stretched.data();
+            pcmsize = stretched.size();
         }
     }
 
-    if (success)
-        snd_file out_snd = process_sox_chain_list(sox, destData, destSize, filetype.c_str());
-    else
-        snd_file out_snd = process_sox_chain_list(sox, data, size, filetype.c_str());
-
-    if (destData)
-        free(destData);
+    // 变速器还在缓存数据时本次可能没有输出，仍然需要返回文本等信息
+    if (!fused && pcmsize > 0)
+    {
+        out_snd = process_sox_chain_list(sox, pcm, pcmsize, outtype.c_str());
+    }
+    else if (!fused)
+    {
+        out_snd.buffer = (void*)"";
+        out_snd.offset = 0;
+        out_snd.size = 0;
+        out_snd.timems = 0;
+    }
+    // 编码器缓存不足一帧的数据时本次没有输出，仍然返回文本等信息
+    bool encoded = false;
+    if (stream->encoder && out_snd.buffer != NULL)
+    {
+        encoded = encode_stream_chunk(stream, out_snd, pcm, islast);
+        if (!encoded)
+        {
+            // 之前的分片已经按照这个格式发出，不能换成其他格式继续
+            return 0;
+        }
+    }
 
-    if (out_snd.size > 0 && out_snd.buffer != NULL)
+    if (out_snd.buffer != NULL && (out_snd.size > 0 || pcmsize == 0 || encoded))
     {
         fill_response(&response, out_snd, speaker, phones, text, filetype, lipsync, cachetype, meldata, melsize);
-        if (out_snd.buffer != data)
+        if (out_snd.buffer != pcm && out_snd.size > 0)
         {
             free(out_snd.buffer);
         }
     }
+    if (wavstream && !stream->headerWritten)
+    {
+        // 流的长度未知，客户端可以直接拼接之后的分片
+        char header[44];
+        WL::Service::Base::writeStreamingWAVHeader(header, 16000, 1);
+        response.mutable_data()->insert(0, header, sizeof(header));
+        stream->headerWritten = true;
+    }
+    if (!stream->started)
+    {
+        // 延迟按照16000Hz的采样数换算，客户端据此设置抖动缓冲
+        // 第一个分片可能还没有变速，之后的分片才建立变速器，所以按照配置的引擎计算
+        int64_t latency = WL::Service::Base::stretchLatency(FLAGS_stretch_engine);
+        if (stream->server != NULL)
+            stream->server->AddInitialMetadata("x-stretch-latency-ms", std::to_string(latency * 1000 / 16000));
+        stream->started = true;
+    }
     if (!islast) 
     { 
-        ((::grpc::ServerWriter<::server::TTSResponse>*)context)->Write(response);
+        stream->writer->Write(response);
     } 
     else 
     {
-        ((::grpc::ServerWriter<::server::TTSResponse>*)context)->WriteLast(response, ::grpc::WriteOptions().set_last_message());
+        stream->writer->WriteLast(response, ::grpc::WriteOptions().set_last_message());
     }
     return size;
 }
@@ -514,16 +366,17 @@ size_t gRPCTTSResponse_Callback(const void *data, size_t size, void *context, st
     }
     else
     {
-        snd_file out_snd;
+        // 不起作用的效果被折叠后结果可能直接指向输入，alldata要保留到fill_response之后
+        std::string alldata;
+        const void *in = data;
+        size_t len = size;
         if (response->data().length() > 0)
         {
-            std::string alldata = response->data() + std::string((const char *)data, size);
-            out_snd = process_sox_chain_list(sox, alldata.c_str(), alldata.length(), filetype.c_str());
-        }
-        else
-        {
-            out_snd = process_sox_chain_list(sox, data, size, filetype.c_str());
+            alldata = response->data() + std::string((const char *)data, size);
+            in = alldata.c_str();
+            len = alldata.length();
         }
+        snd_file out_snd = process_sox_chain_list(sox, in, len, filetype.c_str());
         if (out_snd.size > 0 && out_snd.buffer != NULL)
         {
             if (response->meldata().length() > 0)
@@ -535,7 +388,8 @@ size_t gRPCTTSResponse_Callback(const void *data, size_t size, void *context, st
             {
                 fill_response(response, out_snd, speaker, allphones, alltext, filetype, alllipsync, allcachetype, meldata, melsize);
             }
-            if (out_snd.buffer != data)
+            const char *base = (const char *)out_snd.buffer;
+            if (base < (const char *)in || base >= (const char *)in + len)
             {
                 free(out_snd.buffer);
             }
@@ -625,6 +479,8 @@ public:
         return Status::OK;
     }
 
+    // 流式合成，每个分片一个应答。--stretch_low_latency时第一个应答可能只有音频，
+    // phones、text和lipsync为空，这些信息和同一个分片剩下的音频在下一个应答中返回
     Status BackendStream(ServerContext *context, const server::FrontendResponse *request, ::grpc::ServerWriter<::server::TTSResponse>* writer) override 
     {
         TTSOption option;
@@ -650,7 +506,12 @@ public:
         option.set_lipsync(request->lipsync());
         option.set_accumulatelipsync(false);
         option.set_meldata(request->meldata());
-        tts_synth_->BackendStream(option, utt, gRPCServerWriter_Callback, writer);
+        StreamContext stream = { writer, context };
+        tts_synth_->BackendStream(option, utt, gRPCServerWriter_Callback, &stream);
+        if (stream.failed)
+        {
+            return Status(grpc::StatusCode::INTERNAL, "stream encode failed");
+        }
         return Status::OK;
     }
 
@@ -682,6 +543,8 @@ public:
         return Status::OK;
     }
 
+    // 流式合成，每个分片一个应答。--stretch_low_latency时第一个应答可能只有音频，
+    // phones、text和lipsync为空，这些信息和同一个分片剩下的音频在下一个应答中返回
     Status SynthesisStream(ServerContext *context, const server::TTSRequest *request, ::grpc::ServerWriter<::server::TTSResponse>* writer) override 
     {
         TTSOption option;
@@ -701,7 +564,12 @@ public:
         option.set_dialect(request->dialect());
         option.set_meldata(request->meldata());
         
-        tts_synth_->SynthesizeStream(option, gRPCServerWriter_Callback, writer);
+        StreamContext stream = { writer, context };
+        tts_synth_->SynthesizeStream(option, gRPCServerWriter_Callback, &stream);
+        if (stream.failed)
+        {
+            return Status(grpc::StatusCode::INTERNAL, "stream encode failed");
+        }
         return Status::OK;
     }
 
@@ -733,9 +601,18 @@ public:
 
 int main(int argc, char **argv) 
 {
-    sox_init();
+    // 每个handler线程在第一次后处理时建立自己的WorkerContext，sox在这里初始化一次
+    if (!WL::Service::Base::initSox())
+    {
+        return 1;
+    }
     gflags::SetUsageMessage("xiaoice tts engine");
     gflags::ParseCommandLineFlags(&argc, &argv, true);
+    // process_sox_chain_list中的分段变速使用同一个引擎
+    WL::Service::Base::setDefaultStretchEngine(FLAGS_stretch_engine);
+    WL::Service::Base::setStretchThreads(FLAGS_stretch_threads);
+    WL::Service::Base::setSilenceAwareStretch(FLAGS_stretch_skip_silence);
+    WL::Service::Base::setLowLatencyStretch(FLAGS_stretch_low_latency);
 
     TTSServiceImpl service;
     std::string server_address(FLAGS_address);
@@ -746,6 +623,6 @@ int main(int argc, char **argv)
     std::unique_ptr<Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
     server->Wait();
-    sox_quit();
+    WL::Service::Base::shutdownSox();
     return 0;
 }